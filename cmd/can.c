@@ -28,28 +28,260 @@
 #include <stdint.h>	/* for uintN_t types */
 #include <unistd.h>	/* read/write */
 #include <string.h>	/* strcasecmp */
+#include <ctype.h>	/* tolower */
+#include <stdlib.h>	/* malloc */
+#include <fcntl.h>	/* open */
+#include <sys/stat.h>	/* stat */
+#include <sys/mman.h>	/* mmap */
+#include <sys/param.h>	/* MAXPATHLEN */
+#include <sys/time.h>	/* gettimeofday */
+#include <time.h>	/* time */
+#include <errno.h>
+#include <pthread.h>	/* cache_lock */
 #include "can.h"
 
 #define PKTSIZE (sizeof(struct can_packet))
+#define CAN_V2_BATCH	64
 
-static unsigned long nodeid;
-static int initialized = 0;
+/*
+ * Barriers for the mapped ring, as the kernel's mb() and rmb(), which user
+ * space can't include.  SPARC runs TSO, so there (as in the kernel) the 
+ * compiler is all that needs holding back.
+ */
+#if defined(__x86_64__)
+#define ring_mb()	__asm__ __volatile__("mfence" : : : "memory")
+#define ring_rmb()	__asm__ __volatile__("lfence" : : : "memory")
+#elif defined(__i386__)
+#define ring_mb()	__asm__ __volatile__("lock; addl $0,0(%%esp)" \
+			    : : : "memory")
+#define ring_rmb()	ring_mb()
+#elif defined(__sparc__)
+#define ring_mb()	__asm__ __volatile__("" : : : "memory")
+#define ring_rmb()	ring_mb()
+#else
+#define ring_mb()	__sync_synchronize()
+#define ring_rmb()	__sync_synchronize()
+#endif
 
 /*
- * Get the LCAN address of the local host in "packed" format.
- * Unpack with UNPACK_CLUSTER / UNPACK_MODULE / UNPACK_NODE macros.
- * Exit with return value of 1 and issue text error on stderr on failure.
- * This is a helper function for the functions below.
+ * A handle owns an open /dev/can file descriptor, the local address that
+ * goes with it, and its pending transactions.  Nothing else in libcan is 
+ * per-fd, so handles may be used from different threads.  Calls that only 
+ * read the handle - can_send(), can_send_v(), can_ack(), can_recv(), 
+ * can_recv_v(), can_recv_v2(), can_wait(), can_transact(), 
+ * can_transact_v(), can_nodeid() and can_fd() - may be made on one handle
+ * by several threads at once, as cancon does; with a mapped ring, only 
+ * one of them may receive.  The rest - can_map_ring(), can_set_format(), 
+ * can_close() and the can_txn_*() queue - are for one thread at a time.
+ * The canhosts/canobj lookup cache is shared by all handles, under 
+ * cache_lock; it is loaded when the first handle is opened.
  */
-static void
-_initialize(int fd)
+#define CAN_TXN_HASHSIZE	61
+#define CAN_TXN_BATCH		64
+
+struct can_txnq {
+	int		npending;
+	can_txn_t	*hash[CAN_TXN_HASHSIZE];
+	can_txn_t	*done;		/* completed, no callback */
+};
+
+struct can_handle {
+	int		fd;
+	int		flags;		/* open(2) flags */
+	unsigned long	nodeid;		/* packed local LCAN address */
+	struct can_mmap_ring *ring;	/* see can_map_ring() */
+	uint32_t	ring_overruns;	/* ring->overruns, as last reported */
+	int		format;		/* see can_set_format() */
+	struct can_txnq	txnq;
+};
+
+static struct hostdb *_hostdb_init(void);
+static int _objdb_init(void);
+
+/*
+ * Open a CAN device (path NULL means PATH_CAN) and get the LCAN address 
+ * of the local host in "packed" format (unpack with UNPACK_CLUSTER / 
+ * UNPACK_MODULE / UNPACK_NODE macros).  Return a handle, or NULL on failure
+ * with errno set.
+ */
+can_handle_t *
+can_open(char *path, int flags)
 {
+	can_handle_t *h;
+	int saved_errno;
+
 	assert(can_checkalign() == 0);
-	if (ioctl(fd, CAN_GET_ADDR, &nodeid) < 0) {
-                perror("ioctl CAN_GET_ADDR");
-                exit(1);
+	h = malloc(sizeof(can_handle_t));
+	if (h == NULL) {
+		errno = ENOMEM;
+		return NULL;
 	}
-	initialized = 1;
+	memset(h, 0, sizeof(can_handle_t));
+	h->flags = flags;
+	h->format = CAN_FORMAT_1;
+	h->fd = open(path ? path : PATH_CAN, flags);
+	if (h->fd < 0)
+		goto fail;
+	if (ioctl(h->fd, CAN_GET_ADDR, &h->nodeid) < 0)
+		goto fail;
+
+	/* load lookup cache now, before caller can start threads */
+	(void)_hostdb_init();
+	(void)_objdb_init();
+	return h;
+fail:
+	saved_errno = errno;
+	if (h->fd >= 0)
+		close(h->fd);
+	free(h);
+	errno = saved_errno;
+	return NULL;
+}
+
+/*
+ * Close a handle.  Pending transactions are abandoned.
+ */
+void
+can_close(can_handle_t *h)
+{
+	if (h->ring != NULL)
+		munmap((void *)h->ring, CAN_MMAP_SIZE);
+	close(h->fd);
+	free(h);
+}
+
+/*
+ * Map the driver's receive ring for this handle.  Afterwards can_recv_v()
+ * and can_recv() take packets straight from the ring and only enter the 
+ * kernel to sleep when it is empty.  Return 0 on success, -1 on failure.
+ */
+int
+can_map_ring(can_handle_t *h)
+{
+	void *p;
+
+	if (h->ring != NULL)
+		return 0;
+	p = mmap(NULL, CAN_MMAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, 
+			h->fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	h->ring = (struct can_mmap_ring *)p;
+	h->ring_overruns = h->ring->overruns;
+	return 0;
+}
+
+/*
+ * Get the number of packets lost to this handle since the last call, 
+ * because the reader fell too far behind.  With a mapped ring this is 
+ * read from the ring, without a system call.  Return 0, or -1 on failure.
+ */
+int
+can_get_overruns(can_handle_t *h, unsigned long *lost)
+{
+	uint32_t n;
+
+	if (h->ring != NULL) {
+		n = h->ring->overruns;
+		*lost = n - h->ring_overruns;
+		h->ring_overruns = n;
+		return 0;
+	}
+	return ioctl(h->fd, CAN_GET_OVERRUNS, lost);
+}
+
+/*
+ * Select what the driver returns on reads from this handle: CAN_FORMAT_1
+ * (struct can_packet) or CAN_FORMAT_2 (struct can_packet_v2, which adds
+ * a nanosecond timestamp; see can_recv_v2()).  A handle with a mapped ring
+ * must stay in format 1.  Return 0 on success, -1 on failure.
+ */
+int
+can_set_format(can_handle_t *h, int format)
+{
+	if (h->ring != NULL && format != CAN_FORMAT_1) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (ioctl(h->fd, CAN_SET_FORMAT, &format) < 0)
+		return -1;
+	h->format = format;
+	return 0;
+}
+
+/*
+ * Limit the packets delivered to this handle to those matching 'sub' (see
+ * struct can_subscription), or, if sub is NULL, go back to receiving 
+ * everything addressed to this node.  Return 0 on success, -1 on failure.
+ */
+int
+can_subscribe(can_handle_t *h, struct can_subscription *sub)
+{
+	if (sub == NULL)
+		return ioctl(h->fd, CAN_UNSUBSCRIBE);
+	return ioctl(h->fd, CAN_SUBSCRIBE, sub);
+}
+
+/*
+ * Install a packet filter program (see struct can_filter) so the driver 
+ * drops unwanted packets before they are copied out, or, if filter is NULL,
+ * remove it.  Return 0 on success, -1 on failure.
+ */
+int
+can_set_filter(can_handle_t *h, struct can_filter *filter)
+{
+	if (filter == NULL)
+		return ioctl(h->fd, CAN_CLR_FILTER);
+	return ioctl(h->fd, CAN_SET_FILTER, filter);
+}
+
+/*
+ * Cap the rate at which the driver sends packets written on this handle,
+ * in packets per second (0 = no cap).  Return 0 on success, -1 on failure.
+ */
+int
+can_set_txrate(can_handle_t *h, unsigned long pps)
+{
+	return ioctl(h->fd, CAN_SET_TXRATE, &pps);
+}
+
+/*
+ * Set the receive rate, in packets per second, above which the driver
+ * stops taking receive interrupts and polls the chip (0 = never).
+ * Return 0 on success, -1 on failure.
+ */
+int
+can_set_rxpoll(can_handle_t *h, unsigned long pps)
+{
+	return ioctl(h->fd, CAN_SET_RXPOLL, &pps);
+}
+
+/*
+ * Get the driver's statistics (see struct can_stats).
+ * Return 0 on success, -1 on failure.
+ */
+int
+can_get_stats(can_handle_t *h, struct can_stats *st)
+{
+	return ioctl(h->fd, CAN_GET_STATS, st);
+}
+
+/*
+ * Return the file descriptor underlying a handle, e.g. for ioctl(2).
+ */
+int
+can_fd(can_handle_t *h)
+{
+	return h->fd;
+}
+
+/*
+ * Return the packed LCAN address of the local host.
+ */
+unsigned long
+can_nodeid(can_handle_t *h)
+{
+	return h->nodeid;
 }
 
 /*
@@ -57,63 +289,178 @@ _initialize(int fd)
  * Return value is the return value of the write(2) system call.
  */
 int 
-can_ack(int fd, can_dat *dat, int len, int acknak, struct can_packet *ack)
+can_ack(can_handle_t *h, can_dat *dat, int len, int acknak, 
+		struct can_packet *ack)
 {
 	int nbytes;
 
-	if (!initialized)
-		_initialize(fd);
 	ack->can.can.length = sizeof(can_header_ext) + len;
 	ack->ext.ext.type = acknak;
 	if (dat && len > 0)
 		ack->dat = *dat;
 
-        nbytes = write(fd, ack, PKTSIZE);
+        nbytes = write(h->fd, ack, PKTSIZE);
 	assert(nbytes == -1 || nbytes == PKTSIZE);
 
 	return nbytes;
 }
 
 /*
- * Send a CAN packet.
+ * Build a CAN packet for transmission.
  * The CAN header is built from information in the extended CAN header.
- * Return value is the return value of the write(2) system call.
  */
-int 
-can_send(int fd, can_header_ext *ext, can_dat *dat, int len)
+void
+can_pack(can_handle_t *h, struct can_packet *pkt, can_header_ext *ext, 
+		can_dat *dat, int len)
 {
-	struct can_packet pkt;
-	int nbytes, c, m, n;
+	int c, m;
 
-	if (!initialized)
-		_initialize(fd);
-	c = UNPACK_CLUSTER(nodeid);
-	m = UNPACK_MODULE(nodeid);
-	n = UNPACK_NODE(nodeid);
+	c = UNPACK_CLUSTER(h->nodeid);
+	m = UNPACK_MODULE(h->nodeid);
 #if 0
-	printf("me = (%x,%x,%x)\n", c, m, n);
+	printf("me = (%x,%x,%x)\n", c, m, UNPACK_NODE(h->nodeid));
 	printf("you = (%x,%x,%x)\n", 
 	    ext->ext.cluster, ext->ext.module, ext->ext.node);
 #endif
-	pkt.can.can.lpriority = CAN_HIGH_PRIORITY;
-	pkt.can.can.length = sizeof(can_header_ext) + len;
+	pkt->can.can.lpriority = CAN_HIGH_PRIORITY;
+	pkt->can.can.length = sizeof(can_header_ext) + len;
 	if (m == ext->ext.module && c == ext->ext.cluster)
-		pkt.can.can.dest = ext->ext.node;
+		pkt->can.can.dest = ext->ext.node;
 	else
-		pkt.can.can.dest = CAN_MODULE_H8;
+		pkt->can.can.dest = CAN_MODULE_H8;
 
-	pkt.ext = *ext;
+	pkt->ext = *ext;
 	if (dat != NULL && len > 0)
-		pkt.dat = *dat;
+		pkt->dat = *dat;
+}
 
-        nbytes = write(fd, &pkt, PKTSIZE);
+/*
+ * Send a CAN packet.
+ * Return value is the return value of the write(2) system call.
+ */
+int 
+can_send(can_handle_t *h, can_header_ext *ext, can_dat *dat, int len)
+{
+	struct can_packet pkt;
+	int nbytes;
+
+	can_pack(h, &pkt, ext, dat, len);
+
+        nbytes = write(h->fd, &pkt, PKTSIZE);
 	assert(nbytes == -1 || nbytes == PKTSIZE);
 
 	return nbytes;
 }
 
+/*
+ * Send an array of packets (built with can_pack(), or ACKs from can_recv())
+ * using as few write(2) calls as possible.  The driver accepts as many as 
+ * fit in its output queue per call.  Return the number of packets sent, 
+ * which is less than npkts if a write is interrupted or would block after 
+ * some packets were sent, or -1 if the first write fails.
+ */
+int
+can_send_v(can_handle_t *h, struct can_packet *pkts, int npkts)
+{
+	int nbytes, sent = 0;
+
+	while (sent < npkts) {
+		nbytes = write(h->fd, pkts + sent, (npkts - sent) * PKTSIZE);
+		if (nbytes < 0)
+			return (sent > 0 ? sent : -1);
+		assert(nbytes % PKTSIZE == 0);
+		sent += nbytes / PKTSIZE;
+	}
+	return sent;
+}
+
+/*
+ * Take up to npkts packets from a mapped receive ring.  Return the number
+ * taken, which may be 0.  The barriers pair with the driver's wmb() in 
+ * pkt_to_mring(): slots are read only after the head that covers them, 
+ * and given back only after they have been copied.
+ */
+static int
+_ring_recv(struct can_mmap_ring *r, struct can_packet *pkts, int npkts)
+{
+	uint32_t head = r->head, tail = r->tail;
+	int n = 0;
+
+	ring_rmb();
+	while (n < npkts && tail != head) {
+		pkts[n++] = r->pkt[tail];
+		tail = (tail + 1) % CAN_MMAP_SLOTS;
+	}
+	ring_mb();
+	r->tail = tail;
+	return n;
+}
+
+/*
+ * Receive up to 'npkts' packets with their nanosecond timestamps, on a 
+ * handle in CAN_FORMAT_2 (see can_set_format()).  
+ * Return the number received, or -1.
+ */
+int
+can_recv_v2(can_handle_t *h, struct can_packet_v2 *pkts, int npkts)
+{
+	int nbytes;
+
+	if (h->format != CAN_FORMAT_2) {
+		errno = EINVAL;
+		return -1;
+	}
+	nbytes = read(h->fd, pkts, npkts * sizeof(struct can_packet_v2));
+	if (nbytes < 0)
+		return -1;
+	assert(nbytes % sizeof(struct can_packet_v2) == 0);
+	return nbytes / sizeof(struct can_packet_v2);
+}
+
+/*
+ * Receive up to npkts packets into the caller's array with one read(2),
+ * or from the receive ring if the handle has one mapped.
+ * Return the number of packets received, or -1 on error.
+ */
+int
+can_recv_v(can_handle_t *h, struct can_packet *pkts, int npkts)
+{
+	int n, nbytes;
+
+	while (h->ring != NULL) {
+		n = _ring_recv(h->ring, pkts, npkts);
+		if (n > 0)
+			return n;
+		if (h->flags & O_NONBLOCK) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (can_wait(h, POLLIN, -1) < 0)
+			return -1;
+	}
+	if (h->format == CAN_FORMAT_2) {
+		struct can_packet_v2 v2[CAN_V2_BATCH];
+		int i;
+
+		n = can_recv_v2(h, v2, npkts < CAN_V2_BATCH ? npkts 
+		    : CAN_V2_BATCH);
+		for (i = 0; i < n; i++)
+			pkts[i] = v2[i].pkt;
+		return n;
+	}
+	nbytes = read(h->fd, pkts, npkts * PKTSIZE);
+	if (nbytes < 0)
+		return -1;
+	assert(nbytes % PKTSIZE == 0);
+	return nbytes / PKTSIZE;
+}
+
 #define ACKABLE(t) \
 	((t) == CANTYPE_RO || (t) == CANTYPE_WO || (t) == CANTYPE_DAT)
+#define ISACKNAK(t) ((t) == CANTYPE_ACK || (t) == CANTYPE_NAK)
+#define TV_MSEC(a, b) \
+	(((a)->tv_sec - (b)->tv_sec) * 1000 \
+	+ ((a)->tv_usec - (b)->tv_usec) / 1000)
 
 /*
  * Receive packets from the CAN.  All packets received are returned;
@@ -121,20 +468,17 @@ can_send(int fd, can_header_ext *ext, can_dat *dat, int len)
  * can_recv until the right one is received.  If the packet received requires 
  * an ACK and the 'ack' parameter is non-NULL, build the ACK packet for 
  * subsequent passing to can_ack().
- * Return value is the return value of the read(2) system call.
+ * Return value is the number of bytes received, as from read(2), or -1.
  */
 int 
-can_recv(int fd, can_header_ext *ext, can_dat *dat, int *len, 
+can_recv(can_handle_t *h, can_header_ext *ext, can_dat *dat, int *len, 
 		struct can_packet *ack)
 {
 	struct can_packet pkt;
-	int nbytes;
-
-	if (!initialized)
-		_initialize(fd);
+	int n, nbytes;
 
-	nbytes = read(fd, &pkt, PKTSIZE);
-	assert(nbytes == -1 || nbytes == PKTSIZE);
+	n = can_recv_v(h, &pkt, 1);
+	nbytes = (n < 0 ? -1 : n * PKTSIZE);
 
 	if (nbytes == PKTSIZE) {
 		*ext = pkt.ext;
@@ -143,7 +487,7 @@ can_recv(int fd, can_header_ext *ext, can_dat *dat, int *len,
 	} 
 
 	/* build ack packet */
-	if (ack != NULL && ACKABLE(pkt.ext.ext.type)) {
+	if (nbytes == PKTSIZE && ack != NULL && ACKABLE(pkt.ext.ext.type)) {
 		ack->can.can.lpriority = CAN_HIGH_PRIORITY;
 		ack->can.can.length = sizeof(can_header_ext);
 		ack->can.can.dest = pkt.can.can.src;
@@ -154,7 +498,75 @@ can_recv(int fd, can_header_ext *ext, can_dat *dat, int *len,
 	return nbytes;
 }
 
-#define ISACKNAK(t) ((t) == CANTYPE_ACK || (t) == CANTYPE_NAK)
+/*
+ * Wait up to timeout msec (-1 = forever) for the handle to become readable
+ * (POLLIN) and/or writable (POLLOUT).  Return the events that are ready, 
+ * 0 on timeout, or -1 on error.
+ */
+int
+can_wait(can_handle_t *h, int events, int timeout)
+{
+	struct pollfd pfd;
+	int n;
+
+	pfd.fd = h->fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	n = poll(&pfd, 1, timeout);
+	if (n <= 0)
+		return n;
+	return pfd.revents;
+}
+
+/*
+ * Wait up to timeout msec (-1 = forever) for an acknowledgement for a 
+ * transaction matching the 'ext' extended CAN header.  Return the data and 
+ * its length.  Return value is the return value of the read(2) system call,
+ * or -1 with errno set to ETIMEDOUT if no ACK/NAK arrived in time.
+ */
+int 
+can_recv_ack_timeout(can_handle_t *h, can_header_ext *ext, can_dat *dat, 
+		int *len, int timeout)
+{
+	can_header_ext lext;
+	can_dat ldat;
+	struct timeval t0, now;
+	int llen = 0, nbytes, left = timeout;
+
+	gettimeofday(&t0, NULL);
+	for (;;) {
+		nbytes = can_wait(h, POLLIN, left);
+		if (nbytes == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (nbytes < 0)
+			return -1;
+		nbytes = can_recv(h, &lext, &ldat, &llen, NULL);
+		if (nbytes == -1)
+			return -1;
+		if (nbytes != PKTSIZE) {
+			errno = EIO;
+			return -1;
+		}
+		if (ISACKNAK(lext.ext.type)
+				&& lext.ext.object == ext->ext.object
+				&& lext.ext.cluster == ext->ext.cluster
+				&& lext.ext.module == ext->ext.module
+				&& lext.ext.node == ext->ext.node)
+			break;
+		if (timeout >= 0) {
+			gettimeofday(&now, NULL);
+			left = timeout - TV_MSEC(&now, &t0);
+			if (left < 0)
+				left = 0;
+		}
+	}
+	ext->ext.type = lext.ext.type;
+	*len = llen;
+	*dat = ldat;
+	return nbytes;
+}
 
 /*
  * Wait for an acknowledgement for a transaction matching the
@@ -162,34 +574,240 @@ can_recv(int fd, can_header_ext *ext, can_dat *dat, int *len,
  * Return value is the return value of the read(2) system call.
  */
 int 
-can_recv_ack(int fd, can_header_ext *ext, can_dat *dat, int *len)
+can_recv_ack(can_handle_t *h, can_header_ext *ext, can_dat *dat, int *len)
 {
-	can_header_ext lext;
-	can_dat ldat;
-	int llen, nbytes;
+	return can_recv_ack_timeout(h, ext, dat, len, -1);
+}
 
-	if (!initialized)
-		_initialize(fd);
-	while ((nbytes = can_recv(fd, &lext, &ldat, &llen, NULL)) != -1) {
-		if (!ISACKNAK(lext.ext.type))
-			continue;
-		if (lext.ext.object != ext->ext.object)
-			continue;
-		if (lext.ext.cluster != ext->ext.cluster)
-			continue;
-		if (lext.ext.module != ext->ext.module)
-			continue;
-		if (lext.ext.node != ext->ext.node)
-			continue;
+/*
+ * Send an ACKable request and wait for the ACK/NAK in one system call.
+ * The driver resends the request on a NAK, or after timeout msec with no 
+ * answer, up to 'retries' times.  On return ext->ext.type is the answer's 
+ * type, and dat/len its payload.  Return 0 on success, or -1 with errno set
+ * (ETIMEDOUT if the last attempt got no answer).
+ */
+int
+can_transact(can_handle_t *h, can_header_ext *ext, can_dat *dat, int len,
+		can_dat *ack, int *acklen, int timeout, int retries)
+{
+	struct can_transact t;
 
-		ext->ext.type = lext.ext.type;
-		*len = llen;
-		*dat = ldat;
-		break;
+	memset(&t, 0, sizeof(t));
+	t.req = *ext;
+	if (dat != NULL && len > 0)
+		t.dat = *dat;
+	t.len = len;
+	t.timeout = timeout;
+	t.retries = retries;
+	if (ioctl(h->fd, CAN_TRANSACT, &t) < 0)
+		return -1;
+	if (t.status == CAN_TRANSACT_TIMEDOUT) {
+		errno = ETIMEDOUT;
+		return -1;
 	}
-	return nbytes;
+	ext->ext.type = t.status == CAN_TRANSACT_ACK ? CANTYPE_ACK : CANTYPE_NAK;
+	*ack = t.ack;
+	*acklen = t.acklen;
+	return 0;
+}
+
+/*
+ * Run a vector of transactions (see struct can_transact) in one system 
+ * call, with as many in flight at once as the driver allows.  The caller
+ * fills in req, dat, len, timeout and retries of each; the driver fills in
+ * status, tries, ack, acklen and latency.  Return 0 on success, -1 on 
+ * failure (errno set).
+ */
+int
+can_transact_v(can_handle_t *h, struct can_transact *v, int n)
+{
+	struct can_transact_v tv;
+
+	tv.v = v;
+	tv.n = n;
+	return ioctl(h->fd, CAN_TRANSACT_V, &tv);
+}
+
+/**
+ ** Asynchronous transactions follow.
+ **/
+
+/*
+ * A transaction is an ACKable request (RO, WO or DAT) plus the ACK/NAK that
+ * answers it.  Any number of transactions may be outstanding on a handle, as 
+ * long as no two are for the same object on the same node, since an ACK/NAK
+ * carries only the object and node of the request in its extended header.
+ * Pending transactions are kept in a hash table keyed on that tuple, so 
+ * each received ACK/NAK is matched in constant time.  Completed transactions 
+ * are passed to their callback, or if there is none, put on the handle's 
+ * completion list for can_txn_next().
+ */
+#define TXN_KEY(x) \
+	(((x)->ext.object << 18) | ((x)->ext.cluster << 12) \
+	| ((x)->ext.module << 6) | (x)->ext.node)
+#define TXN_HASH(k)	((k) % CAN_TXN_HASHSIZE)
+
+static can_txn_t *
+_txn_lookup(struct can_txnq *q, unsigned long key, can_txn_t ***prevp)
+{
+	can_txn_t **pp, *t;
+
+	for (pp = &q->hash[TXN_HASH(key)]; (t = *pp) != NULL; pp = &t->next) {
+		if (TXN_KEY(&t->req) == key) {
+			if (prevp != NULL)
+				*prevp = pp;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Remove a transaction from the pending table and deliver it to its
+ * callback or the completion list.
+ */
+static void
+_txn_complete(struct can_txnq *q, can_txn_t **pp, int status)
+{
+	can_txn_t *t = *pp, **tail;
+
+	*pp = t->next;
+	t->next = NULL;
+	q->npending--;
+	t->status = status;
+	if (t->cb != NULL) {
+		t->cb(t, t->arg);
+	} else {
+		for (tail = &q->done; *tail != NULL; tail = &(*tail)->next)
+			;
+		*tail = t;
+	}
+}
+
+/*
+ * Send the request for a transaction and add it to the pending table.
+ * The caller fills in req, dat, len, timeout (msec), and optionally cb/arg,
+ * and must not touch the transaction again until it completes.
+ * Return 0 on success, -1 on failure (errno set: EINVAL if the request is not
+ * ACKable, EBUSY if a transaction for the same object/node is pending, 
+ * or from write(2)).
+ */
+int
+can_txn_submit(can_handle_t *h, can_txn_t *txn)
+{
+	struct can_txnq *q = &h->txnq;
+	unsigned long key = TXN_KEY(&txn->req);
+
+	if (!ACKABLE(txn->req.ext.type)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (_txn_lookup(q, key, NULL) != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (can_send(h, &txn->req, &txn->dat, txn->len) < 0)
+		return -1;
+	txn->status = CAN_TXN_PENDING;
+	gettimeofday(&txn->deadline, NULL);
+	txn->deadline.tv_sec += txn->timeout / 1000;
+	txn->deadline.tv_usec += (txn->timeout % 1000) * 1000;
+	if (txn->deadline.tv_usec >= 1000000) {
+		txn->deadline.tv_sec++;
+		txn->deadline.tv_usec -= 1000000;
+	}
+	txn->next = q->hash[TXN_HASH(key)];
+	q->hash[TXN_HASH(key)] = txn;
+	q->npending++;
+	return 0;
+}
+
+/*
+ * Complete any pending transactions whose deadline has passed, and return 
+ * the number of msec until the next deadline (-1 if nothing is pending).
+ */
+static int
+_txn_expire(struct can_txnq *q)
+{
+	struct timeval now;
+	can_txn_t **pp;
+	int i, ms, next = -1;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < CAN_TXN_HASHSIZE; i++) {
+		pp = &q->hash[i];
+		while (*pp != NULL) {
+			ms = TV_MSEC(&(*pp)->deadline, &now);
+			if (ms <= 0) {
+				_txn_complete(q, pp, CAN_TXN_TIMEDOUT);
+				continue;
+			}
+			if (next == -1 || ms < next)
+				next = ms;
+			pp = &(*pp)->next;
+		}
+	}
+	return next;
 }
 
+/*
+ * Wait up to timeout msec (-1 = until the next deadline) for ACK/NAKs,
+ * and complete the transactions they answer.  Received packets that are not
+ * replies to a pending transaction are discarded.  Return the number of 
+ * transactions completed, or -1 on error.
+ */
+int
+can_txn_poll(can_handle_t *h, int timeout)
+{
+	struct can_txnq *q = &h->txnq;
+	struct can_packet pkts[CAN_TXN_BATCH];
+	can_txn_t *t, **pp;
+	int i, n, next, before = q->npending;
+
+	next = _txn_expire(q);
+	if (q->npending == 0)
+		return before;
+	if (timeout < 0 || timeout > next)
+		timeout = next;
+	n = can_wait(h, POLLIN, timeout);
+	if (n < 0 && errno != EINTR)
+		return -1;
+	if (n > 0) {
+		n = can_recv_v(h, pkts, CAN_TXN_BATCH);
+		if (n < 0 && errno != EINTR && errno != EAGAIN)
+			return -1;
+		for (i = 0; i < n; i++) {
+			if (!ISACKNAK(pkts[i].ext.ext.type))
+				continue;
+			t = _txn_lookup(q, TXN_KEY(&pkts[i].ext), &pp);
+			if (t == NULL)
+				continue;
+			t->ack = pkts[i].dat;
+			t->acklen = pkts[i].can.can.length 
+			    - sizeof(can_header_ext);
+			_txn_complete(q, pp, pkts[i].ext.ext.type == CANTYPE_ACK
+			    ? CAN_TXN_ACK : CAN_TXN_NAK);
+		}
+	}
+	_txn_expire(q);
+	return before - q->npending;
+}
+
+/*
+ * Remove and return the oldest transaction on the completion list,
+ * or NULL if the list is empty.
+ */
+can_txn_t *
+can_txn_next(can_handle_t *h)
+{
+	can_txn_t *t = h->txnq.done;
+
+	if (t != NULL) {
+		h->txnq.done = t->next;
+		t->next = NULL;
+	}
+	return t;
+}
 
 /**
  ** /etc/canhosts and /etc/canobj query functions follow.
@@ -197,12 +815,115 @@ can_recv_ack(int fd, can_header_ext *ext, can_dat *dat, int *len)
 
 #define BSIZE 255
 
+struct canhosts_dbhdr;
+
+struct hostdb {				/* /etc/canhosts (see below) */
+	struct canhosts_dbhdr	*hdr;
+	struct canhostname	*hosts;
+	uint16_t		*modtab;
+	uint16_t		*nodetab;
+	uint16_t		*hashtab;
+};
+
 /*
- * Given a can hostname, return a filled out struct canhostname.
- * On success, return 0; failure -1.
+ * Process-wide lookup cache.  All the query functions below share one copy
+ * of the canhosts index and the canobj tables, each loaded on first use 
+ * (under cache_lock, in case the first use is by several threads at once).
  */
-int 
-can_gethostbyname(char *name, struct canhostname *canhost)
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	struct {
+		struct hostdb		*db;
+		time_t			checked;	/* last stat() */
+	} hosts;
+	struct {			/* /etc/canobj (see below) */
+		int			loaded;
+		int			nobjs;
+		struct canobj		*objs;
+		uint16_t		byid[CANOBJ_NIDS];
+		int			nbkt;
+		uint16_t		*seed;
+		int			size;
+		uint16_t		*byname;
+	} objs;
+} cache;
+
+/*
+ * /etc/canhosts is compiled into a binary index, PATH_CANHOSTS_DB, the first 
+ * time it is needed (or when canhosts is newer than the index).  The index 
+ * is mapped and all lookups are done in memory:
+ *
+ *   header | struct canhostname[nhosts] | modtab[4096] | nodetab[nblk][64] 
+ *          | hashtab[hashsize]
+ *
+ * modtab is indexed by (cluster << 6 | module) and holds a nodetab block 
+ * number + 1, or 0 if no hosts are on that module.  nodetab blocks are indexed
+ * by node and hold a host index + 1.  hashtab is an open addressed (linear 
+ * probe) table on hostname holding host index + 1.  As with the old linear 
+ * scan of canhosts, the last entry wins if an address or name is duplicated.
+ *
+ * If the index cannot be written (e.g. not root), it is built in memory.
+ *
+ * A long running process re-stats canhosts at most once a second, and 
+ * loads a new index if it changed.  The old one is never unmapped, as 
+ * another thread may still be looking something up in it.
+ */
+#define CANHOSTS_DB_MAGIC	0x43484442	/* "CHDB" */
+#define CANHOSTS_DB_VERSION	1
+#define MODTAB_SIZE		(1 << 12)
+#define NODETAB_SIZE		(1 << 6)
+#define ADDR_MOD(c, m)		((((c) & 0x3f) << 6) | ((m) & 0x3f))
+
+struct canhosts_dbhdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	mtime;		/* st_mtime of PATH_CANHOSTS */
+	uint32_t	size;		/* st_size of PATH_CANHOSTS */
+	uint32_t	nhosts;
+	uint32_t	nblk;		/* number of nodetab blocks */
+	uint32_t	hashsize;	/* power of two */
+	uint32_t	len;		/* total length of index */
+};
+
+
+static unsigned int
+_hashstr(char *s)
+{
+	unsigned int h = 0;
+
+	while (*s)
+		h = h * 31 + (unsigned char)*s++;
+	return h;
+}
+
+/*
+ * Set the hostdb table pointers from a header at the front of an index.
+ */
+static void
+_hostdb_attach(struct hostdb *db, struct canhosts_dbhdr *hdr)
+{
+	db->hdr = hdr;
+	db->hosts = (struct canhostname *)(hdr + 1);
+	db->modtab = (uint16_t *)(db->hosts + hdr->nhosts);
+	db->nodetab = db->modtab + MODTAB_SIZE;
+	db->hashtab = db->nodetab + hdr->nblk * NODETAB_SIZE;
+}
+
+static uint32_t
+_hostdb_len(int nhosts, int nblk, int hashsize)
+{
+	return sizeof(struct canhosts_dbhdr) 
+	    + nhosts * sizeof(struct canhostname)
+	    + (MODTAB_SIZE + nblk * NODETAB_SIZE + hashsize) * sizeof(uint16_t);
+}
+
+/*
+ * Parse PATH_CANHOSTS and build an index in malloc'ed memory.  
+ * Return pointer to the index header, or NULL on failure.
+ */
+static struct canhosts_dbhdr *
+_hostdb_build(struct stat *sb)
 {
 	FILE *f; 
 	int nitems; 
@@ -210,101 +931,453 @@ can_gethostbyname(char *name, struct canhostname *canhost)
 	char hostname[MAXHOSTNAMELEN]; 
 	char canid[255];
 	unsigned int c, m, n;
-	int retval = -1;
+	struct canhostname *tmp = NULL, *hp;
+	int i, nhosts = 0, maxhosts = 0, nblk = 0, hashsize;
+	struct canhosts_dbhdr *hdr;
+	struct hostdb db;
+	uint16_t *slot;
+	unsigned int h;
+	char seen[MODTAB_SIZE];
 
 	f = fopen(PATH_CANHOSTS, "r");
-	if (f != NULL) {
-		while (fgets(buf, BSIZE, f)) {
-			nitems = sscanf(buf, "%s %s", canid, hostname);
-			if (nitems != 2 || strcmp(hostname, name) != 0)
-				continue;
-			nitems = sscanf(canid, "%x,%x,%x", &c, &m, &n);
-			if (nitems != 3)
-				continue;
-			canhost->cluster = c;
-			canhost->module = m;
-			canhost->node = n;
-			strcpy(canhost->hostname, hostname);
-			retval = 0;
+	if (f == NULL) {
+		perror(PATH_CANHOSTS);
+		return NULL;
+	}
+	while (fgets(buf, BSIZE, f)) {
+		nitems = sscanf(buf, "%s %s", canid, hostname);
+		if (nitems != 2)
+			continue;
+		nitems = sscanf(canid, "%x,%x,%x", &c, &m, &n);
+		if (nitems != 3 || c > 0x3f || m > 0x3f || n > 0x3f)
+			continue;
+		if (nhosts == maxhosts) {
+			maxhosts = maxhosts ? maxhosts * 2 : 256;
+			hp = realloc(tmp, maxhosts * sizeof(*tmp));
+			if (hp == NULL)
+				goto nomem;
+			tmp = hp;
 		}
+		tmp[nhosts].cluster = c;
+		tmp[nhosts].module = m;
+		tmp[nhosts].node = n;
+		strcpy(tmp[nhosts].hostname, hostname);
+		nhosts++;
+	}
+	fclose(f);
+	f = NULL;
+
+	for (hashsize = 16; hashsize < nhosts * 2; hashsize <<= 1)
+		;
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < nhosts; i++) {
+		if (!seen[ADDR_MOD(tmp[i].cluster, tmp[i].module)]) {
+			seen[ADDR_MOD(tmp[i].cluster, tmp[i].module)] = 1;
+			nblk++;
+		}
+	}
+	hdr = calloc(1, _hostdb_len(nhosts, nblk, hashsize));
+	if (hdr == NULL)
+		goto nomem;
+	hdr->magic = CANHOSTS_DB_MAGIC;
+	hdr->version = CANHOSTS_DB_VERSION;
+	hdr->mtime = sb->st_mtime;
+	hdr->size = sb->st_size;
+	hdr->nhosts = nhosts;
+	hdr->nblk = nblk;
+	hdr->hashsize = hashsize;
+	hdr->len = _hostdb_len(nhosts, nblk, hashsize);
+	_hostdb_attach(&db, hdr);
+	memcpy(db.hosts, tmp, nhosts * sizeof(*tmp));
+
+	nblk = 0;
+	for (i = 0; i < nhosts; i++) {
+		hp = &db.hosts[i];
+		slot = &db.modtab[ADDR_MOD(hp->cluster, hp->module)];
+		if (*slot == 0)
+			*slot = ++nblk;
+		db.nodetab[(*slot - 1) * NODETAB_SIZE + hp->node] = i + 1;
+	}
+	for (i = 0; i < nhosts; i++) {
+		hp = &db.hosts[i];
+		h = _hashstr(hp->hostname) & (hashsize - 1);
+		while (db.hashtab[h] != 0 && strcmp(hp->hostname, 
+		    db.hosts[db.hashtab[h] - 1].hostname) != 0)
+			h = (h + 1) & (hashsize - 1);
+		db.hashtab[h] = i + 1;
+	}
+	free(tmp);
+	return hdr;
+nomem:
+	fprintf(stderr, "%s: out of memory\n", PATH_CANHOSTS);
+	if (f != NULL)
 		fclose(f);
-	} else
-		perror(PATH_CANHOSTS);
+	if (tmp != NULL)
+		free(tmp);
+	return NULL;
+}
 
-	return retval;
+/*
+ * Map PATH_CANHOSTS_DB if it is valid and up to date.
+ */
+static struct canhosts_dbhdr *
+_hostdb_map(struct stat *sb)
+{
+	struct canhosts_dbhdr *hdr;
+	struct stat dbsb;
+	int fd;
+
+	fd = open(PATH_CANHOSTS_DB, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &dbsb) < 0 || dbsb.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+	hdr = mmap(NULL, dbsb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return NULL;
+	if (hdr->magic != CANHOSTS_DB_MAGIC 
+	    || hdr->version != CANHOSTS_DB_VERSION
+	    || hdr->mtime != (uint32_t)sb->st_mtime 
+	    || hdr->size != (uint32_t)sb->st_size
+	    || hdr->len != dbsb.st_size) {
+		munmap(hdr, dbsb.st_size);
+		return NULL;
+	}
+	return hdr;
 }
 
 /*
- * Given a can address, return a filled out struct canhostname.
+ * Write a freshly built index out to PATH_CANHOSTS_DB.  Failure is not an
+ * error; the in-memory copy is used either way.
+ */
+static void
+_hostdb_save(struct canhosts_dbhdr *hdr)
+{
+	char tmpname[MAXPATHLEN];
+	int fd;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", PATH_CANHOSTS_DB, 
+	    (int)getpid());
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+	if (write(fd, hdr, hdr->len) != hdr->len || close(fd) < 0 
+	    || rename(tmpname, PATH_CANHOSTS_DB) < 0)
+		unlink(tmpname);
+}
+
+static struct hostdb *
+_hostdb_load(struct stat *sb)
+{
+	struct canhosts_dbhdr *hdr;
+	struct hostdb *db;
+
+	db = malloc(sizeof(*db));
+	if (db == NULL) {
+		fprintf(stderr, "%s: out of memory\n", PATH_CANHOSTS);
+		return NULL;
+	}
+	hdr = _hostdb_map(sb);
+	if (hdr == NULL) {
+		hdr = _hostdb_build(sb);
+		if (hdr == NULL) {
+			free(db);
+			return NULL;
+		}
+		_hostdb_save(hdr);
+	}
+	_hostdb_attach(db, hdr);
+	return db;
+}
+
+/*
+ * Return the canhosts index, loading it if this is the first use or 
+ * canhosts has changed since, or NULL on failure.  If a reload fails, 
+ * the old index is kept.
+ */
+static struct hostdb *
+_hostdb_init(void)
+{
+	struct hostdb *db, *ndb;
+	struct stat sb;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&cache_lock);
+	db = cache.hosts.db;
+	if (db == NULL || now != cache.hosts.checked) {
+		cache.hosts.checked = now;
+		if (stat(PATH_CANHOSTS, &sb) < 0) {
+			if (db == NULL)
+				perror(PATH_CANHOSTS);
+		} else if (db == NULL 
+		    || db->hdr->mtime != (uint32_t)sb.st_mtime
+		    || db->hdr->size != (uint32_t)sb.st_size) {
+			ndb = _hostdb_load(&sb);
+			if (ndb != NULL)
+				cache.hosts.db = db = ndb;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return db;
+}
+
+/*
+ * Given a can hostname, return a filled out struct canhostname.
  * On success, return 0; failure -1.
  */
 int 
-can_gethostbyaddr(int c, int m, int n, struct canhostname *canhost)
+can_gethostbyname(char *name, struct canhostname *canhost)
 {
-	FILE *f; 
-	int nitems; 
-	int retval = -1;
-	char buf[BSIZE];
-	char hostname[MAXHOSTNAMELEN];
-	char canid[255];
-	unsigned int xc, xm, xn;
+	struct hostdb *db;
+	unsigned int h;
+	int i;
 
-	f = fopen(PATH_CANHOSTS, "r");
-	if (f != NULL) {
-		while (fgets(buf, BSIZE, f)) {
-			nitems = sscanf(buf, "%s %s", canid, hostname);
-			if (nitems != 2)
-				continue;
-			nitems = sscanf(canid, "%x,%x,%x", &xc, &xm, &xn);
-			if (nitems != 3)
-				continue;
-			if (c != xc || m != xm || n != xn)
-				continue;
-			canhost->cluster = xc;
-			canhost->module = xm;
-			canhost->node = xn;
-			strcpy(canhost->hostname, hostname);
-			retval = 0;
+	if ((db = _hostdb_init()) == NULL)
+		return -1;
+	h = _hashstr(name) & (db->hdr->hashsize - 1);
+	while ((i = db->hashtab[h]) != 0) {
+		if (strcmp(db->hosts[i - 1].hostname, name) == 0) {
+			*canhost = db->hosts[i - 1];
+			return 0;
 		}
-		fclose(f);
-	} else
-		perror(PATH_CANHOSTS);
-
-	return retval;
+		h = (h + 1) & (db->hdr->hashsize - 1);
+	}
+	return -1;
 }
 
 /*
- * Given a can object name, return a filled out struct canobj.
+ * Given a can address, return a filled out struct canhostname.
  * On success, return 0; failure -1.
  */
 int 
-can_getobjbyname(char *name, struct canobj *canobj)
+can_gethostbyaddr(int c, int m, int n, struct canhostname *canhost)
+{
+	struct hostdb *db;
+	int blk, i;
+
+	if ((db = _hostdb_init()) == NULL)
+		return -1;
+	if (c < 0 || c > 0x3f || m < 0 || m > 0x3f || n < 0 || n > 0x3f)
+		return -1;
+	blk = db->modtab[ADDR_MOD(c, m)];
+	if (blk == 0)
+		return -1;
+	i = db->nodetab[(blk - 1) * NODETAB_SIZE + n];
+	if (i == 0)
+		return -1;
+	*canhost = db->hosts[i - 1];
+	return 0;
+}
+
+/*
+ * /etc/canobj is read once per process.  Objects are indexed directly by 
+ * their 10 bit ID in byid[] (holding index into objs[] + 1).  Names are 
+ * looked up with a perfect hash generated when the file is loaded, using the 
+ * hash-and-displace method:  a name is first hashed into one of nbkt buckets,
+ * then hashed again with that bucket's seed to find its unique slot in 
+ * byname[].  A lookup is thus two hashes and a single strcasecmp.  As with 
+ * the old linear scan, the first entry wins if an ID or name is duplicated;
+ * a line whose name is taken is still found by its ID.
+ */
+#define OBJ_SEED_MAX		0xffff
+
+static unsigned int
+_hashname(char *s, unsigned int seed)
+{
+	unsigned int h = 2166136261U ^ seed;
+
+	while (*s) {
+		h ^= tolower((unsigned char)*s++);
+		h *= 16777619;
+	}
+	return h;
+}
+
+/*
+ * Generate the byname[] perfect hash for the n objects in cache.objs.objs[]
+ * indexed by names[].  Return 0 on success, -1 on failure.
+ */
+static int
+_objdb_phash(int *names, int n)
+{
+	int nbkt, size, b, i, j, k, seed, max = 0;
+	int *bkt, *order, *slots;
+	uint16_t *byname, *bseed;
+	int retval = -1;
+
+	nbkt = n / 4 + 1;
+	for (size = 16; size < n + n / 4; size <<= 1)
+		;
+	bkt = malloc(n * sizeof(int));
+	order = malloc(n * sizeof(int));
+	slots = malloc(n * sizeof(int));
+	byname = calloc(size, sizeof(uint16_t));
+	bseed = calloc(nbkt, sizeof(uint16_t));
+	if (!bkt || !order || !slots || !byname || !bseed)
+		goto done;
+
+	/* order objects by bucket, biggest buckets first */
+	for (i = 0; i < n; i++) {
+		bkt[i] = _hashname(cache.objs.objs[names[i]].name, 0) % nbkt;
+		bseed[bkt[i]]++;
+		if (bseed[bkt[i]] > max)
+			max = bseed[bkt[i]];
+	}
+	for (k = 0; max > 0; max--)
+		for (b = 0; b < nbkt; b++)
+			if (bseed[b] == max)
+				for (i = 0; i < n; i++)
+					if (bkt[i] == b)
+						order[k++] = i;
+
+	/* find a seed for each bucket that puts its members in free slots */
+	for (i = 0; i < n; i = j) {
+		b = bkt[order[i]];
+		for (j = i; j < n && bkt[order[j]] == b; j++)
+			;
+		for (seed = 1; seed <= OBJ_SEED_MAX; seed++) {
+			for (k = i; k < j; k++) {
+				slots[k] = _hashname(
+				    cache.objs.objs[names[order[k]]].name, 
+				    seed) & (size - 1);
+				if (byname[slots[k]] != 0)
+					break;
+				byname[slots[k]] = names[order[k]] + 1;
+			}
+			if (k == j)
+				break;
+			while (--k >= i)
+				byname[slots[k]] = 0;
+		}
+		if (seed > OBJ_SEED_MAX)
+			goto done;
+		bseed[b] = seed;
+	}
+	cache.objs.nbkt = nbkt;
+	cache.objs.size = size;
+	cache.objs.seed = bseed;
+	cache.objs.byname = byname;
+	bseed = NULL;
+	byname = NULL;
+	retval = 0;
+done:
+	free(bkt);
+	free(order);
+	free(slots);
+	free(byname);
+	free(bseed);
+	return retval;
+}
+
+static int
+_objdb_load(void)
 {
 	FILE *f;
 	int nitems; 
 	char buf[BSIZE];
 	char tmpname[MAXHOSTNAMELEN];
-	int tmpid;
-	int retval = -1;
+	int tmpid, i, j, dup, max = 0, nnames = 0;
+	int *names = NULL, *ntmp;	/* objs[] by name, first of each */
+	struct canobj *tmp;
 
 	f = fopen(PATH_CANOBJ, "r");
-	if (f != NULL) {
-		while (fgets(buf, BSIZE, f)) {
-			nitems = sscanf(buf, "%x %s", &tmpid, tmpname);
-			if (nitems == 2 && strcasecmp(tmpname, name) == 0) {
-				strcpy(canobj->name, tmpname);
-				canobj->id = tmpid;
-				retval = 0;
+	if (f == NULL) {
+		perror(PATH_CANOBJ);
+		return -1;
+	}
+	while (fgets(buf, BSIZE, f)) {
+		nitems = sscanf(buf, "%x %s", &tmpid, tmpname);
+		if (nitems != 2)
+			continue;
+		for (j = 0; j < nnames; j++)
+			if (strcasecmp(cache.objs.objs[names[j]].name, 
+			    tmpname) == 0)
 				break;
+		dup = (j < nnames);
+		/* a duplicate name is only kept for its ID */
+		if (dup && (tmpid < 0 || tmpid >= CANOBJ_NIDS 
+		    || cache.objs.byid[tmpid] != 0))
+			continue;
+		if (cache.objs.nobjs == max) {
+			max = max ? max * 2 : 256;
+			tmp = realloc(cache.objs.objs, max * sizeof(*tmp));
+			if (tmp != NULL)
+				cache.objs.objs = tmp;
+			ntmp = realloc(names, max * sizeof(*ntmp));
+			if (ntmp != NULL)
+				names = ntmp;
+			if (tmp == NULL || ntmp == NULL) {
+				fclose(f);
+				goto nomem;
 			}
 		}
-		fclose(f);
-	} else
-		perror(PATH_CANOBJ);
+		i = cache.objs.nobjs++;
+		strcpy(cache.objs.objs[i].name, tmpname);
+		cache.objs.objs[i].id = tmpid;
+		if (!dup)
+			names[nnames++] = i;
+		if (tmpid >= 0 && tmpid < CANOBJ_NIDS 
+		    && cache.objs.byid[tmpid] == 0)
+			cache.objs.byid[tmpid] = i + 1;
+	}
+	fclose(f);
+	if (cache.objs.nobjs == 0) {
+		fprintf(stderr, "%s: no objects\n", PATH_CANOBJ);
+		goto fail;
+	}
+	if (_objdb_phash(names, nnames) < 0)
+		goto nomem;
+	free(names);
+	cache.objs.loaded = 1;
+	return 0;
+nomem:
+	fprintf(stderr, "%s: out of memory\n", PATH_CANOBJ);
+fail:
+	free(names);
+	free(cache.objs.objs);
+	memset(&cache.objs, 0, sizeof(cache.objs));
+	return -1;
+}
 
+/*
+ * Make sure the canobj tables are loaded.  Return 0 on success, -1 on failure.
+ */
+static int
+_objdb_init(void)
+{
+	int retval = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!cache.objs.loaded)
+		retval = _objdb_load();
+	pthread_mutex_unlock(&cache_lock);
 	return retval;
 }
 
+/*
+ * Given a can object name, return a filled out struct canobj.
+ * On success, return 0; failure -1.
+ */
+int 
+can_getobjbyname(char *name, struct canobj *canobj)
+{
+	unsigned int b;
+	int i;
+
+	if (_objdb_init() < 0)
+		return -1;
+	b = _hashname(name, 0) % cache.objs.nbkt;
+	i = cache.objs.byname[_hashname(name, cache.objs.seed[b]) 
+	    & (cache.objs.size - 1)];
+	if (i == 0 || strcasecmp(cache.objs.objs[i - 1].name, name) != 0)
+		return -1;
+	*canobj = cache.objs.objs[i - 1];
+	return 0;
+}
+
 /*
  * Given a can object ID, return a filled out struct canobj.
  * On success, return 0; failure -1.
@@ -312,28 +1385,17 @@ can_getobjbyname(char *name, struct canobj *canobj)
 int 
 can_getobjbyid(int id, struct canobj *canobj)
 {
-	char buf[BSIZE];
-	FILE *f;
-	int nitems; 
-	int retval = -1;
-	char tmpname[MAXHOSTNAMELEN];
-	int tmpid;
+	int i;
 
-	f = fopen(PATH_CANOBJ, "r");
-	if (f != NULL) {
-		while (fgets(buf, BSIZE, f)) {
-			nitems = sscanf(buf, "%x %s", &tmpid, tmpname);
-			if (nitems == 2 && tmpid == id) {
-				strcpy(canobj->name, tmpname);
-				canobj->id = tmpid;
-				retval = 0;
-				break;
-			}
-		}
-		fclose(f);
-	} else
-		perror(PATH_CANOBJ);
-	return retval;
+	if (_objdb_init() < 0)
+		return -1;
+	if (id < 0 || id >= CANOBJ_NIDS)
+		return -1;
+	i = cache.objs.byid[id];
+	if (i == 0)
+		return -1;
+	*canobj = cache.objs.objs[i - 1];
+	return 0;
 }
 
 /* 
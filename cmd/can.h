@@ -1,6 +1,8 @@
 #ifndef _CAN_LIB_H
 #define _CAN_LIB_H
 
+#include <sys/time.h>	/* struct timeval */
+#include <sys/poll.h>	/* POLLIN, POLLOUT for can_wait() */
 #include <asm/meiko/can.h>
 
 #ifndef MAXHOSTNAMELEN
@@ -14,14 +16,49 @@ struct canhostname {
 	char hostname[MAXHOSTNAMELEN];
 };
 
+#define CANOBJ_NIDS	1024	/* object ID is 10 bits */
+
 struct canobj {
 	int id;
 	char name[MAXHOSTNAMELEN];
 };
 
+/*
+ * Asynchronous transaction (see can_txn_submit()).
+ */
+#define CAN_TXN_PENDING		0
+#define CAN_TXN_ACK		1
+#define CAN_TXN_NAK		2
+#define CAN_TXN_TIMEDOUT	3
+
+typedef struct can_txn can_txn_t;
+typedef void (*can_txn_cb_t)(can_txn_t *txn, void *arg);
+
+struct can_txn {
+	can_header_ext	req;		/* request type, object, and target */
+	can_dat		dat;		/* request payload */
+	int		len;		/* request payload length */
+	int		timeout;	/* msec */
+	can_txn_cb_t	cb;		/* completion callback (or NULL) */
+	void		*arg;		/* callback argument */
+	int		status;		/* CAN_TXN_* */
+	can_dat		ack;		/* ACK/NAK payload */
+	int		acklen;		/* ACK/NAK payload length */
+	struct timeval	deadline;	/* private */
+	can_txn_t	*next;		/* private */
+};
+
+typedef struct can_handle can_handle_t;
+
+#ifndef PATH_CAN
+#define PATH_CAN	"/dev/can"
+#endif
 #ifndef PATH_CANHOSTS
 #define PATH_CANHOSTS 	"/etc/canhosts"
 #endif
+#ifndef PATH_CANHOSTS_DB
+#define PATH_CANHOSTS_DB "/etc/canhosts.db"
+#endif
 #ifndef PATH_CANOBJ
 #define PATH_CANOBJ	"/etc/canobj"
 #endif
@@ -35,11 +72,41 @@ extern int can_gethostbyaddr(int c, int m, int n, struct canhostname *canhost);
 extern int can_getobjbyname(char *name, struct canobj *canobj);
 extern int can_getobjbyid(int id, struct canobj *canobj);
 
-extern int can_ack(int fd, can_dat *dat, int len, int acknak, 
-		struct can_packet *ack);
-extern int can_send(int fd, can_header_ext *ext, can_dat *dat, int len);
-extern int can_recv(int fd, can_header_ext *ext, can_dat *dat, int *len, 
+extern can_handle_t *can_open(char *path, int flags);
+extern void can_close(can_handle_t *h);
+extern int can_fd(can_handle_t *h);
+extern int can_map_ring(can_handle_t *h);
+extern int can_get_overruns(can_handle_t *h, unsigned long *lost);
+extern int can_subscribe(can_handle_t *h, struct can_subscription *sub);
+extern int can_set_filter(can_handle_t *h, struct can_filter *filter);
+extern int can_set_txrate(can_handle_t *h, unsigned long pps);
+extern int can_set_rxpoll(can_handle_t *h, unsigned long pps);
+extern int can_get_stats(can_handle_t *h, struct can_stats *st);
+extern int can_set_format(can_handle_t *h, int format);
+extern int can_recv_v2(can_handle_t *h, struct can_packet_v2 *pkts, int npkts);
+extern unsigned long can_nodeid(can_handle_t *h);
+
+extern int can_ack(can_handle_t *h, can_dat *dat, int len, int acknak, 
 		struct can_packet *ack);
-extern int can_recv_ack(int fd, can_header_ext *ext, can_dat *dat, int *len);
+extern void can_pack(can_handle_t *h, struct can_packet *pkt, 
+		can_header_ext *ext, can_dat *dat, int len);
+extern int can_send(can_handle_t *h, can_header_ext *ext, can_dat *dat, 
+		int len);
+extern int can_send_v(can_handle_t *h, struct can_packet *pkts, int npkts);
+extern int can_recv(can_handle_t *h, can_header_ext *ext, can_dat *dat, 
+		int *len, struct can_packet *ack);
+extern int can_recv_v(can_handle_t *h, struct can_packet *pkts, int npkts);
+extern int can_recv_ack(can_handle_t *h, can_header_ext *ext, can_dat *dat, 
+		int *len);
+extern int can_recv_ack_timeout(can_handle_t *h, can_header_ext *ext, 
+		can_dat *dat, int *len, int timeout);
+extern int can_wait(can_handle_t *h, int events, int timeout);
+
+extern int can_transact(can_handle_t *h, can_header_ext *ext, can_dat *dat, 
+		int len, can_dat *ack, int *acklen, int timeout, int retries);
+extern int can_transact_v(can_handle_t *h, struct can_transact *v, int n);
+extern int can_txn_submit(can_handle_t *h, can_txn_t *txn);
+extern int can_txn_poll(can_handle_t *h, int timeout);
+extern can_txn_t *can_txn_next(can_handle_t *h);
 
 #endif /*_CAN_LIB_H*/
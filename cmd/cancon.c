@@ -85,9 +85,8 @@
 
 static can_header_ext console_object;
 static struct canhostname target_ch;
-static int fd;
+static can_handle_t *h;		/* shared by the threads: see can.c */
 static int consobj;
-static unsigned long nodeid;
 static struct canobj resetobj;
 
 typedef enum { NONE, ACK, NAK, TIMEDOUT } acknak_t;
@@ -141,9 +140,9 @@ load_ext_nodeid(can_header_ext *ext, int tp, int obj)
 {
 	ext->ext.type = tp;
 	ext->ext.object = obj;
-	ext->ext.cluster = UNPACK_CLUSTER(nodeid);
-	ext->ext.module = UNPACK_MODULE(nodeid);
-	ext->ext.node = UNPACK_NODE(nodeid);
+	ext->ext.cluster = UNPACK_CLUSTER(can_nodeid(h));
+	ext->ext.module = UNPACK_MODULE(can_nodeid(h));
+	ext->ext.node = UNPACK_NODE(can_nodeid(h));
 }
 
 /*
@@ -259,7 +258,7 @@ reader(void *args)
 	can_dat stolenack = { 1, };
 	struct can_packet ack;
 
-	while (can_recv(fd, &target, &dat, &len, &ack) != -1) {
+	while (can_recv(h, &target, &dat, &len, &ack) != -1) {
 		switch (target.ext.type) {
 		case CANTYPE_ACK:
 		case CANTYPE_NAK:
@@ -269,14 +268,14 @@ reader(void *args)
 			if (target.ext_dat == console_object.ext_dat) {
 				fwrite(&dat.dat_b[0], len, 1, stdout);
 				fflush(stdout);
-				can_ack(fd, NULL, 0, CANTYPE_ACK, &ack);
+				can_ack(h, NULL, 0, CANTYPE_ACK, &ack);
 			}
 			break;
 		case CANTYPE_WO:
 			if (target.ext.object == CANOBJ_FORCE_DISCONN
 				      && dat.dat == console_object.ext_dat) {
 				fprintf(stderr, "\r\nConsole has been stolen!");
-				can_ack(fd, &stolenack, 4, CANTYPE_ACK, &ack);
+				can_ack(h, &stolenack, 4, CANTYPE_ACK, &ack);
 				start_disconnect();
 			}
 			break;
@@ -365,7 +364,7 @@ mysend(can_header_ext *target, can_dat *dat, int len, can_dat *ack,
 
 	do {
 		try++;
-		can_send(fd, target, dat, len);
+		can_send(h, target, dat, len);
 
 		response = waitfor_acknak(target, ack);
 
@@ -722,16 +721,12 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	fd = open("/dev/can", O_RDWR);
-	if (fd < 0) {
-		perror("/dev/can");
+	h = can_open(NULL, O_RDWR);
+	if (h == NULL) {
+		perror(PATH_CAN);
 		exit(1);
 	}
-	if (ioctl(fd, CAN_GET_ADDR, &nodeid) < 0) {
-		perror("ioctl CAN_GET_ADDR");
-		return -1;
-	}
-	if (ioctl(fd, CAN_GET_CONSOBJ, &consobj) < 0) {
+	if (ioctl(can_fd(h), CAN_GET_CONSOBJ, &consobj) < 0) {
 		perror("ioctl CAN_GET_CONSOBJ");
 		return -1;
 	}
@@ -26,15 +26,17 @@
  * $Id: canctrl.c,v 1.5 2001/07/31 08:53:59 garlick Exp $
  *
  * Simple CAN transaction: send a packet, if ACK expected, receive/decode it.
+ * Given a comma separated list of hosts, do the same with each, all at once.
  */
 
 #include <sys/fcntl.h>
 #include <sys/ioctl.h>
 #include <asm/param.h> 	/* for HZ */
-#include <signal.h>
 #include <errno.h>
 #include <stdint.h>	/* for uintN_t types */
 #include <stdio.h>
+#include <stdlib.h>	/* exit */
+#include <string.h>	/* strtok */
 #include <unistd.h>
 #include "can.h"
 
@@ -74,29 +76,48 @@ str_to_obj(char *s, can_header_ext *ext)
 	return 0;
 }
 
-void 
-dummy_hand(int x)
+void
+print_reply(int type, can_dat *dat, int len)
 {
+	char tmp1[255] = "", tmp2[255] = "";
+	int i;
+
+	printf("%s", type == CANTYPE_ACK ? "ACK" : "NAK");
+
+	if (len > 0) {
+		for (i = 0; i < len; i++) {
+			sprintf(tmp1 + strlen(tmp1), "%2.2x ",
+					dat->dat_b[i]);
+			sprintf(tmp2 + strlen(tmp2), "%c", 
+					CHR(dat->dat_b[i]));
+		}
+		printf(":  %-11.11s   '%-4.4s'\n", tmp1, tmp2);
+	} else 
+		printf("\n");
 }
 
+static struct canhostname ch[CAN_TRANSACT_MAX];
+static struct can_transact tv[CAN_TRANSACT_MAX];
+
 int
 main(int argc, char *argv[])
 {
 	can_header_ext req;
 	can_dat req_data, ack_data;
 	int req_len, ack_len;
-	int fd, i, bytes;
-	struct canhostname ch;
-	char tmp1[255] = "", tmp2[255] = "";
+	can_handle_t *h;
+	int i, bytes, nhosts = 0;
+	char *host;
 
 	if (argc != 5 && argc != 4) {
-		fprintf(stderr,"Usage: canctrl type obj node [hex data]\n");
+		fprintf(stderr,"Usage: canctrl type obj node[,node...] "
+				"[hex data]\n");
 		exit(1);
 	}
 
-	fd = open("/dev/can", O_RDWR);
-	if (fd < 0) {
-		perror("/dev/can");
+	h = can_open(NULL, O_RDWR);
+	if (h == NULL) {
+		perror(PATH_CAN);
 		exit(1);
 	}
 
@@ -108,13 +129,18 @@ main(int argc, char *argv[])
 		fprintf(stderr, "canctrl: %s: unknown object\n", argv[2]);
 		exit(1);
 	}
-	if (can_gethostbyname(argv[3], &ch) == -1) {
-		fprintf(stderr, "canctrl: %s: unknown can host\n", argv[3]);
-		exit(1);
-	} else {
-		req.ext.cluster = ch.cluster;
-		req.ext.module = ch.module;
-		req.ext.node = ch.node;
+	for (host = strtok(argv[3], ","); host; host = strtok(NULL, ",")) {
+		if (nhosts == CAN_TRANSACT_MAX) {
+			fprintf(stderr, "canctrl: more than %d hosts\n", 
+					CAN_TRANSACT_MAX);
+			exit(1);
+		}
+		if (can_gethostbyname(host, &ch[nhosts]) == -1) {
+			fprintf(stderr, "canctrl: %s: unknown can host\n", 
+					host);
+			exit(1);
+		}
+		nhosts++;
 	}
 	if (argc == 5) {
 		if (sscanf(argv[4], "0x%lx", 
@@ -130,51 +156,71 @@ main(int argc, char *argv[])
 	} else
 		req_len = 0;
 
-	signal(SIGALRM, dummy_hand);
-
-	alarm(TIMEOUT);
-	bytes = can_send(fd, &req, &req_data, req_len);
-	if (bytes < 0 && errno == EINTR) {
-		fprintf(stderr, "canctrl: can_send timeout\n");
-		exit(1);
-	}
-	if (bytes != PKTSIZE) {
-		perror("canctrl: can_send");
-		exit(1);
-	}
-
 	switch (req.ext.type) {
 		case CANTYPE_WNA:
 		case CANTYPE_ACK:
 		case CANTYPE_NAK:
 		case CANTYPE_SIG:
+			for (i = 0; i < nhosts; i++) {
+				req.ext.cluster = ch[i].cluster;
+				req.ext.module = ch[i].module;
+				req.ext.node = ch[i].node;
+				if (can_wait(h, POLLOUT, TIMEOUT * 1000) == 0) {
+					fprintf(stderr, 
+					    "canctrl: can_send timeout\n");
+					exit(1);
+				}
+				bytes = can_send(h, &req, &req_data, req_len);
+				if (bytes != PKTSIZE) {
+					perror("canctrl: can_send");
+					exit(1);
+				}
+			}
 			exit(0);
 	}
 
-	bytes = can_recv_ack(fd, &req, &ack_data, &ack_len);
-	alarm(0);
-	if (bytes < 0 && errno == EINTR) {
-		fprintf(stderr, "canctrl: can_recv_ack timeout\n");
-		exit(1);
+	if (nhosts == 1) {
+		req.ext.cluster = ch[0].cluster;
+		req.ext.module = ch[0].module;
+		req.ext.node = ch[0].node;
+		if (can_transact(h, &req, &req_data, req_len, &ack_data, 
+				&ack_len, TIMEOUT * 1000, 0) < 0) {
+			if (errno == ETIMEDOUT)
+				fprintf(stderr, 
+				    "canctrl: can_transact timeout\n");
+			else
+				perror("canctrl: can_transact");
+			exit(1);
+		}
+		print_reply(req.ext.type, &ack_data, ack_len);
+		can_close(h);
+		exit(0);
+	}
+
+	for (i = 0; i < nhosts; i++) {
+		tv[i].req = req;
+		tv[i].req.ext.cluster = ch[i].cluster;
+		tv[i].req.ext.module = ch[i].module;
+		tv[i].req.ext.node = ch[i].node;
+		tv[i].dat = req_data;
+		tv[i].len = req_len;
+		tv[i].timeout = TIMEOUT * 1000;
+		tv[i].retries = 0;
 	}
-	if (bytes != PKTSIZE) {
-		perror("canctrl: can_recv_ack");
+	if (can_transact_v(h, tv, nhosts) < 0) {
+		perror("canctrl: can_transact_v");
 		exit(1);
 	}
+	for (i = 0; i < nhosts; i++) {
+		printf("%s: ", ch[i].hostname);
+		if (tv[i].status == CAN_TRANSACT_TIMEDOUT)
+			printf("timeout\n");
+		else
+			print_reply(tv[i].status == CAN_TRANSACT_ACK 
+			    ? CANTYPE_ACK : CANTYPE_NAK, &tv[i].ack, 
+			    tv[i].acklen);
+	}
 
-	printf("%s", req.ext.type == CANTYPE_ACK ? "ACK" : "NAK");
-
-	if (ack_len > 0) {
-		for (i = 0; i < ack_len; i++) {
-			sprintf(tmp1 + strlen(tmp1), "%2.2x ",
-					ack_data.dat_b[i]);
-			sprintf(tmp2 + strlen(tmp2), "%c", 
-					CHR(ack_data.dat_b[i]));
-		}
-		printf(":  %-11.11s   '%-4.4s'\n", tmp1, tmp2);
-	} else 
-		printf("\n");
-
-	close(fd);
+	can_close(h);
 	exit(0);
 }
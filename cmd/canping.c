@@ -33,14 +33,12 @@
 #include <sys/ioctl.h>
 #include <assert.h>
 #include <sys/time.h>
-#include <sys/signal.h>
 #include <asm/param.h> 		/* for HZ */
 #include <stdint.h>		/* for uintN_t types */
 #include <unistd.h>		/* getopt */
 #include <stdlib.h>		/* atoi */
 #include <asm/meiko/elan.h> 	/* for elan_getclock() */
 #include <sys/mman.h>		/* for MAP_SHARED, etc */
-#include <signal.h>
 #include <sys/errno.h>
 #include "can.h"
 
@@ -53,11 +51,6 @@ usage(void)
 	exit(1);
 }
 
-void
-null_handler(int foo)
-{
-}
-
 int
 main(int argc, char *argv[])
 {
@@ -66,12 +59,13 @@ main(int argc, char *argv[])
 	int bytes, ack_len;
 	int fopt = 0;
 	int copt = 0;
-	int count;
+	int count = 0;
 	can_dat send_seq;
 	can_dat recv_seq;
 	uint64_t t1, t2;
 	elanreg_t *elanreg;
 	int fd;
+	can_handle_t *h;
 	struct canhostname ch;
 	char *target_host;
 	extern char *optarg;
@@ -125,9 +119,9 @@ main(int argc, char *argv[])
 	/*
 	 * Open the CAN device and look up target_host's CAN address.
 	 */
-	fd = open("/dev/can", O_RDWR);
-	if (fd < 0) {
-		perror("/dev/can");
+	h = can_open(NULL, O_RDWR);
+	if (h == NULL) {
+		perror(PATH_CAN);
 		exit(1);
 	}
 	if (can_gethostbyname(target_host, &ch) == -1) {
@@ -135,8 +129,6 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	signal(SIGALRM, null_handler);
-
 	/*
 	 * Let the pinging begin!
 	 */
@@ -152,26 +144,17 @@ main(int argc, char *argv[])
 		req.ext.object = testrwobj.id;
 
 		/*
-		 * Write seq integer to TESTRW object.
+		 * Write seq integer to TESTRW object, and receive its old
+		 * value in the ack.
 		 */
 		t1 = elan_getclock(elanreg, NULL);
-		bytes = can_send(fd, &req, &send_seq, sizeof(send_seq));
-		if (bytes < 0) {
-			perror("can_send");
-			exit(1);
-		}
-
-		/*
-		 * Receive old value of TESTRW object in ack.
-		 */
-		alarm(1); /* time out after a sec */
-		bytes = can_recv_ack(fd, &req, &recv_seq, &ack_len);
-		alarm(0);
-		if (bytes < 0 && errno == EINTR)
+		bytes = can_transact(h, &req, &send_seq, sizeof(send_seq), 
+				&recv_seq, &ack_len, 1000, 0); /* 1 sec timeout */
+		if (bytes < 0 && errno == ETIMEDOUT)
 			continue;
 		t2 = elan_getclock(elanreg, NULL);
-		if (bytes != PKTSIZE) {
-			perror("can_recv_ack");
+		if (bytes < 0) {
+			perror("can_transact");
 			exit(1);
 		}
 		responses++;
@@ -191,13 +174,13 @@ main(int argc, char *argv[])
 					(unsigned long)send_seq.dat - 1);
 		} else if (ack_len != sizeof(recv_seq)) {
 			printf(" <-- size of response (%d) != %d\n", 
-					ack_len, sizeof(recv_seq));
+					ack_len, (int)sizeof(recv_seq));
 		} else {
 			printf("\n");
 		}
 		if (!fopt)
 			sleep(1);
 	}
-	close(fd);
+	can_close(h);
 	exit(responses > 0 ? 0 : 1);
 }
@@ -27,6 +27,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/fcntl.h>
 #include <sys/ioctl.h>
@@ -60,10 +62,11 @@ obj_to_str(int type, int id)
  * 6.555 00c->013  ACK 00,00,0c 0031        00 00 00 04 '....'
  */
 static void 
-decode(struct can_packet *pkt, int no_heartbeat)
+decode(struct can_packet *pkt, uint64_t nsec, int no_heartbeat)
 {
 	static unsigned long last_stamp = 0;
 	static unsigned long first_stamp = 0;
+	static uint64_t first_nsec = 0;
 	static float sec_stamp;
 	struct canhostname ch;
 	char tmp1[255] = "";
@@ -77,9 +80,15 @@ decode(struct can_packet *pkt, int no_heartbeat)
 		first_stamp = pkt->timestamp;
 	sec_stamp = (float)(pkt->timestamp - first_stamp) / HZ;
 
-	/* can header */
-	printf("%-.3f %3.3x->%3.3x  ", 
-	    sec_stamp, pkt->can.can.src, pkt->can.can.dest);
+	/* can header (with elan clock stamp to the usec if we have one) */
+	if (nsec != 0) {
+		if (first_nsec == 0)
+			first_nsec = nsec;
+		printf("%-.6f %3.3x->%3.3x  ", (double)(nsec - first_nsec) / 1E9, 
+		    pkt->can.can.src, pkt->can.can.dest);
+	} else
+		printf("%-.3f %3.3x->%3.3x  ", 
+		    sec_stamp, pkt->can.can.src, pkt->can.can.dest);
 	if (pkt->can.can.length < 4) { 
 		printf("len=%d - ERROR bad packet length\n", 
 		    pkt->can.can.length);
@@ -109,14 +118,30 @@ decode(struct can_packet *pkt, int no_heartbeat)
 	printf("  %-11.11s %-4.4s\n", tmp1, tmp2);
 }
 
-#define NPKT	1
+#define NPKT	64
+
+/* 
+ * Filter program for -h: drop heartbeats in the driver.
+ */
+static struct can_filter no_heartbeat_filter = {
+	4, {
+		CANF_STMT(CANF_LD, CANF_F_OBJECT),
+		CANF_JUMP(CANF_JEQ, CANOBJ_HEARTBEAT, 0, 1),
+		CANF_STMT(CANF_RET, 0),
+		CANF_STMT(CANF_RET, 1),
+	}
+};
 
 int
 main(int argc, char *argv[])
 {
 	struct can_packet pkt[NPKT];	
-	int fd, i, bytes, packets; 
+	struct can_packet_v2 pkt2[NPKT];
+	can_handle_t *h;
+	int i, packets; 
 	int no_heartbeat = 0;
+	int nsec = 0;
+	unsigned long lost;
 
 #if 0
 	printf("CAN Packets are size %d\n", PKTSIZE);
@@ -125,39 +150,60 @@ main(int argc, char *argv[])
 	printf("ext %d\n", (unsigned long)&pkt[0].data - (unsigned long)&pkt[0].ext.ext);
 #endif
 
-	fd = open("/dev/can", O_RDONLY);
-	if (fd < 0) {
-		perror("/dev/can");
+	h = can_open(NULL, O_RDONLY);
+	if (h == NULL) {
+		perror(PATH_CAN);
 		exit(1);
 	}
 	/* request to receive packets sent by this node to someone else */
-	if (ioctl(fd, CAN_SET_SNOOPY) < 0) {
+	if (ioctl(can_fd(h), CAN_SET_SNOOPY) < 0) {
 		perror("ioctl");
 		exit(1);
 	}
 	while (argc > 1) {
 		if (!strcmp(argv[1], "-p")) {
-			if (ioctl(fd, CAN_SET_PROMISCUOUS) < 0)
+			if (ioctl(can_fd(h), CAN_SET_PROMISCUOUS) < 0)
 				perror("ioctl");
 		} else if (!strcmp(argv[1], "-h")) {
+			/* if the driver can't filter, decode() will */
 			no_heartbeat = 1;
+			(void)can_set_filter(h, &no_heartbeat_filter);
+		} else if (!strcmp(argv[1], "-n")) {
+			/* nanosecond stamps - read(2) only */
+			if (can_set_format(h, CAN_FORMAT_2) < 0)
+				perror("can_set_format");
+			else
+				nsec = 1;
 		} else {
-			fprintf(stderr, "Usage: cansnoop [-p] [-h]\n");
+			fprintf(stderr, "Usage: cansnoop [-p] [-h] [-n]\n");
 			exit(1);
 		}
 		argc--;
 		argv++;
 	}
 
-	do {
-		bytes = read(fd, pkt, PKTSIZE * NPKT);
-		packets = bytes / PKTSIZE;
-		assert(bytes % PKTSIZE == 0);
+	/* take packets from a shared ring if we can, else read(2) them */
+	if (!nsec)
+		(void)can_map_ring(h);
 
-		for (i = 0; i < packets; i++)
-			decode(&pkt[i], no_heartbeat);
+	do {
+		if (nsec)
+			packets = can_recv_v2(h, pkt2, NPKT);
+		else
+			packets = can_recv_v(h, pkt, NPKT);
+
+		/* driver drops packets if we fall too far behind */
+		if (can_get_overruns(h, &lost) == 0 && lost > 0)
+			printf("*** %lu packets lost ***\n", lost);
+
+		for (i = 0; i < packets; i++) {
+			if (nsec)
+				decode(&pkt2[i].pkt, pkt2[i].nsec, no_heartbeat);
+			else
+				decode(&pkt[i], 0, no_heartbeat);
+		}
 	} while (packets >= 1);
 
-	close(fd);
+	can_close(h);
 	exit(0);
 }
@@ -22,6 +22,8 @@
 
 elanreg_t 	*elanreg = NULL;
 
+EXPORT_SYMBOL(elanreg);		/* can.o stamps packets with the clock */
+
 void
 elan_init(void)
 {
@@ -43,9 +43,8 @@
 
 static cringbuf_t 		cancon_outbuf, cancon_inbuf;
 static int			cancon_ack_pending = 0;
-#if 0
 static spinlock_t		cancon_ack_pending_lock = SPIN_LOCK_UNLOCKED;
-#endif
+static spinlock_t		cancon_outbuf_lock = SPIN_LOCK_UNLOCKED;
 
 /* see arch/sparc/kernel/setup.c (XXX unused now?) */
 int 				use_can_console = 0; 
@@ -68,69 +67,60 @@ static struct 			timer_list ack_timer;
 
 extern uint32_t			can_nodeid;
 
+/* 
+ * The rings are SPSC: char_to_ring() callers must be serialized against
+ * each other, as must ring_to_char() and clear_ring() callers.
+ */
+
 /* fail (return 0) if buffer is full */
 static int 
 char_to_ring(char c, cringbuf_t *r)
 {
-	int retval = 1;
-#if 0
-	unsigned long flags;
-
-	if (r->use_inlock)
-		spin_lock_irqsave(&r->inlock, flags);
-#endif
 	if (RING_FULL(*r))
-		retval = 0;
-	else
-		RING_IN(*r, c);
-#if 0
-	if (r->use_inlock)
-		spin_unlock_irqrestore(&r->inlock, flags);
-#endif
-	return retval;
+		return 0;
+	RING_IN(*r, c);
+	return 1;
 }
 
 /* fail (return 0) if buffer is empty */
 static int 
 ring_to_char(char *c, cringbuf_t *r)
 {
-	int retval = 1;
-#if 0
+        if (RING_EMPTY(*r))
+		return 0;
+	RING_OUT(*r, *c);
+	return 1;
+}
+
+static void
+clear_ring(cringbuf_t *r)
+{
+	RING_CLEAR(*r);
+}	
+
+/* put a char in outbuf on behalf of the tty (fail if full) */
+static int
+cancon_putc(char c)
+{
 	unsigned long flags;
+	int retval;
 
-	if (r->use_outlock)
-		spin_lock_irqsave(&r->outlock, flags);
-#endif
-        if (RING_EMPTY(*r))
-		retval = 0;
-	else
-		RING_OUT(*r, *c);
-#if 0
-	if (r->use_outlock)
-		spin_unlock_irqrestore(&r->outlock, flags);
-#endif
+	spin_lock_irqsave(&cancon_outbuf_lock, flags);
+	retval = char_to_ring(c, &cancon_outbuf);
+	spin_unlock_irqrestore(&cancon_outbuf_lock, flags);
 	return retval;
 }
 
+/* toss outbuf (consumer side, so under cancon_ack_pending_lock) */
 static void
-clear_ring(cringbuf_t *r)
+cancon_flush(void)
 {
-#if 0
 	unsigned long flags;
 
-	if (r->use_outlock)
-		spin_lock_irqsave(&r->outlock, flags);
-	if (r->use_inlock)
-		spin_lock_irqsave(&r->inlock, flags);
-#endif
-	RING_CLEAR(*r);
-#if 0
-	if (r->use_inlock)
-		spin_unlock_irqrestore(&r->inlock, flags);
-	if (r->use_outlock)
-		spin_unlock_irqrestore(&r->outlock, flags);
-#endif
-}	
+	spin_lock_irqsave(&cancon_ack_pending_lock, flags);
+	clear_ring(&cancon_outbuf);
+	spin_unlock_irqrestore(&cancon_ack_pending_lock, flags);
+}
 
 /*
  * Set the cancon_rmt variable to point to the node/object contained
@@ -162,11 +152,11 @@ cancon_send_next(void)
 	int count;
 	unsigned long flags;
 
+	spin_lock_irqsave(&cancon_ack_pending_lock, flags);
 	if (CANCON_UNCONNECTED(cancon_rmt)) { 
 		clear_ring(&cancon_outbuf);
-		return;
+		goto fail;
 	}
-	spin_lock_irqsave(&cancon_ack_pending_lock, flags);
 	if (cancon_ack_pending)
 		goto fail;
 
@@ -184,19 +174,27 @@ cancon_send_next(void)
 	pkt.can.can.dest = IS_LOCAL(pkt.ext) ? pkt.ext.ext.node : CAN_MODULE_H8;
 	pkt.ext.ext.type = CANTYPE_DAT;
 
-	/* try to send the packet--it is possible to fail here and drop one */
-	if (!send_pkt(&pkt))
-		goto fail;
-
-	/* we won't send another until this one is ACKed */
+	/* 
+	 * We won't send another until this one is ACKed, and the ACK may 
+	 * come before send_pkt() returns, so claim it and schedule the ACK 
+	 * timeout first.  Don't hold the lock over send_pkt(): it may 
+	 * deliver to us, and cancon_recv_ack() takes it.
+	 */
 	cancon_ack_pending = 1;
-	spin_unlock_irqrestore(&cancon_ack_pending_lock, flags);
-
-	/* schedule ack timeout */
 	ack_timer.expires = jiffies + CANCON_ACK_TIMEOUT;
 	ack_timer.function = cancon_recv_ack;
 	ack_timer.data = 1; 
 	add_timer(&ack_timer);
+	spin_unlock_irqrestore(&cancon_ack_pending_lock, flags);
+
+	/* try to send the packet--it is possible to fail here and drop one */
+	if (!send_pkt(&pkt)) {
+		del_timer(&ack_timer);
+		spin_lock_irqsave(&cancon_ack_pending_lock, flags);
+		cancon_ack_pending = 0;
+		spin_unlock_irqrestore(&cancon_ack_pending_lock, flags);
+		return;
+	}
 
 	/* let tty routines know buffer space is available */
 	cantty_write_wakeup(NULL);
@@ -237,14 +235,17 @@ static void
 cancon_printk_write(struct console *con, const char *str, unsigned count)
 {
 	int todo = count;
+	unsigned long flags;
 
 	if (CANCON_UNCONNECTED(cancon_rmt) || count == 0)
 		return;
+	spin_lock_irqsave(&cancon_outbuf_lock, flags);
 	while (todo-- > 0) {
 		if (*str == '\n')
 			char_to_ring('\r', &cancon_outbuf);
 		char_to_ring(*str++, &cancon_outbuf);
 	}
+	spin_unlock_irqrestore(&cancon_outbuf_lock, flags);
 	cancon_send_next();
 }
 
@@ -291,7 +292,7 @@ static struct console can_console = {
 void
 cantty_hangup(void)
 {
-	clear_ring(&cancon_outbuf);
+	cancon_flush();
 	clear_ring(&cancon_inbuf);
 	if (ttyp != NULL)
 		tty_hangup(ttyp);
@@ -392,7 +393,7 @@ cantty_write(struct tty_struct *tty, int from_user, const unsigned char *buf,
 			}
 		} else
 			c = buf[i];
-		if (!char_to_ring(c, &cancon_outbuf))
+		if (!cancon_putc(c))
 			break;
 	}
         if (i > 0)
@@ -416,7 +417,7 @@ cantty_write_room(struct tty_struct *tty)
 static void 
 cantty_put_char(struct tty_struct *tty, unsigned char ch)
 {
-	char_to_ring(ch, &cancon_outbuf);
+	cancon_putc(ch);
 	cancon_send_next();
 }
 
@@ -426,7 +427,7 @@ cantty_put_char(struct tty_struct *tty, unsigned char ch)
  */
 static void cantty_flush_buffer(struct tty_struct *tty)
 {
-	clear_ring(&cancon_outbuf);
+	cancon_flush();
 	cantty_write_wakeup(tty);
 }
 
@@ -504,12 +505,12 @@ void
 cancon_init(void)
 {
 	/* 
-	 * printk and tty can write to outbuf concurrently, but
-	 * outbuf->can is serialized by cancon_ack_pending lock.
+	 * printk and tty can write to outbuf concurrently, so producers
+	 * are serialized by cancon_outbuf_lock, and outbuf->can is 
+	 * serialized by cancon_ack_pending_lock.
 	 * (We can only have one ACK outstanding at a time.)
  	 */
 	RING_INIT(cancon_outbuf);
-	RING_INIT_INLOCK(cancon_outbuf);
 	/*
 	 * inbuf is entirely serial:  (can->inbuf, inbuf->tty)
 	 * No locking required.
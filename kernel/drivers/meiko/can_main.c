@@ -24,104 +24,246 @@
 #include <linux/interrupt.h>
 #include <linux/tqueue.h>	/* for struct tq_struct */
 #include <linux/major.h>	/* for MISC_MAJOR */
+#include <linux/sched.h>	/* for add_wait_queue(), schedule() */
+#include <linux/timer.h>	/* for time_after() */
+#include <linux/mm.h>		/* for remap_page_range() */
+#include <linux/wrapper.h>	/* for mem_map_reserve() */
 #include <asm/io.h> 		/* for sparc_alloc_io(), sparc_free_io() */
 #include <asm/spinlock.h>	/* for spin_lock_irqsave(), etc */
+#include <asm/bitops.h>		/* for test_and_set_bit(), etc */
+#include <asm/system.h>		/* for __cli(), wmb(), etc */
+#include <linux/smp.h>		/* for smp_processor_id() */
+#include <asm/semaphore.h>	/* for down_interruptible() */
+#include <linux/proc_fs.h>	/* for create_proc_entry() */
+#include <linux/delay.h>	/* for udelay() */
 
 #include <asm/meiko/obp.h>
 #include <asm/meiko/can.h>
+#include <asm/meiko/elan.h>
 #include <asm/meiko/debug.h>
 
-static ringbuf_t 	inq, outq;	
+static pktq_t	 	inq, outq[TXQ_MAX];	
+static struct can_stats	canstats;	/* see can_get_stats() */
+static unsigned long	lost_closed = 0;	/* fs->lost of closed fd's */
+static struct proc_dir_entry *can_proc_dir = NULL;
+static spinlock_t	rx_lock = SPIN_LOCK_UNLOCKED;	/* chip rx, rxpolling */
+static int		rxpolling = 0;		/* receive interrupt masked */
+static unsigned long	rxpoll_rate = 0;	/* CAN_SET_RXPOLL */
+static unsigned long	rxwin_start = 0;	/* jiffies */
+static unsigned long	rxwin_count = 0;	/* packets since rxwin_start */
+static struct timer_list rxpoll_timer;		/* backstop for polling */
+static unsigned long	xmit_flags = 0;		/* XMIT_BUSY, XMIT_AGAIN */
+static struct file_state *txfd[CAN_MAX_USECOUNT];	/* fd's with txq's */
+static int		txfd_count = 0;
+static int		txsched_cur = 0;	/* 0 = kernel, else txfd[n-1] */
+static struct timer_list txtimer;		/* retry rate capped fd's */
+static int		txtimer_armed = 0;
+static struct can_packet rxlog[RXLOG_SIZE];
+static unsigned long	rxlog_rcpt[RXLOG_SIZE];	/* RX_ANY, RX_MONITOR or fd id */
+static uint64_t		rxlog_nsec[RXLOG_SIZE];	/* elan clock stamps */
+static volatile unsigned long rxlog_head = 0;	/* seq of next entry */
+static struct can_ackwait ackwait_pool[ACKWAIT_MAX];
+static struct can_ackwait *ackwait_hash[ACKWAIT_HASH];
+static struct can_ackwait *ackwait_free = NULL;
+static unsigned long	ackwait_overflow = 0;
+static unsigned long	next_fd_id = 1;
 
 static int		can_debug = 0;
 static int 		can_usecount = 0;
 static struct can_reg	*reg = NULL;
-static struct wait_queue *writeq = NULL;
+static struct wait_queue *rxwait = NULL;	/* readers of our packets */
+static struct wait_queue *rxwait_all = NULL;	/* promiscuous/snoopy readers */
+static struct wait_queue *txwait = NULL;	/* writers stuck on outq/inq */
 static int		promiscuous_usecount = 0;
 static struct tq_struct bh_tq;
 static struct file_state *openfd[CAN_MAX_USECOUNT];
+static struct file_state *ringfd[CAN_MAX_USECOUNT];	/* fd's with rings */
+static int		ringfd_count = 0;
+static struct can_subidx *subidx[CAN_SUB_OBJWORDS * 32];	/* by object */
+static struct file_state *filtfd[CAN_MAX_USECOUNT];	/* fd's w/filters */
+static int		filtfd_count = 0;
 static char 		consobj_reserved[CANOBJ_CONSMAX - CANOBJ_CONSMIN + 1];
+static uint8_t		accept_code, accept_mask;	/* as programmed */
+static unsigned long	loopback_flags = 0;	/* LOOPBACK_BUSY */
 
 uint32_t			can_nodeid;
 
-static int 		can_init_82c200(int promiscuous);
+static int 		can_init_82c200(void);
+static void		can_update_accept(void);
 static inline void	can_copy_rx(struct can_packet *pkt);
 static inline void	can_copy_tx(struct can_packet *pkt);
 static inline void 	try_xmit(void);
-static inline void 	try_recv(void);
+static inline int 	try_recv(void);
 static void 		can_init_consobj(void);
 static int 		can_alloc_consobj(void);
 
 #define PKTSIZE		(sizeof(struct can_packet))
+#define FS_PKTSIZE(fs)	((fs)->format == CAN_FORMAT_2 \
+			? sizeof(struct can_packet_v2) : PKTSIZE)
+#define RXLOG_BATCH	16		/* format 2 packets per copy out */
 
 static void deliver_pkt(struct can_packet *pkt);
 
 /* 
- * NOTE: pkt_to_ring and ring_to_pkt are MT safe relative to each other,
- * but not to themselves.  Concurrent uses of pkt_to_ring(inq) by the interrupt
- * handler and syscall interface can arise when packets are written to 
- * /dev/can with the local address (loopback) or when the device is in 
- * promiscuous mode.  Concurrent uses of pkt_to_ring(outq) by the hearbeat
- * timeout (via send_pkt) and the write syscall can occur.  Therefore, 
- * spinlocks are used to protect inq and outq input.   
- * 
- * Similar circumstances do NOT arise for inq and outq output, or for either 
- * input or output to the per-fd ring buffers.
+ * NOTE: inq and outq have many producers that can run at once on an SMP.
+ * inq is fed by the interrupt handler, by the bottom half and timers (ACKs
+ * and heartbeats to ourselves, sent packets echoed for snoopers), and by 
+ * write(2) and printk on any CPU.  outq is fed by all of those but the 
+ * interrupt handler.  Instead of locking, each queue is a set of SPSC rings,
+ * one per producer context per CPU, so every ring has exactly one producer:
+ * system calls on a CPU never interrupt each other, and interrupt context
+ * producers (which may nest) hold off local interrupts around the copy.
+ * The consumer merges the rings round-robin, so packets stay in order per 
+ * producer but not across producers.  Each queue has a single consumer: 
+ * the bottom half, which runs on one CPU at a time, for inq; and whoever
+ * holds XMIT_BUSY (see try_xmit()) for outq.
+ *
+ * outq is really one queue per transmit class, drained in strict priority
+ * order, so ACK/NAKs and heartbeats are not stuck behind (or dropped for) 
+ * a flood of user writes.  User bulk packets do not go through outq at all
+ * but through per-fd transmit rings, filled in bulk by user_to_outq() 
+ * under the fd's txsem (copying from user space may sleep) and shared 
+ * out fairly by txsched_next(), also under XMIT_BUSY.
+ *
+ * The receive log has a single producer, the bottom half.  Readers never 
+ * lock it; they detect an entry overwritten under them by re-checking 
+ * rxlog_head after the copy.
  */
 
-static void 
+#define XMIT_BUSY	0		/* bits in xmit_flags */
+#define XMIT_AGAIN	1
+
+#define LOOPBACK_BUSY	0		/* bit in loopback_flags */
+
+#define PKTQ_RING(q, ctx) ((q)->ring[(ctx) * CAN_NR_CPUS + smp_processor_id()])
+
+static void
+pktq_fini(pktq_t *q)
+{
+	int i;
+
+	for (i = 0; i < PKTQ_NRING; i++) {
+		if (q->ring[i] != NULL)
+			kfree(q->ring[i]);
+		q->ring[i] = NULL;
+	}
+}
+
+static int
+pktq_init(pktq_t *q)
+{
+	int i;
+
+	q->next = 0;
+	for (i = 0; i < PKTQ_NRING; i++)
+		q->ring[i] = NULL;
+	for (i = 0; i < PKTQ_NRING; i++) {
+		q->ring[i] = kmalloc(sizeof(ringbuf_t), GFP_KERNEL);
+		if (q->ring[i] == NULL) {
+			pktq_fini(q);
+			return -1;
+		}
+		RING_INIT(*q->ring[i]);
+		q->ring[i]->drops = 0;
+	}
+	return 0;
+}
+
+static int
+pktq_size(pktq_t *q)
+{
+	int i, n = 0;
+
+	for (i = 0; i < PKTQ_NRING; i++)
+		n += RING_SIZE(*q->ring[i]);
+	return n;
+}
+
+/* packets lost because a ring was full */
+static unsigned long
+pktq_drops(pktq_t *q)
+{
+	unsigned long n = 0;
+	int i;
+
+	for (i = 0; i < PKTQ_NRING; i++)
+		n += q->ring[i]->drops;
+	return n;
+}
+
+static void
+can_fini_queues(void)
+{
+	int i;
+
+	pktq_fini(&inq);
+	for (i = 0; i < TXQ_MAX; i++)
+		pktq_fini(&outq[i]);
+}
+
+static int 
 can_init_queues(void)
 {
-	RING_INIT(inq);
-	RING_INIT(outq);
-#if 0
-	RING_INIT_INLOCK(inq);
-	RING_INIT_INLOCK(outq);	
-#endif
+	int i;
+
+	if (pktq_init(&inq) < 0)
+		return -1;
+	for (i = 0; i < TXQ_MAX; i++) {
+		if (pktq_init(&outq[i]) < 0) {
+			can_fini_queues();
+			return -1;
+		}
+	}
+	return 0;
 }
 
-/* fail (return 0) if buffer is full */
+/* fail (return 0) if the calling context's ring is full */
 static int 
-pkt_to_ring(struct can_packet *pkt, ringbuf_t *r)
+pkt_to_ring(struct can_packet *pkt, pktq_t *q)
 {
+	unsigned long flags = 0;
+	int intr = in_interrupt();
+	ringbuf_t *r;
 	int retval = 1;
-#if 0
-	unsigned long flags;
 
-	if (r->use_inlock)
-		spin_lock_irqsave(&r->inlock, flags);
-#endif
-	if (RING_FULL(*r))
+	if (intr) {
+		__save_flags(flags);
+		__cli();
+	}
+	r = PKTQ_RING(q, intr ? CTX_INTR : CTX_PROCESS);
+	if (RING_FULL(*r)) {
+		r->drops++;
 		retval = 0;
-	else
+	} else
 		RING_IN(*r, *pkt);
-#if 0
-	if (r->use_inlock)
-		spin_unlock_irqrestore(&r->inlock, flags);
-#endif
+	if (intr)
+		__restore_flags(flags);
 	return retval;
 }
 
-/* fail (return 0) if buffer is empty */
+/* return 1 if the calling process context's ring is full */
+static inline int
+pktq_full(pktq_t *q)
+{
+	return RING_FULL(*PKTQ_RING(q, CTX_PROCESS));
+}
+
+/* fail (return 0) if all rings are empty */
 static int 
-ring_to_pkt(struct can_packet *pkt, ringbuf_t *r)
+ring_to_pkt(struct can_packet *pkt, pktq_t *q)
 {
-	int retval = 1;
-#if 0
-	unsigned long flags;
+	ringbuf_t *r;
+	int i;
 
-	if (r->use_outlock)
-		spin_lock_irqsave(&r->outlock, flags);
-#endif
-        if (RING_EMPTY(*r))
-		retval = 0;
-	else
-		RING_OUT(*r, *pkt);
-#if 0
-	if (r->use_outlock)
-		spin_unlock_irqrestore(&r->outlock, flags);
-#endif
-	return retval;
+	for (i = 0; i < PKTQ_NRING; i++) {
+		r = q->ring[q->next];
+		q->next = (q->next + 1) % PKTQ_NRING;
+		if (!RING_EMPTY(*r)) {
+			RING_OUT(*r, *pkt);
+			return 1;
+		}
+	}
+	return 0;
 }
 
 /*
@@ -136,25 +278,467 @@ outgoing_fixup(struct can_packet *pkt)
 	pkt->can.can.remote = 0; 	/* manual says always 1 -- typo??? */
 }
 
+/*
+ * While a packet waits in inq, its timestamp holds the low 32 bits of the
+ * elan clock when it was received or sent.  The bottom half widens that 
+ * back to 64 bits for format 2 readers, and puts jiffies back for format 1
+ * readers, which works as long as packets spend less than 4s in inq.
+ */
+static inline uint64_t
+can_getclock(void)
+{
+	if (elanreg == NULL)
+		return (uint64_t)jiffies * (1000000000 / HZ);
+	return elan_getclock(elanreg, NULL);
+}
+
 static inline void 
 incoming_fixup(struct can_packet *pkt)
 {
-	pkt->timestamp = jiffies;
+	pkt->timestamp = (uint32_t)can_getclock();
 }	
 
+/* 
+ * Return the full elan clock stamp, and restore the jiffies stamp.
+ * Also set *agep to how long ago the stamp was taken, in nsec.
+ */
+static inline uint64_t
+incoming_stamp(struct can_packet *pkt, uint32_t *agep)
+{
+	uint64_t now = can_getclock();
+	uint32_t age = (uint32_t)now - pkt->timestamp;
+
+	pkt->timestamp = jiffies - age / (1000000000 / HZ);
+	*agep = age;
+	return now - age;
+}
+
 #define IS_MYPACKET(x) ((x)->can.can.dest == UNPACK_NODE(can_nodeid))
+#define WANTS_ALL(fs)	((fs)->promiscuous || (fs)->snoopy)
+
+#define IS_ACKABLE(t)	((t) == CANTYPE_RO || (t) == CANTYPE_WO \
+			|| (t) == CANTYPE_DAT)
+#define IS_ACKNAK(t)	((t) == CANTYPE_ACK || (t) == CANTYPE_NAK)
+#define IS_HEARTBEAT(x)	((x)->ext.ext.type == CANTYPE_WNA \
+			&& ((x)->ext.ext.object == CANOBJ_HEARTBEAT \
+			|| (x)->ext.ext.object == CANOBJ_IAM))
+
+/* 
+ * Pick a transmit class.  ACK/NAKs and heartbeats go out at high priority 
+ * on the bus as well; bulk packets keep the priority the sender gave them.
+ */
+static inline int
+txclass(struct can_packet *pkt)
+{
+	if (IS_ACKNAK(pkt->ext.ext.type)) {
+		pkt->can.can.lpriority = CAN_HIGH_PRIORITY;
+		return TXQ_CTRL;
+	}
+	if (IS_HEARTBEAT(pkt)) {
+		pkt->can.can.lpriority = CAN_HIGH_PRIORITY;
+		return TXQ_HB;
+	}
+	return TXQ_BULK;
+}
+
+/* 
+ * Who a receive log entry is for: everyone whose filter passes it, only
+ * promiscuous/snoopy fd's (an ACK/NAK no fd is waiting for), or the fd 
+ * whose id is given (an ACK/NAK for its request) and promiscuous fd's.
+ */
+#define RX_ANY		0UL
+#define RX_MONITOR	(~0UL)
+
+/* 
+ * Return 1 if a packet falls within an fd's subscription.
+ */
+static inline int
+sub_match(struct can_subscription *sub, struct can_packet *pkt)
+{
+	int i;
+
+	if (!CAN_SUB_ISSET(sub, pkt->ext.ext.object))
+		return 0;
+	if (sub->types != 0 && !(sub->types & (1 << pkt->ext.ext.type)))
+		return 0;
+	if (sub->npeers == 0)
+		return 1;
+	for (i = 0; i < sub->npeers; i++) {
+		if (sub->peers[i].ext.cluster == pkt->ext.ext.cluster
+				&& sub->peers[i].ext.module == pkt->ext.ext.module
+				&& sub->peers[i].ext.node == pkt->ext.ext.node)
+			return 1;
+	}
+	return 0;
+}
+
+/* helper for can_filter_run() */
+static inline uint32_t
+can_filter_field(struct can_packet *pkt, uint32_t field)
+{
+	switch (field) {
+		case CANF_F_LPRIORITY:	return pkt->can.can.lpriority;
+		case CANF_F_DEST:	return pkt->can.can.dest;
+		case CANF_F_SRC:	return pkt->can.can.src;
+		case CANF_F_LENGTH:	return pkt->can.can.length;
+		case CANF_F_XPRIORITY:	return pkt->ext.ext.xpriority;
+		case CANF_F_TYPE:	return pkt->ext.ext.type;
+		case CANF_F_CLUSTER:	return pkt->ext.ext.cluster;
+		case CANF_F_MODULE:	return pkt->ext.ext.module;
+		case CANF_F_NODE:	return pkt->ext.ext.node;
+		case CANF_F_OBJECT:	return pkt->ext.ext.object;
+		case CANF_F_DAT:	return pkt->dat.dat;
+		default:		return 0;
+	}
+}
+
+/* evaluate a filter program's conditional jump */
+static inline int
+can_filter_test(struct can_filter_insn *in, uint32_t A)
+{
+	switch (in->code) {
+		case CANF_JEQ:
+			return (A == in->k);
+		case CANF_JGT:
+			return (A > in->k);
+		case CANF_JGE:
+			return (A >= in->k);
+		case CANF_JSET:
+		default:
+			return ((A & in->k) != 0);
+	}
+}
+
+/*
+ * Run a packet filter program (see struct can_filter).  The program was
+ * checked by can_filter_check(), so pc stays in bounds.
+ */
+static uint32_t
+can_filter_run(struct can_filter *f, struct can_packet *pkt)
+{
+	struct can_filter_insn *in;
+	uint32_t A = 0;
+	int pc = 0;
+
+	for (;;) {
+		in = &f->insns[pc++];
+		switch (in->code) {
+			case CANF_LD:
+				A = can_filter_field(pkt, in->k);
+				continue;
+			case CANF_LDB:
+				A = pkt->dat.dat_b[in->k];
+				continue;
+			case CANF_AND:
+				A &= in->k;
+				continue;
+			case CANF_JEQ:
+			case CANF_JGT:
+			case CANF_JGE:
+			case CANF_JSET:
+				pc += can_filter_test(in, A) ? in->jt : in->jf;
+				continue;
+			case CANF_RET:
+			default:
+				return in->k;
+		}
+	}
+}
+
+/*
+ * Could a filter program accept some packet with this lpriority and dest
+ * (the fields the 82C200's acceptance filter sees)?  A test on any other
+ * field could go either way, so both branches are tried.  Jumps only go 
+ * forward, so memo[] can record the answer from each such test, and each 
+ * is worked out once.  Call with known = 1, A = 0.
+ */
+static int
+can_filter_may_accept(struct can_filter *f, int pc, int known, uint32_t A,
+    uint32_t lpri, uint32_t dest, uint8_t *memo)
+{
+	struct can_filter_insn *in;
+	int r;
+
+	for (;;) {
+		in = &f->insns[pc];
+		switch (in->code) {
+			case CANF_LD:
+				known = (in->k == CANF_F_LPRIORITY 
+				    || in->k == CANF_F_DEST);
+				A = (in->k == CANF_F_LPRIORITY) ? lpri : dest;
+				pc++;
+				continue;
+			case CANF_LDB:
+				known = 0;
+				pc++;
+				continue;
+			case CANF_AND:
+				A &= in->k;
+				pc++;
+				continue;
+			case CANF_RET:
+				return (in->k != 0);
+		}
+		if (known) {
+			pc += 1 + (can_filter_test(in, A) ? in->jt : in->jf);
+			continue;
+		}
+		if (memo[pc] == 0) {
+			r = can_filter_may_accept(f, pc + 1 + in->jt, 0, 0,
+			    lpri, dest, memo) 
+			    || can_filter_may_accept(f, pc + 1 + in->jf, 0, 0, 
+			    lpri, dest, memo);
+			memo[pc] = r ? 2 : 1;
+		}
+		return (memo[pc] == 2);
+	}
+}
+
+/*
+ * Return 1 if an fd's filter accepts log entry 'seq'.  The bottom half 
+ * runs the filter once per entry as it is logged and keeps the verdict 
+ * in filtpass; only entries logged before the filter was installed are 
+ * run here.
+ */
+static inline int
+filt_pass(struct file_state *fs, struct can_packet *pkt, unsigned long seq)
+{
+	if (fs->filter == NULL)
+		return 1;
+	if ((long)(seq - fs->filtseq) >= 0)
+		return test_bit(RXLOG_SLOT(seq), fs->filtpass);
+	return (can_filter_run(fs->filter, pkt) != 0);
+}
+
+/*
+ * Return 1 if an fd should receive log entry 'seq', a packet with 
+ * recipient 'rcpt'.
+ */
+static inline int
+fd_wants(struct file_state *fs, struct can_packet *pkt, unsigned long rcpt,
+	unsigned long seq)
+{
+	if (rcpt == RX_MONITOR && !WANTS_ALL(fs))
+		return 0;
+	if (rcpt != RX_ANY && rcpt != RX_MONITOR && rcpt != fs->id
+			&& !fs->promiscuous)
+		return 0;
+	if (!IS_MYPACKET(pkt) && !WANTS_ALL(fs))
+		return 0;
+	if (fs->sub != NULL && !sub_match(fs->sub, pkt))
+		return 0;
+	return filt_pass(fs, pkt, seq);
+}
+
+/*
+ * Every fd is woken through its own queue for packets routed to it, 
+ * objects it subscribes to, or packets its filter accepts.  Other fd's 
+ * also wait on a shared queue: one for our packets and one for everything.
+ */
+static inline struct wait_queue **
+fd_sharedq(struct file_state *fs)
+{
+	if (fs->sub != NULL || fs->filter != NULL)
+		return NULL;
+	return WANTS_ALL(fs) ? &rxwait_all : &rxwait;
+}
+
+/*
+ * ACK/NAK routing.  can_write() and can_transact() record each request they
+ * queue; the bottom half looks up incoming ACK/NAKs and hands them to the 
+ * fd, or the CAN_TRANSACT caller, that is waiting.
+ * Retries of a request by the same fd reuse its entry.  Entries that time 
+ * out are reclaimed when the free list runs dry.
+ */
+static void
+ackwait_init(void)
+{
+	int i;
+
+	for (i = 0; i < ACKWAIT_HASH; i++)
+		ackwait_hash[i] = NULL;
+	ackwait_free = NULL;
+	for (i = 0; i < ACKWAIT_MAX; i++) {
+		ackwait_pool[i].next = ackwait_free;
+		ackwait_free = &ackwait_pool[i];
+	}
+}
+
+/* 
+ * Remove entries belonging to fs (or, if fs is NULL, expired entries) 
+ * to the free list.  Call with bottom halves disabled.
+ */
+static void
+ackwait_purge(struct file_state *fs)
+{
+	struct can_ackwait **ap, *a;
+	int i;
+
+	for (i = 0; i < ACKWAIT_HASH; i++) {
+		ap = &ackwait_hash[i];
+		while ((a = *ap) != NULL) {
+			if (fs ? a->fs == fs : time_after(jiffies, a->expires)){
+				*ap = a->next;
+				a->next = ackwait_free;
+				ackwait_free = a;
+			} else
+				ap = &a->next;
+		}
+	}
+}
+
+/* 
+ * Record a request that expires after tmo jiffies.
+ * Return 0, or -1 if there was no room to track it.
+ */
+static int
+ackwait_add(struct file_state *fs, struct can_packet *pkt, 
+    struct can_xact *xact, unsigned long tmo)
+{
+	uint32_t key = ACKWAIT_KEY(pkt->ext);
+	struct can_ackwait **ap, *a;
+	int rv = 0;
+
+	start_bh_atomic();
+	for (ap = &ackwait_hash[ACKWAIT_BUCKET(key)]; *ap; ap = &(*ap)->next)
+		if ((*ap)->key == key && (*ap)->fs == fs)
+			break;
+	if ((a = *ap) == NULL) {
+		if (ackwait_free == NULL)
+			ackwait_purge(NULL);
+		if (ackwait_free == NULL) {
+			ackwait_overflow++;
+			rv = -1;
+			goto done;
+		}
+		a = ackwait_free;
+		ackwait_free = a->next;
+		a->key = key;
+		a->fs = fs;
+		a->next = NULL;
+		/* recompute - purge may have changed the chain */
+		for (ap = &ackwait_hash[ACKWAIT_BUCKET(key)]; *ap; 
+		    ap = &(*ap)->next)
+			;
+		*ap = a;	/* append so the oldest request matches first */
+	}
+	a->xact = xact;
+	a->expires = jiffies + tmo;
+done:
+	end_bh_atomic();
+	return rv;
+}
+
+/* 
+ * Forget the request a CAN_TRANSACT caller has stopped waiting for, if the
+ * bottom half hasn't already matched it.  On return no bottom half is 
+ * still delivering the answer, so the caller may use (or free) xact.
+ */
+static void
+ackwait_cancel(struct can_packet *pkt, struct can_xact *xact)
+{
+	uint32_t key = ACKWAIT_KEY(pkt->ext);
+	struct can_ackwait **ap, *a;
+
+	start_bh_atomic();
+	for (ap = &ackwait_hash[ACKWAIT_BUCKET(key)]; (a = *ap) != NULL; 
+	    ap = &a->next) {
+		if (a->xact == xact) {
+			*ap = a->next;
+			a->next = ackwait_free;
+			ackwait_free = a;
+			break;
+		}
+	}
+	end_bh_atomic();
+}
+
+/* 
+ * Find and remove the oldest request an ACK/NAK answers.
+ * Return the fd that sent it, or NULL, and set *xactp if it was sent
+ * by CAN_TRANSACT.  Called from the bottom half.
+ */
+static struct file_state *
+ackwait_match(struct can_packet *pkt, struct can_xact **xactp)
+{
+	uint32_t key = ACKWAIT_KEY(pkt->ext);
+	struct can_ackwait **ap, *a;
+	struct file_state *fs = NULL;
+
+	*xactp = NULL;
+	for (ap = &ackwait_hash[ACKWAIT_BUCKET(key)]; (a = *ap) != NULL; 
+	    ap = &a->next) {
+		if (a->key == key && !time_after(jiffies, a->expires)) {
+			fs = a->fs;
+			*xactp = a->xact;
+			*ap = a->next;
+			a->next = ackwait_free;
+			ackwait_free = a;
+			break;
+		}
+	}
+	return fs;
+}
+
+/* 
+ * Return 1 if can_loopback() would take a packet now.  Not with interrupts
+ * off (printk, or a caller under spin_lock_irqsave()): start_bh_atomic()
+ * waits for a bottom half on another CPU that may want the same lock.
+ */
+static inline int
+loopback_ok(void)
+{
+	unsigned long flags;
+
+	__save_flags(flags);
+	return (!in_interrupt() && (flags & PSR_PIL) != PSR_PIL
+	    && !test_bit(LOOPBACK_BUSY, &loopback_flags));
+}
+
+/*
+ * Deliver a packet sent to this node from process context right away, 
+ * instead of through inq and the bottom half, which is held off while we
+ * do its job.  One caller at a time does this; the rest queue.  Anything 
+ * already in inq goes first, to keep order, and anything queued 
+ * meanwhile, like the kernel object layer's ACK, goes before we return.
+ * Return 1 if delivered, or 0 if the caller should queue the packet: in 
+ * interrupt or bottom half context, with interrupts off, or while 
+ * can_loopback() is busy.
+ */
+static int
+can_loopback(struct can_packet *pkt)
+{
+	struct can_packet p;
+
+	if (!loopback_ok() || test_and_set_bit(LOOPBACK_BUSY, &loopback_flags))
+		return 0;
+	start_bh_atomic();
+	while (ring_to_pkt(&p, &inq))
+		deliver_pkt(&p);
+	deliver_pkt(pkt);
+	canstats.loopback_packets++;
+	while (ring_to_pkt(&p, &inq))
+		deliver_pkt(&p);
+	end_bh_atomic();
+	clear_bit(LOOPBACK_BUSY, &loopback_flags);
+	wake_up_interruptible(&txwait);
+	return 1;
+}
 
 int
 send_pkt_no_out_fixup(struct can_packet *pkt)
 {
-	int instat = 0, outstat = 0;
+	int instat = 0, outstat = 0, class;
 
 	incoming_fixup(pkt);
 
-	if (IS_MYPACKET(pkt))
+	if (IS_MYPACKET(pkt)) {
+		if (can_loopback(pkt))
+			return 1;
 		instat = pkt_to_ring(pkt, &inq);
-	else {
-		outstat = pkt_to_ring(pkt, &outq);
+	} else {
+		class = txclass(pkt);
+		outstat = pkt_to_ring(pkt, &outq[class]);
 #if 0
 		if (outstat && promiscuous_usecount > 0)
 			instat = pkt_to_ring(pkt, &inq);
@@ -181,32 +765,414 @@ send_pkt(struct can_packet *pkt)
 	return send_pkt_no_out_fixup(pkt);
 }
 
-static int 
-user_to_outq(const char *buf, int count)
+/*
+ * Take exclusive use of the transmitter from process context, e.g. to
+ * change the transmit scheduler's state.  Whoever else wanted it in the 
+ * meantime left XMIT_AGAIN set, so have another go on the way out.
+ */
+static void
+xmit_lock(void)
+{
+	while (test_and_set_bit(XMIT_BUSY, &xmit_flags))
+		barrier();
+}
+
+static void
+xmit_unlock(void)
+{
+	clear_bit(XMIT_BUSY, &xmit_flags);
+	if (test_bit(XMIT_AGAIN, &xmit_flags))
+		try_xmit();
+}
+
+/* give an fd its transmit ring and a place in the round-robin */
+static int
+can_alloc_txq(struct file_state *fs)
+{
+	ringbuf_t *r;
+
+	r = kmalloc(sizeof(ringbuf_t), GFP_KERNEL);
+	if (r == NULL)
+		return -ENOMEM;
+	RING_INIT(*r);
+	xmit_lock();
+	fs->txq = r;
+	fs->txdeficit = 0;
+	txfd[txfd_count++] = fs;
+	xmit_unlock();
+	return 0;
+}
+
+/* packets still in the ring are dropped */
+static void
+can_free_txq(struct file_state *fs)
 {
 	int i;
-	struct can_packet pkt;
 
-	for (i = 0; i < count; i++) {
-		copy_from_user_ret(&pkt, buf + (i * PKTSIZE), PKTSIZE, -EFAULT);
-		if (!send_pkt(&pkt))
+	if (fs->txq == NULL)
+		return;
+	xmit_lock();
+	for (i = 0; i < txfd_count; i++)
+		if (txfd[i] == fs)
+			break;
+	if (i < txfd_count)
+		txfd[i] = txfd[--txfd_count];
+	txsched_cur = 0;
+	xmit_unlock();
+	kfree(fs->txq);
+	fs->txq = NULL;
+}
+
+static void
+can_set_txrate(struct file_state *fs, unsigned long rate)
+{
+	xmit_lock();
+	fs->txrate = rate;
+	fs->txtokens = TXQ_BURST * HZ;
+	fs->txstamp = jiffies;
+	xmit_unlock();
+}
+
+/* return 1 if the fd's rate cap lets it send a packet now */
+static int
+txrate_ok(struct file_state *fs)
+{
+	unsigned long elapsed = jiffies - fs->txstamp;
+
+	if (fs->txrate == 0)
+		return 1;
+	if (elapsed > TXQ_BURST * HZ)		/* avoid overflow */
+		fs->txtokens = TXQ_BURST * HZ;
+	else
+		fs->txtokens += elapsed * fs->txrate;
+	if (fs->txtokens > TXQ_BURST * HZ)
+		fs->txtokens = TXQ_BURST * HZ;
+	fs->txstamp = jiffies;
+	return (fs->txtokens >= HZ);
+}
+
+static void
+txtimer_expire(unsigned long foo)
+{
+	txtimer_armed = 0;
+	try_xmit();
+}
+
+/*
+ * Deficit round-robin over the kernel's bulk packets and the fd transmit 
+ * rings.  The kernel sends one packet a turn; an fd sends while the packet
+ * at its tail costs no more than its deficit, which is topped up by 
+ * TXQ_QUANTUM each time its turn comes and forgotten when it runs dry.
+ * Called one packet at a time from try_xmit(), so the round's position
+ * is kept in txsched_cur.
+ */
+static int
+txsched_next(struct can_packet *pkt)
+{
+	struct file_state *fs;
+	ringbuf_t *r;
+	int n, capped = 0;
+
+	for (n = 0; n < 2 * (txfd_count + 1); n++) {
+		if (txsched_cur == 0) {
+			txsched_cur = (txfd_count > 0);
+			if (txsched_cur)
+				txfd[0]->txdeficit += TXQ_QUANTUM;
+			if (ring_to_pkt(pkt, &outq[TXQ_BULK]))
+				return 1;
+			continue;
+		}
+		fs = txfd[txsched_cur - 1];
+		r = fs->txq;
+		if (RING_EMPTY(*r))
+			fs->txdeficit = 0;
+		else if (!txrate_ok(fs))
+			capped = 1;
+		else {
+			rmb();
+			if (TXQ_COST(&RING_TAIL(*r)) <= fs->txdeficit) {
+				fs->txdeficit -= TXQ_COST(&RING_TAIL(*r));
+				RING_OUT(*r, *pkt);
+				if (fs->txrate != 0)
+					fs->txtokens -= HZ;
+				wake_up_interruptible(&fs->writeq);
+				return 1;
+			}
+		}
+		txsched_cur = (txsched_cur + 1) % (txfd_count + 1);
+		if (txsched_cur != 0)
+			txfd[txsched_cur - 1]->txdeficit += TXQ_QUANTUM;
+	}
+	if (capped && !txtimer_armed) {
+		txtimer_armed = 1;
+		txtimer.expires = jiffies + 1;
+		add_timer(&txtimer);
+	}
+	return 0;
+}
+
+/*
+ * Copy up to 'count' packets from user space straight into the fd's 
+ * transmit ring, one copy per contiguous span, then do send_pkt()'s work 
+ * on them in place: packets for us are delivered (see can_loopback()) and
+ * ACK/NAKs and heartbeats go to their own class, all squeezed out of the 
+ * span; packets that leave the node are echoed to inq for snoopers.
+ * A packet is only expected to be ACKed once it is sure to go.
+ * Return the number of packets taken, or -EFAULT/-ERESTARTSYS/-ENOMEM.
+ * When it stops short, *fullq is the queue that was full, or NULL if it
+ * was the fd's own ring.
+ */
+static int 
+user_to_outq(struct file_state *fs, const char *buf, int count, 
+    pktq_t **fullq)
+{
+	ringbuf_t *r;
+	struct can_packet *pkt;
+	pktq_t *q;
+	int i, j, n, done = 0, instat = 0, class;
+
+	*fullq = NULL;
+	if (down_interruptible(&fs->txsem))
+		return -ERESTARTSYS;
+	if (fs->txq == NULL && can_alloc_txq(fs) < 0) {
+		up(&fs->txsem);
+		return -ENOMEM;
+	}
+	r = fs->txq;
+	while (done < count && (n = RING_SPAN_IN(*r)) > 0) {
+		if (n > count - done)
+			n = count - done;
+		if (copy_from_user(&RING_HEAD(*r), buf + (done * PKTSIZE), 
+		    n * PKTSIZE)) {
+			if (done == 0)
+				done = -EFAULT;
+			break;
+		}
+		for (i = j = 0; i < n; i++) {
+			pkt = &r->buf[r->head + i];
+			outgoing_fixup(pkt);
+			incoming_fixup(pkt);
+			if (IS_MYPACKET(pkt))
+				q = loopback_ok() ? NULL : &inq;
+			else if ((class = txclass(pkt)) != TXQ_BULK)
+				q = &outq[class];
+			else
+				q = NULL;
+			if (q != NULL && pktq_full(q)) {
+				*fullq = q;
+				break;
+			}
+			if (IS_ACKABLE(pkt->ext.ext.type))
+				ackwait_add(fs, pkt, NULL, ACKWAIT_TIMEOUT);
+			if (IS_MYPACKET(pkt)) {
+				if (!can_loopback(pkt)) {
+					pkt_to_ring(pkt, &inq);
+					instat = 1;
+				}
+				continue;
+			}
+			if (q != NULL)
+				pkt_to_ring(pkt, q);
+			if (pkt_to_ring(pkt, &inq))
+				instat = 1;
+			if (q != NULL)
+				continue;
+			if (j != i)
+				r->buf[r->head + j] = *pkt;
+			j++;
+		}
+		wmb();
+		RING_HEADADD(*r, j);
+		done += i;
+		if (i < n)
+			break;
+	}
+	up(&fs->txsem);
+
+	if (instat) {
+		queue_task(&bh_tq, &tq_immediate);
+		mark_bh(IMMEDIATE_BH);
+	}
+	if (done > 0)
+		try_xmit();
+	return done;
+}
+
+/*
+ * Advance an fd's receive log cursor past entries it does not want,
+ * first counting any it lost because the log wrapped.  Return 1 if an 
+ * entry is waiting at the cursor, 0 if the fd is caught up.
+ */
+static int
+rxlog_skip(struct file_state *fs)
+{
+	unsigned long head = rxlog_head;
+
+	rmb();				/* entries before head are complete */
+	if (head - fs->rxseq >= RXLOG_SIZE) {
+		fs->overruns += head - fs->rxseq - (RXLOG_SIZE - 1);
+		fs->lost += head - fs->rxseq - (RXLOG_SIZE - 1);
+		fs->rxseq = head - (RXLOG_SIZE - 1);
+	}
+	while (fs->rxseq != head && !fd_wants(fs, 
+	    &rxlog[RXLOG_SLOT(fs->rxseq)], rxlog_rcpt[RXLOG_SLOT(fs->rxseq)],
+	    fs->rxseq))
+		fs->rxseq++;
+	return (fs->rxseq != head);
+}
+
+/*
+ * Helpers for the mmapped receive ring.  The ring lives in memory the
+ * reader can scribble on, so head is kept privately in the file_state and 
+ * only published in the ring, and tail is range checked before use.
+ */
+static inline int
+mring_empty(struct file_state *fs)
+{
+	return (fs->ringhead == fs->ring->tail);
+}
+
+/* fail (return 0) if the ring is full, counting an overrun */
+static int
+pkt_to_mring(struct can_packet *pkt, struct file_state *fs)
+{
+	struct can_mmap_ring *r = fs->ring;
+	uint32_t next = (fs->ringhead + 1) % CAN_MMAP_SLOTS;
+
+	if (next == r->tail) {
+		fs->overruns++;
+		fs->lost++;
+		r->overruns++;
+		return 0;
+	}
+	r->pkt[fs->ringhead] = *pkt;
+	wmb();
+	r->head = fs->ringhead = next;
+	return 1;
+}
+
+ /* return 1 if packets are waiting for this fd */
+static int
+fd_pending(struct file_state *fs)
+{
+	if (fs->ring != NULL)
+		return !mring_empty(fs);
+	return rxlog_skip(fs);
+}
+
+/*
+ * Sleep until the fd is woken through its own queue or its shared queue.
+ * The task is on the queues before fd_pending() is checked, so a wakeup 
+ * between the check and schedule() is not lost.
+ */
+static void
+can_sleep(struct file_state *fs)
+{
+	struct wait_queue wait = { current, NULL };
+	struct wait_queue wait_shared = { current, NULL };
+	struct wait_queue **sharedq = fd_sharedq(fs);
+
+	current->state = TASK_INTERRUPTIBLE;
+	add_wait_queue(&fs->readq, &wait);
+	if (sharedq != NULL)
+		add_wait_queue(sharedq, &wait_shared);
+	if (!fd_pending(fs))
+		schedule();
+	current->state = TASK_RUNNING;
+	if (sharedq != NULL)
+		remove_wait_queue(sharedq, &wait_shared);
+	remove_wait_queue(&fs->readq, &wait);
+}
+
+/*
+ * Format 2 version of the receive log half of rxlog_to_user().  Entries 
+ * are widened into a small buffer and copied out a batch at a time.
+ */
+static int
+rxlog_to_user_v2(struct file_state *fs, const char *buf, int count)
+{
+	struct can_packet_v2 batch[RXLOG_BATCH];
+	unsigned long seq;
+	int i = 0, n;
+
+	while (i < count) {
+		n = 0;
+		while (i + n < count && n < RXLOG_BATCH && rxlog_skip(fs)) {
+			seq = fs->rxseq;
+			batch[n].pkt = rxlog[RXLOG_SLOT(seq)];
+			batch[n].nsec = rxlog_nsec[RXLOG_SLOT(seq)];
+			rmb();
+			/* (overwritten ones are counted by rxlog_skip()) */
+			if (rxlog_head - seq < RXLOG_SIZE) {
+				fs->rxseq++;
+				n++;
+			}
+		}
+		if (n == 0)
 			break;
+		copy_to_user_ret(buf + (i * sizeof(struct can_packet_v2)), 
+		    batch, n * sizeof(struct can_packet_v2), -EFAULT);
+		i += n;
 	}
 	return i;
 }
 
 /*
- * Copy 'count' packets from user space to the specified ring buffer.
+ * Copy up to 'count' packets to user space from the fd's mmapped ring, 
+ * if it has one, else from the receive log.  Packets go straight from 
+ * ring or log storage to the user buffer, one copy per contiguous run:
+ * at most two for the ring, which wraps; for the log, a run also ends at 
+ * an entry the fd does not want.
  * Return the number of packets copied, or -EFAULT on VM error.
  */
 static int 
-ring_to_user(ringbuf_t *r, const char *buf, int count)
+rxlog_to_user(struct file_state *fs, const char *buf, int count)
 {
-        int i;
-	struct can_packet pkt;
+	struct can_mmap_ring *r = fs->ring;
+	unsigned long start, head;
+	uint32_t tail;
+        int i = 0, n;
 	
-        for (i = 0; i < count && ring_to_pkt(&pkt, r); i++)
-                copy_to_user_ret(buf + (i * PKTSIZE), &pkt, PKTSIZE, -EFAULT);
+	if (r != NULL) {
+		while (i < count) {
+			tail = r->tail;
+			if (tail >= CAN_MMAP_SLOTS || tail == fs->ringhead)
+				break;
+			rmb();
+			n = (fs->ringhead > tail ? fs->ringhead 
+			    : CAN_MMAP_SLOTS) - tail;
+			if (n > count - i)
+				n = count - i;
+			copy_to_user_ret(buf + (i * PKTSIZE), &r->pkt[tail], 
+			    n * PKTSIZE, -EFAULT);
+			r->tail = (tail + n) % CAN_MMAP_SLOTS;
+			i += n;
+		}
+		return i;
+	}
+	if (fs->format == CAN_FORMAT_2)
+		return rxlog_to_user_v2(fs, buf, count);
+	while (i < count && rxlog_skip(fs)) {
+		head = rxlog_head;
+		rmb();
+		start = fs->rxseq;
+		for (n = 1; i + n < count && start + n != head 
+		    && RXLOG_SLOT(start + n) != 0
+		    && fd_wants(fs, &rxlog[RXLOG_SLOT(start + n)], 
+		    rxlog_rcpt[RXLOG_SLOT(start + n)], start + n); n++)
+			;
+		copy_to_user_ret(buf + (i * PKTSIZE), 
+		    &rxlog[RXLOG_SLOT(start)], n * PKTSIZE, -EFAULT);
+		rmb();
+		/* 
+		 * If the oldest entry was overwritten during the copy, let 
+		 * rxlog_skip() count what was lost and copy again over it.
+		 */
+		if (rxlog_head - start >= RXLOG_SIZE)
+			continue;
+		fs->rxseq = start + n;
+		i += n;
+	}
         return i;
 }
 
@@ -229,23 +1195,206 @@ can_copy_rx(struct can_packet *pkt)
 	pkt->dat.dat_b[3] = reg->rx7;
 }
 
-/*
- * Copy a packet to be transmitted from can_packet structure to 82C200 
- * registers (byte regs are mapped on long words).
- */
-static inline void 
-can_copy_tx(struct can_packet *pkt)
+/*
+ * Copy a packet to be transmitted from can_packet structure to 82C200 
+ * registers (byte regs are mapped on long words).
+ */
+static inline void 
+can_copy_tx(struct can_packet *pkt)
+{
+	reg->txdb1 = pkt->can.can_b[0];
+	reg->txdb2 = pkt->can.can_b[1];
+	reg->tx0 = pkt->ext.ext_b[0];
+	reg->tx1 = pkt->ext.ext_b[1];
+	reg->tx2 = pkt->ext.ext_b[2];
+	reg->tx3 = pkt->ext.ext_b[3];
+	reg->tx4 = pkt->dat.dat_b[0];
+	reg->tx5 = pkt->dat.dat_b[1];
+	reg->tx6 = pkt->dat.dat_b[2];
+	reg->tx7 = pkt->dat.dat_b[3];
+}
+
+/*
+ * Helpers for the CAN_SUBSCRIBE ioctl family.  The subscriber index is 
+ * walked by the bottom half, so it is only changed with bottom halves 
+ * disabled.  Entries are allocated before that and freed after.
+ */
+static void
+can_unsubscribe(struct file_state *fs)
+{
+	struct can_subidx **sp, *s, *freelist = NULL;
+	int obj;
+
+	if (fs->sub == NULL)
+		return;
+	start_bh_atomic();
+	for (obj = 0; obj < CAN_SUB_OBJWORDS * 32; obj++) {
+		if (!CAN_SUB_ISSET(fs->sub, obj))
+			continue;
+		for (sp = &subidx[obj]; *sp != NULL; sp = &(*sp)->next) {
+			if ((*sp)->fs == fs) {
+				s = *sp;
+				*sp = s->next;
+				s->next = freelist;
+				freelist = s;
+				break;
+			}
+		}
+	}
+	end_bh_atomic();
+	while ((s = freelist) != NULL) {
+		freelist = s->next;
+		kfree(s);
+	}
+	kfree(fs->sub);
+	fs->sub = NULL;
+}
+
+static int
+can_subscribe(struct file_state *fs, struct can_subscription *usub)
+{
+	struct can_subscription *sub;
+	struct can_subidx *s, *newlist = NULL;
+	int obj;
+
+	sub = kmalloc(sizeof(struct can_subscription), GFP_KERNEL);
+	if (sub == NULL)
+		return -ENOMEM;
+	if (copy_from_user(sub, usub, sizeof(struct can_subscription))) {
+		kfree(sub);
+		return -EFAULT;
+	}
+	if (sub->npeers > CAN_SUB_MAXPEERS) {
+		kfree(sub);
+		return -EINVAL;
+	}
+	for (obj = 0; obj < CAN_SUB_OBJWORDS * 32; obj++) {
+		if (!CAN_SUB_ISSET(sub, obj))
+			continue;
+		s = kmalloc(sizeof(struct can_subidx), GFP_KERNEL);
+		if (s == NULL)
+			goto nomem;
+		s->fs = fs;
+		s->next = newlist;
+		newlist = s;
+	}
+
+	can_unsubscribe(fs);
+
+	/* newlist holds one entry per object, highest object first */
+	start_bh_atomic();
+	fs->sub = sub;
+	for (obj = CAN_SUB_OBJWORDS * 32 - 1; obj >= 0; obj--) {
+		if (!CAN_SUB_ISSET(sub, obj))
+			continue;
+		s = newlist;
+		newlist = s->next;
+		s->next = subidx[obj];
+		subidx[obj] = s;
+	}
+	end_bh_atomic();
+	return 0;
+nomem:
+	while ((s = newlist) != NULL) {
+		newlist = s->next;
+		kfree(s);
+	}
+	kfree(sub);
+	return -ENOMEM;
+}
+
+/*
+ * Helpers for the CAN_SET_FILTER and CAN_CLR_FILTER ioctls.
+ * Return 0 if a filter program is safe to run, -1 if not.
+ */
+static int
+can_filter_check(struct can_filter *f)
+{
+	struct can_filter_insn *in;
+	int pc;
+
+	if (f->len == 0 || f->len > CAN_FILTER_MAXINSNS)
+		return -1;
+	for (pc = 0; pc < f->len; pc++) {
+		in = &f->insns[pc];
+		switch (in->code) {
+			case CANF_LD:
+				if (in->k >= CANF_F_MAX)
+					return -1;
+				break;
+			case CANF_LDB:
+				if (in->k >= sizeof(can_dat))
+					return -1;
+				break;
+			case CANF_AND:
+			case CANF_RET:
+				break;
+			case CANF_JEQ:
+			case CANF_JGT:
+			case CANF_JGE:
+			case CANF_JSET:
+				if (pc + 1 + in->jt >= f->len 
+						|| pc + 1 + in->jf >= f->len)
+					return -1;
+				break;
+			default:
+				return -1;
+		}
+	}
+	return (f->insns[f->len - 1].code == CANF_RET ? 0 : -1);
+}
+
+static void
+can_clr_filter(struct file_state *fs)
+{
+	int i;
+
+	if (fs->filter == NULL)
+		return;
+	start_bh_atomic();
+	for (i = 0; i < filtfd_count; i++)
+		if (filtfd[i] == fs)
+			break;
+	if (i < filtfd_count)
+		filtfd[i] = filtfd[--filtfd_count];
+	end_bh_atomic();
+	kfree(fs->filter);
+	kfree(fs->filtpass);
+	fs->filter = NULL;
+	fs->filtpass = NULL;
+}
+
+static int
+can_set_filter(struct file_state *fs, struct can_filter *ufilter)
 {
-	reg->txdb1 = pkt->can.can_b[0];
-	reg->txdb2 = pkt->can.can_b[1];
-	reg->tx0 = pkt->ext.ext_b[0];
-	reg->tx1 = pkt->ext.ext_b[1];
-	reg->tx2 = pkt->ext.ext_b[2];
-	reg->tx3 = pkt->ext.ext_b[3];
-	reg->tx4 = pkt->dat.dat_b[0];
-	reg->tx5 = pkt->dat.dat_b[1];
-	reg->tx6 = pkt->dat.dat_b[2];
-	reg->tx7 = pkt->dat.dat_b[3];
+	struct can_filter *f;
+	unsigned long *pass;
+
+	f = kmalloc(sizeof(struct can_filter), GFP_KERNEL);
+	pass = kmalloc(RXLOG_SIZE / 8, GFP_KERNEL);
+	if (f == NULL || pass == NULL) {
+		kfree(f);
+		kfree(pass);
+		return -ENOMEM;
+	}
+	if (copy_from_user(f, ufilter, sizeof(struct can_filter))) {
+		kfree(f);
+		kfree(pass);
+		return -EFAULT;
+	}
+	if (can_filter_check(f) < 0) {
+		kfree(f);
+		kfree(pass);
+		return -EINVAL;
+	}
+	can_clr_filter(fs);
+	start_bh_atomic();
+	fs->filter = f;
+	fs->filtpass = pass;
+	fs->filtseq = rxlog_head;	/* bh fills verdicts from here on */
+	filtfd[filtfd_count++] = fs;
+	end_bh_atomic();
+	return 0;
 }
 
 /*
@@ -300,17 +1449,336 @@ can_dump_info(void)
 		cancon_dump_info();
 
 		printk("can: debugging ON\n");
-		printk("can: inq contains %d packets\n",  RING_SIZE(inq));
-		printk("can: outq contains %d packets\n", RING_SIZE(outq));
-		for (i = 0; i < CAN_MAX_USECOUNT; i++)
-			if (openfd[i] != NULL)
-				fdcount++;
+		printk("can: inq contains %d packets\n",  pktq_size(&inq));
+		for (i = 0; i < TXQ_MAX; i++)
+			printk("can: outq[%d] contains %d packets, dropped %lu\n",
+			    i, pktq_size(&outq[i]), pktq_drops(&outq[i]));
+		printk("can: rxlog has logged %lu packets\n", rxlog_head);
+		printk("can: %lu requests not tracked for ACK routing\n",
+		    ackwait_overflow);
+		for (i = 0; i < CAN_MAX_USECOUNT; i++) {
+			if (openfd[i] == NULL)
+				continue;
+			printk("can: fd %d is %lu behind, %lu overruns, "
+			    "%d to send\n", i, rxlog_head - openfd[i]->rxseq, 
+			    openfd[i]->overruns, openfd[i]->txq == NULL ? 0 
+			    : RING_SIZE(*openfd[i]->txq));
+			fdcount++;
+		}
 		printk("can: there are %d fd's open\n", fdcount);
 
 		cancon_dump_debug();
 	}
 }
 
+/*
+ * Fill in a snapshot of the statistics.  Each counter in canstats has one
+ * writer: the bottom half, whoever holds XMIT_BUSY, or whoever holds
+ * rx_lock (the interrupt handler or receive poller), so none need locks;
+ * the rest are gathered from their owners here.  The snapshot is not 
+ * atomic, but every counter in it is sane.
+ */
+static void
+can_get_stats(struct can_stats *st)
+{
+	int i;
+
+	*st = canstats;
+	st->inq_drops = pktq_drops(&inq);
+	for (i = 0; i < TXQ_MAX; i++)
+		st->txq_drops[i] = pktq_drops(&outq[i]);
+	st->fd_overruns = lost_closed;
+	for (i = 0; i < CAN_MAX_USECOUNT; i++)
+		if (openfd[i] != NULL)
+			st->fd_overruns += openfd[i]->lost;
+	st->ackwait_overflow = ackwait_overflow;
+}
+
+/* 
+ * Helpers for /proc/can/stats, which may be longer than a page.  
+ * PROC_PRINTF() appends to the page, keeping only what lies in the 
+ * window [off, off + count) asked for.
+ */
+#define PROC_PRINTF(args...) { \
+	len += sprintf(page + len, args); \
+	if (begin + len < off) { \
+		begin += len; \
+		len = 0; \
+	} \
+	if (begin + len > off + count) \
+		goto done; \
+}
+
+static void
+proc_counts(char *buf, unsigned long *v, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		buf += sprintf(buf, " %lu", v[i]);
+}
+
+static int
+can_read_proc_stats(char *page, char **start, off_t off, int count, 
+    int *eof, void *data)
+{
+	struct can_stats *st;
+	struct file_state *fs;
+	char line[CAN_STATS_NTYPES * 12];
+	off_t begin = 0;
+	int len = 0, i;
+
+	st = kmalloc(sizeof(struct can_stats), GFP_KERNEL);
+	if (st == NULL)
+		return -ENOMEM;
+	can_get_stats(st);
+
+	PROC_PRINTF("rx_packets %lu\n", st->rx_packets);
+	PROC_PRINTF("tx_packets %lu\n", st->tx_packets);
+	proc_counts(line, st->rx_type, CAN_STATS_NTYPES);
+	PROC_PRINTF("rx_type%s\n", line);
+	proc_counts(line, st->tx_type, CAN_STATS_NTYPES);
+	PROC_PRINTF("tx_type%s\n", line);
+	PROC_PRINTF("inq_drops %lu\n", st->inq_drops);
+	proc_counts(line, st->txq_drops, CAN_STATS_NTXQ);
+	PROC_PRINTF("txq_drops%s\n", line);
+	PROC_PRINTF("fd_overruns %lu\n", st->fd_overruns);
+	PROC_PRINTF("chip_overruns %lu\n", st->chip_overruns);
+	PROC_PRINTF("bus_errors %lu\n", st->bus_errors);
+	PROC_PRINTF("bus_status %lu\n", st->bus_status);
+	PROC_PRINTF("resets %lu\n", st->resets);
+	PROC_PRINTF("bh_runs %lu\n", st->bh_runs);
+	PROC_PRINTF("inq_maxdepth %lu\n", st->inq_maxdepth);
+	proc_counts(line, st->txq_maxdepth, CAN_STATS_NTXQ);
+	PROC_PRINTF("txq_maxdepth%s\n", line);
+	PROC_PRINTF("ackwait_overflow %lu\n", st->ackwait_overflow);
+	PROC_PRINTF("rxpoll_enter %lu\n", st->rxpoll_enter);
+	PROC_PRINTF("rxpoll_exit %lu\n", st->rxpoll_exit);
+	PROC_PRINTF("rxpoll_packets %lu\n", st->rxpoll_packets);
+	PROC_PRINTF("bh_latency_max %lu\n", st->bh_latency_max);
+	PROC_PRINTF("bh_latency_total %lu\n", st->bh_latency_total);
+	PROC_PRINTF("accept_changes %lu\n", st->accept_changes);
+	PROC_PRINTF("loopback_packets %lu\n", st->loopback_packets);
+	PROC_PRINTF("accept_code 0x%.2x\n", accept_code);
+	PROC_PRINTF("accept_mask 0x%.2x\n", accept_mask);
+	for (i = 0; i < CAN_STATS_NOBJS; i++)
+		if (st->rx_obj[i] != 0)
+			PROC_PRINTF("rx_obj 0x%03x %lu\n", i, st->rx_obj[i]);
+	for (i = 0; i < CAN_MAX_USECOUNT; i++) {
+		if ((fs = openfd[i]) == NULL)
+			continue;
+		PROC_PRINTF("fd %lu lost %lu behind %lu txq %d txrate %lu\n",
+		    fs->id, fs->lost, rxlog_head - fs->rxseq, 
+		    fs->txq == NULL ? 0 : RING_SIZE(*fs->txq), fs->txrate);
+	}
+	*eof = 1;
+done:
+	kfree(st);
+	*start = page + (off - begin);
+	len -= (off - begin);
+	if (len > count)
+		len = count;
+	if (len < 0)
+		len = 0;
+	return len;
+}
+
+static void
+can_init_proc(void)
+{
+	struct proc_dir_entry *ent;
+
+	can_proc_dir = create_proc_entry("can", S_IFDIR, 0);
+	if (can_proc_dir == NULL)
+		return;
+	ent = create_proc_entry("stats", 0, can_proc_dir);
+	if (ent != NULL)
+		ent->read_proc = can_read_proc_stats;
+}
+
+static void
+can_fini_proc(void)
+{
+	if (can_proc_dir == NULL)
+		return;
+	remove_proc_entry("stats", can_proc_dir);
+	remove_proc_entry("can", 0);
+}
+
+/*
+ * Set up a transaction for can_transact(), building the CAN header as 
+ * can_pack() in libcan does.  Return 0, or -EINVAL for a bad request.
+ */
+static int
+xact_init(struct can_transact *t, struct can_xact *x)
+{
+	if (!IS_ACKABLE(t->req.ext.type) || t->len < 0 
+	    || t->len > sizeof(can_dat) || t->timeout <= 0 || t->retries < 0)
+		return -EINVAL;
+	memset(x, 0, sizeof(*x));
+	x->req.can.can.lpriority = CAN_HIGH_PRIORITY;
+	x->req.can.can.length = sizeof(can_header_ext) + t->len;
+	if (t->req.ext.cluster == UNPACK_CLUSTER(can_nodeid)
+	    && t->req.ext.module == UNPACK_MODULE(can_nodeid))
+		x->req.can.can.dest = t->req.ext.node;
+	else
+		x->req.can.can.dest = CAN_MODULE_H8;
+	x->req.ext = t->req;
+	x->req.dat = t->dat;
+	x->key = ACKWAIT_KEY(x->req.ext);
+	t->status = CAN_TRANSACT_PENDING;
+	t->tries = 0;
+	t->acklen = 0;
+	t->latency = 0;
+	return 0;
+}
+
+/* 
+ * Send a transaction's request, unless one for the same object and node 
+ * is in flight.  Return 0 if sent or put off, -1 if the driver is full.
+ */
+static int
+xact_send(struct file_state *fs, struct can_transact *t, struct can_xact *x,
+    struct can_xact *xv, int n)
+{
+	struct can_packet pkt;
+	long tmo = (t->timeout * HZ + 999) / 1000;
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (xv[i].inflight && xv[i].key == x->key)
+			return 0;
+	x->done = 0;
+	if (ackwait_add(fs, &x->req, x, tmo) < 0)
+		return -1;
+	pkt = x->req;
+	x->sent = can_getclock();
+	if (!send_pkt(&pkt)) {
+		ackwait_cancel(&x->req, x);
+		return -1;
+	}
+	x->expires = jiffies + tmo;
+	x->inflight = 1;
+	t->tries++;
+	return 0;
+}
+
+/*
+ * If an in-flight transaction has been answered, timed out, or (if sig)
+ * is to be abandoned, take it out of flight, and if it is finished, set 
+ * its status.  Return 1 if it finished, else 0.  The bottom half sets 
+ * done before it wakes us, so even then x is not ours until 
+ * ackwait_cancel() has waited for it.
+ */
+static int
+xact_reap(struct can_transact *t, struct can_xact *x, int sig)
+{
+	int status;
+
+	if (!x->done && time_before(jiffies, x->expires) && !sig)
+		return 0;
+	ackwait_cancel(&x->req, x);	/* the answer may beat this */
+	x->inflight = 0;
+	if (x->done) {
+		t->acklen = x->reply.can.can.length - sizeof(can_header_ext);
+		t->ack = x->reply.dat;
+		t->latency = (unsigned long)(x->nsec - x->sent) / 1000;
+		status = x->reply.ext.ext.type == CANTYPE_ACK 
+		    ? CAN_TRANSACT_ACK : CAN_TRANSACT_NAK;
+	} else
+		status = CAN_TRANSACT_TIMEDOUT;
+	if (status == CAN_TRANSACT_ACK || t->tries > t->retries) {
+		t->status = status;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * CAN_TRANSACT and CAN_TRANSACT_V: send each request and wait for its 
+ * ACK/NAK, resending on NAK or timeout.  As many requests are kept in 
+ * flight as the outq and ackwait table take; when they are full, try 
+ * again a jiffy later.  The requests go out in the kernel's bulk class, 
+ * so the fd's CAN_SET_TXRATE cap doesn't apply.
+ * Return 0 with every status set, or -EINTR.
+ */
+static int
+can_transact(struct file_state *fs, struct can_transact *tv, 
+    struct can_xact *xv, int n)
+{
+	struct wait_queue *waitq = NULL;
+	struct wait_queue wait = { current, NULL };
+	long tmo;
+	int i, full, left = n, sig = 0;
+
+	for (i = 0; i < n; i++)
+		xv[i].waitq = &waitq;
+	add_wait_queue(&waitq, &wait);
+	while (left > 0) {
+		full = 0;
+		for (i = 0; i < n && !full; i++)
+			if (tv[i].status == CAN_TRANSACT_PENDING 
+			    && !xv[i].inflight)
+				full = xact_send(fs, &tv[i], &xv[i], xv, n);
+
+		/* sleep until an answer, the next deadline, or a jiffy */
+		tmo = full ? 1 : MAX_SCHEDULE_TIMEOUT;
+		for (i = 0; i < n; i++)
+			if (xv[i].inflight 
+			    && (long)(xv[i].expires - jiffies) < tmo)
+				tmo = xv[i].expires - jiffies;
+		current->state = TASK_INTERRUPTIBLE;
+		for (i = 0; i < n; i++)
+			if (xv[i].inflight && xv[i].done)
+				break;
+		if (i == n && tmo > 0 && current->sigpending == 0)
+			schedule_timeout(tmo);
+		current->state = TASK_RUNNING;
+
+		sig = (current->sigpending != 0);
+		for (i = 0; i < n; i++)
+			if (xv[i].inflight) 
+				left -= xact_reap(&tv[i], &xv[i], sig);
+		if (sig)
+			break;
+	}
+	remove_wait_queue(&waitq, &wait);
+	return sig ? -EINTR : 0;
+}
+
+/* CAN_TRANSACT_V */
+static int
+can_transact_v(struct file_state *fs, struct can_transact_v *tvv)
+{
+	struct can_transact *tv;
+	struct can_xact *xv;
+	int i, err = -ENOMEM;
+
+	if (tvv->n <= 0 || tvv->n > CAN_TRANSACT_MAX)
+		return -EINVAL;
+	tv = kmalloc(tvv->n * sizeof(*tv), GFP_KERNEL);
+	xv = kmalloc(tvv->n * sizeof(*xv), GFP_KERNEL);
+	if (tv == NULL || xv == NULL)
+		goto done;
+	err = -EFAULT;
+	if (copy_from_user(tv, tvv->v, tvv->n * sizeof(*tv)))
+		goto done;
+	for (i = 0; i < tvv->n; i++)
+		if ((err = xact_init(&tv[i], &xv[i])) < 0)
+			goto done;
+	if ((err = can_transact(fs, tv, xv, tvv->n)) < 0)
+		goto done;
+	err = 0;
+	if (copy_to_user(tvv->v, tv, tvv->n * sizeof(*tv)))
+		err = -EFAULT;
+done:
+	if (tv != NULL)
+		kfree(tv);
+	if (xv != NULL)
+		kfree(xv);
+	return err;
+}
+
 /*
  * Ioctl operation.
  */
@@ -320,17 +1788,27 @@ can_ioctl(struct inode *inode, struct file *file, unsigned int cmd,
 {
 	struct file_state *fstate = (struct file_state *)(file->private_data);
 	uint32_t hb_val;
+	unsigned long txrate;
+	struct can_stats *st;
+	struct can_transact xt;
+	struct can_transact_v xtv;
+	struct can_xact xact;
+	int err, format;
 
 	switch (cmd) {
 		case CAN_SET_PROMISCUOUS:	/* see all packets on LCAN */
-			fstate->promiscuous = 1;
-			if (promiscuous_usecount++ == 0)
-				can_init_82c200(1);
+			if (!fstate->promiscuous) {
+				fstate->promiscuous = 1;
+				promiscuous_usecount++;
+				can_update_accept();
+			}
 			return 0;
 		case CAN_CLR_PROMISCUOUS:	/* see only "my" LCAN packets */
-			fstate->promiscuous = 0;
-			if (--promiscuous_usecount == 0)
-				can_init_82c200(0);
+			if (fstate->promiscuous) {
+				fstate->promiscuous = 0;
+				promiscuous_usecount--;
+				can_update_accept();
+			}
 			return 0;
 		case CAN_SET_SNOOPY:		/* see outgoing packets */
 			fstate->snoopy = 1;
@@ -348,6 +1826,83 @@ can_ioctl(struct inode *inode, struct file *file, unsigned int cmd,
 			    -EFAULT);
 			canobj_sethbval(hb_val);
 			return 0;
+		case CAN_GET_OVERRUNS:		/* get and clear overruns */
+			copy_to_user_ret(arg, &fstate->overruns,
+			    sizeof(fstate->overruns), -EFAULT);
+			fstate->overruns = 0;
+			return 0;
+		case CAN_SUBSCRIBE:		/* receive only these objs */
+			return can_subscribe(fstate, 
+			    (struct can_subscription *)arg);
+		case CAN_UNSUBSCRIBE:		/* receive all "my" objs */
+			can_unsubscribe(fstate);
+			return 0;
+		case CAN_GET_SUBSCRIPTION:	/* get subscription */
+			if (fstate->sub == NULL)
+				return -ENOENT;
+			copy_to_user_ret(arg, fstate->sub, 
+			    sizeof(struct can_subscription), -EFAULT);
+			return 0;
+		case CAN_SET_FILTER:		/* install filter program */
+			err = can_set_filter(fstate, (struct can_filter *)arg);
+			if (err == 0 && fstate->promiscuous)
+				can_update_accept();
+			return err;
+		case CAN_CLR_FILTER:		/* remove filter program */
+			can_clr_filter(fstate);
+			if (fstate->promiscuous)
+				can_update_accept();
+			return 0;
+		case CAN_SET_TXRATE:		/* cap transmit rate */
+			copy_from_user_ret(&txrate, arg, sizeof(txrate), 
+			    -EFAULT);
+			can_set_txrate(fstate, txrate);
+			return 0;
+		case CAN_GET_TXRATE:		/* get transmit rate cap */
+			copy_to_user_ret(arg, &fstate->txrate, 
+			    sizeof(fstate->txrate), -EFAULT);
+			return 0;
+		case CAN_SET_FORMAT:		/* select read(2) format */
+			copy_from_user_ret(&format, arg, sizeof(format), 
+			    -EFAULT);
+			if (format != CAN_FORMAT_1 && format != CAN_FORMAT_2)
+				return -EINVAL;
+			if (fstate->ring != NULL && format != CAN_FORMAT_1)
+				return -EBUSY;
+			fstate->format = format;
+			return 0;
+		case CAN_GET_FORMAT:		/* get read(2) format */
+			copy_to_user_ret(arg, &fstate->format, 
+			    sizeof(fstate->format), -EFAULT);
+			return 0;
+		case CAN_SET_RXPOLL:		/* set polled receive rate */
+			copy_from_user_ret(&rxpoll_rate, arg, 
+			    sizeof(rxpoll_rate), -EFAULT);
+			return 0;
+		case CAN_GET_RXPOLL:		/* get polled receive rate */
+			copy_to_user_ret(arg, &rxpoll_rate, 
+			    sizeof(rxpoll_rate), -EFAULT);
+			return 0;
+		case CAN_TRANSACT:		/* send request, wait for reply */
+			copy_from_user_ret(&xt, arg, sizeof(xt), -EFAULT);
+			if ((err = xact_init(&xt, &xact)) < 0)
+				return err;
+			if ((err = can_transact(fstate, &xt, &xact, 1)) < 0)
+				return err;
+			copy_to_user_ret(arg, &xt, sizeof(xt), -EFAULT);
+			return 0;
+		case CAN_TRANSACT_V:		/* a vector of them */
+			copy_from_user_ret(&xtv, arg, sizeof(xtv), -EFAULT);
+			return can_transact_v(fstate, &xtv);
+		case CAN_GET_STATS:		/* get statistics */
+			st = kmalloc(sizeof(struct can_stats), GFP_KERNEL);
+			if (st == NULL)
+				return -ENOMEM;
+			can_get_stats(st);
+			err = copy_to_user((void *)arg, st, 
+			    sizeof(struct can_stats)) ? -EFAULT : 0;
+			kfree(st);
+			return err;
 		case CAN_GET_ADDR:		/* get "my" can address */
 			copy_to_user_ret(arg, &can_nodeid, 
 					sizeof(can_nodeid), -EFAULT);
@@ -362,7 +1917,7 @@ can_ioctl(struct inode *inode, struct file *file, unsigned int cmd,
 					sizeof(int), -EFAULT);
 			return 0;
 		case CAN_SET_RESET:		/* reset chip */
-			can_init_82c200(0);
+			can_init_82c200();
 			return 0;
 		case CAN_SET_DEBUG:		/* set debugging flag */
 			can_debug = 1;
@@ -377,6 +1932,51 @@ can_ioctl(struct inode *inode, struct file *file, unsigned int cmd,
 	}
 }
 
+/*
+ * Allocate an mmappable receive ring for an fd and start delivering its
+ * packets there.  Return 0 on success, -1 on failure.
+ */
+static int
+can_alloc_ring(struct file_state *fs)
+{
+	unsigned long page, addr;
+
+	addr = __get_free_pages(GFP_KERNEL, CAN_MMAP_ORDER);
+	if (addr == 0)
+		return -1;
+	for (page = addr; page < addr + CAN_MMAP_SIZE; page += PAGE_SIZE)
+		mem_map_reserve(MAP_NR(page));
+	memset((void *)addr, 0, CAN_MMAP_SIZE);
+	fs->ring = (struct can_mmap_ring *)addr;
+	fs->ring->size = CAN_MMAP_SLOTS;
+	fs->ringhead = 0;
+
+	start_bh_atomic();
+	ringfd[ringfd_count++] = fs;
+	end_bh_atomic();
+	return 0;
+}
+
+static void
+can_free_ring(struct file_state *fs)
+{
+	unsigned long page, addr = (unsigned long)fs->ring;
+	int i;
+
+	start_bh_atomic();
+	for (i = 0; i < ringfd_count; i++)
+		if (ringfd[i] == fs)
+			break;
+	if (i < ringfd_count)
+		ringfd[i] = ringfd[--ringfd_count];
+	end_bh_atomic();
+
+	for (page = addr; page < addr + CAN_MMAP_SIZE; page += PAGE_SIZE)
+		mem_map_unreserve(MAP_NR(page));
+	free_pages(addr, CAN_MMAP_ORDER);
+	fs->ring = NULL;
+}
+
 static void 
 can_init_openfd(void)
 {
@@ -397,11 +1997,31 @@ can_alloc_openfd(void)
 		return NULL;
 
 	openfd[i] = kmalloc(sizeof(struct file_state), GFP_KERNEL);
+	if (openfd[i] == NULL)
+		return NULL;
 	openfd[i]->consobj = -1;
 	openfd[i]->promiscuous = 0;
 	openfd[i]->snoopy = 0;
+	openfd[i]->id = next_fd_id++;
+	if (next_fd_id == RX_MONITOR)
+		next_fd_id = 1;
+	openfd[i]->rxseq = rxlog_head;	/* see only new packets */
+	openfd[i]->overruns = 0;
+	openfd[i]->lost = 0;
+	openfd[i]->format = CAN_FORMAT_1;
+	openfd[i]->ring = NULL;
+	openfd[i]->ringhead = 0;
+	openfd[i]->sub = NULL;
+	openfd[i]->filter = NULL;
+	openfd[i]->filtpass = NULL;
 	openfd[i]->readq = NULL;
-	RING_INIT(openfd[i]->inq);
+	openfd[i]->txq = NULL;
+	openfd[i]->txsem = MUTEX;
+	openfd[i]->writeq = NULL;
+	openfd[i]->txdeficit = 0;
+	openfd[i]->txrate = 0;
+	openfd[i]->txtokens = 0;
+	openfd[i]->txstamp = jiffies;
 	return openfd[i];
 }
 
@@ -419,9 +2039,20 @@ can_release_openfd(void *myopenfd)
 	}
 	if (openfd[i]->consobj != -1)
 		can_free_consobj(openfd[i]->consobj);
-	if (openfd[i]->promiscuous)
-		if (--promiscuous_usecount == 0)
-			can_init_82c200(0);
+	if (openfd[i]->promiscuous) {
+		openfd[i]->promiscuous = 0;
+		promiscuous_usecount--;
+		can_update_accept();
+	}
+	if (openfd[i]->ring != NULL)
+		can_free_ring(openfd[i]);
+	can_unsubscribe(openfd[i]);
+	can_clr_filter(openfd[i]);
+	can_free_txq(openfd[i]);
+	lost_closed += openfd[i]->lost;
+	start_bh_atomic();
+	ackwait_purge(openfd[i]);
+	end_bh_atomic();
 	kfree((void *)openfd[i]);
 	openfd[i] = NULL;
 }
@@ -464,20 +2095,20 @@ can_read(struct file *file, char *buf, size_t count, loff_t *ppos)
 	ssize_t retval = 0;
 	int got;
 
-	if (count < PKTSIZE)
+	if (count < FS_PKTSIZE(fstate))
 		return -EIO;
 
 	do {
-		got = ring_to_user(&fstate->inq, buf, count / PKTSIZE);
+		got = rxlog_to_user(fstate, buf, count / FS_PKTSIZE(fstate));
 		if (got < 0)
 			retval = -EFAULT;
 		else if (got > 0)
-			retval = got * PKTSIZE;
+			retval = got * FS_PKTSIZE(fstate);
 		else if (got == 0) {
 			if (file->f_flags & O_NONBLOCK)	
 				retval = -EAGAIN;
 			else {
-				interruptible_sleep_on(&fstate->readq);
+				can_sleep(fstate);
 				if (current->sigpending != 0)
 					retval = -EINTR;
 			}
@@ -487,30 +2118,51 @@ can_read(struct file *file, char *buf, size_t count, loff_t *ppos)
 	return retval;
 }
 
+/*
+ * Sleep until there is room in what held up user_to_outq(): fullq, or if
+ * that is NULL the fd's transmit ring (see can_sleep()).
+ */
+static void
+can_wsleep(struct file_state *fs, pktq_t *fullq)
+{
+	struct wait_queue wait = { current, NULL };
+	struct wait_queue **q = fullq ? &txwait : &fs->writeq;
+
+	current->state = TASK_INTERRUPTIBLE;
+	add_wait_queue(q, &wait);
+	if (fullq ? pktq_full(fullq) : fs->txq != NULL && RING_FULL(*fs->txq))
+		schedule();
+	current->state = TASK_RUNNING;
+	remove_wait_queue(q, &wait);
+}
+
 /* 
  * Write operation.
  */
 static ssize_t 
 can_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
 {
+	struct file_state *fstate = (struct file_state *)(file->private_data);
 	ssize_t retval = 0;
+	pktq_t *fullq;
 	int i;
 
 	if (count % PKTSIZE != 0)
 		return -EIO;
-
+	if (count == 0)
+		return 0;
 
 	do {
-		i = user_to_outq(buf, count / PKTSIZE);
+		i = user_to_outq(fstate, buf, count / PKTSIZE, &fullq);
 		if (i < 0)
-			retval = -EFAULT;
+			retval = i;
 		else if (i > 0)
 			retval = i * PKTSIZE;
 		else if (i == 0) {
 			if (file->f_flags & O_NONBLOCK)	
 				retval = -EAGAIN;
 			else {
-				interruptible_sleep_on(&writeq);
+				can_wsleep(fstate, fullq);
 				if (current->sigpending != 0)
 					retval = -EINTR;
 			}
@@ -520,40 +2172,204 @@ can_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
 	return retval;
 }
 
-/* helper for can_intr()  */
+/*
+ * Poll operation.  Readable when the receive log holds packets this fd
+ * wants, writable when there is room in the fd's transmit ring.
+ */
+static unsigned int
+can_poll(struct file *file, poll_table *wait)
+{
+	struct file_state *fstate = (struct file_state *)(file->private_data);
+	unsigned int mask = 0;
+
+	poll_wait(file, &fstate->readq, wait);
+	if (fd_sharedq(fstate) != NULL)
+		poll_wait(file, fd_sharedq(fstate), wait);
+	poll_wait(file, &fstate->writeq, wait);
+
+	if (fd_pending(fstate))
+		mask |= POLLIN | POLLRDNORM;
+	if (fstate->txq == NULL || !RING_FULL(*fstate->txq))
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+/*
+ * Mmap operation.  Map this fd's receive ring (struct can_mmap_ring),
+ * allocating it on first use.  From then on the fd's packets are delivered
+ * to the ring, where the reader can take them without a system call, 
+ * using poll() only to sleep when the ring is empty.  read() takes packets
+ * from the same ring.
+ */
+static int
+can_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct file_state *fstate = (struct file_state *)(file->private_data);
+	unsigned long len = vma->vm_end - vma->vm_start;
+
+	if (len != CAN_MMAP_SIZE || vma->vm_offset != 0)
+		return -EINVAL;
+	if (fstate->format != CAN_FORMAT_1)	/* ring holds format 1 */
+		return -EINVAL;
+	if (fstate->ring == NULL && can_alloc_ring(fstate) < 0)
+		return -ENOMEM;
+	if (remap_page_range(vma->vm_start, virt_to_phys(fstate->ring), 
+	    len, vma->vm_page_prot))
+		return -EAGAIN;
+	return 0;
+}
+
+/* 
+ * Take the next packet from the highest priority class that has one.
+ * Bulk packets are shared out by txsched_next().
+ */
+static inline int
+txq_to_pkt(struct can_packet *pkt)
+{
+	int i;
+
+	for (i = 0; i < TXQ_BULK; i++) {
+		if (ring_to_pkt(pkt, &outq[i])) {
+			wake_up_interruptible(&txwait);
+			return 1;
+		}
+	}
+	return txsched_next(pkt);
+}
+
+/* 
+ * Helper for can_intr() and send_pkt().  Only one CPU at a time may 
+ * consume outq and load the transmit buffer.  A caller that finds the 
+ * transmitter busy leaves XMIT_AGAIN set so the holder goes around once 
+ * more, instead of spinning.
+ */
 static void 
 try_xmit(void)
 {
-	int i = 0;
 	struct can_packet pkt;
+	unsigned long depth;
+	int i;
 
-	while (reg->status & CAN_STATUS_XMIT_AVAIL && ring_to_pkt(&pkt, &outq)){
-		can_copy_tx(&pkt);
-		reg->command = CAN_COMMAND_TRANSMIT;
-		i++;
+	set_bit(XMIT_AGAIN, &xmit_flags);
+	while (!test_and_set_bit(XMIT_BUSY, &xmit_flags)) {
+		clear_bit(XMIT_AGAIN, &xmit_flags);
+		for (i = 0; i < TXQ_MAX; i++) {
+			depth = pktq_size(&outq[i]);
+			if (depth > canstats.txq_maxdepth[i])
+				canstats.txq_maxdepth[i] = depth;
+		}
+		while (reg->status & CAN_STATUS_XMIT_AVAIL 
+				&& txq_to_pkt(&pkt)) {
+			can_copy_tx(&pkt);
+			reg->command = CAN_COMMAND_TRANSMIT;
+			canstats.tx_packets++;
+			canstats.tx_type[pkt.ext.ext.type]++;
+		}
+		clear_bit(XMIT_BUSY, &xmit_flags);
+		if (!test_bit(XMIT_AGAIN, &xmit_flags))
+			break;
 	}
-	if (i > 0)
-		wake_up_interruptible(&writeq);
 }
 
-/* helper for can_intr() */
-static void 
+/* 
+ * Helper for can_intr() and can_rxpoll(), which hold rx_lock.  
+ * Return the number of packets taken from the chip.
+ */
+static int 
 try_recv(void)
 {
 	int i = 0;
 	struct can_packet pkt;
 
-	while (reg->status & CAN_STATUS_RECV_AVAIL) {
+	while (reg->status & CAN_STATUS_RECV_AVAIL && i < RXPOLL_BUDGET) {
 		can_copy_rx(&pkt);
 		reg->command = CAN_COMMAND_CLR_RECV;
 		incoming_fixup(&pkt);
 		pkt_to_ring(&pkt, &inq);
 		i++;
 	}
+	canstats.rx_packets += i;
 	if (i > 0) {
 		queue_task(&bh_tq, &tq_immediate);
 		mark_bh(IMMEDIATE_BH);
 	}
+	return i;
+}
+
+/* 
+ * Switch between interrupt driven and polled receive (with rx_lock held).
+ */
+static void
+rxpoll_start(void)
+{
+	rxpolling = 1;
+	reg->control &= ~CAN_CONTROL_RIE;
+	canstats.rxpoll_enter++;
+	mod_timer(&rxpoll_timer, jiffies + 1);
+}
+
+static void
+rxpoll_stop(void)
+{
+	rxpolling = 0;
+	reg->control |= CAN_CONTROL_RIE;
+	canstats.rxpoll_exit++;
+	/* a packet that slipped in before RIE was set raises no interrupt */
+	try_recv();
+}
+
+/*
+ * Poll the chip from the bottom half.  If it is empty, go back to 
+ * interrupts; else try_recv() has queued the bottom half to poll again.
+ */
+static void
+can_rxpoll(void)
+{
+	unsigned long flags;
+	int n;
+
+	spin_lock_irqsave(&rx_lock, flags);
+	if (rxpolling) {
+		n = try_recv();
+		canstats.rxpoll_packets += n;
+		if (n == 0)
+			rxpoll_stop();
+		else
+			mod_timer(&rxpoll_timer, jiffies + 1);
+	}
+	spin_unlock_irqrestore(&rx_lock, flags);
+}
+
+/* in case the bottom half doesn't come round again soon enough */
+static void
+rxpoll_expire(unsigned long foo)
+{
+	if (rxpolling) {
+		queue_task(&bh_tq, &tq_immediate);
+		mark_bh(IMMEDIATE_BH);
+	}
+}
+
+/* 
+ * Receive from interrupt context, switching to polled receive if the
+ * packet rate over the last RXPOLL_WINDOW is above rxpoll_rate.
+ */
+static void
+can_rxintr(void)
+{
+	spin_lock(&rx_lock);
+	if (!rxpolling) {
+		if (jiffies - rxwin_start >= RXPOLL_WINDOW) {
+			rxwin_start = jiffies;
+			rxwin_count = 0;
+		}
+		rxwin_count += try_recv();
+		if (rxpoll_rate != 0 
+		    && rxwin_count * HZ > rxpoll_rate * RXPOLL_WINDOW)
+			rxpoll_start();
+	}
+	spin_unlock(&rx_lock);
 }
 
 /*
@@ -562,18 +2378,19 @@ try_recv(void)
 static void 
 can_intr(int irq, void *dev_id, struct pt_regs *pregs) 
 {
+	/* just count these - printk from here is slow and may loop via cancon */
 	if (reg->status & CAN_STATUS_OVERRUN) {
 		reg->command = CAN_COMMAND_CLR_OVERRUN;
-		printk("can: overrun cleared\n");
+		canstats.chip_overruns++;
 	}
 	if (reg->status & CAN_STATUS_ERROR_STAT)
-		printk("can: error detected\n");
+		canstats.bus_errors++;
 	if (reg->control & CAN_CONTROL_RESET)
-		printk("can: reset is active\n");
+		canstats.resets++;
 	if (reg->status & CAN_STATUS_BUS_STAT)
-		printk("can: bus stat\n");
+		canstats.bus_status++;
 
-	try_recv();
+	can_rxintr();
 	try_xmit();
 
 	(void)reg->interrupt;		/* clear pending interrupts */
@@ -582,22 +2399,80 @@ can_intr(int irq, void *dev_id, struct pt_regs *pregs)
 static void
 deliver_pkt(struct can_packet *pkt)
 {
+	struct can_subidx *s;
+	struct file_state *owner = NULL;
+	struct can_xact *xact;
+	unsigned long rcpt = RX_ANY;
+	unsigned long seq;
+	uint32_t age;
+	uint64_t nsec = incoming_stamp(pkt, &age);
 	int i;
 
+	if (age / 1000 > canstats.bh_latency_max)
+		canstats.bh_latency_max = age / 1000;
+	canstats.bh_latency_total += age / 1000;
+
+	canstats.rx_type[pkt->ext.ext.type]++;
+	canstats.rx_obj[pkt->ext.ext.object]++;
+
 	/* give kernel a chance to dispatch object */
 	if (IS_MYPACKET(pkt))
 		canobj_packet(pkt); 
 
-	/* now user space */
-	for (i = 0; i < CAN_MAX_USECOUNT; i++) {
-		if (openfd[i] == NULL)
-			continue;
-		if (!IS_MYPACKET(pkt) && !openfd[i]->promiscuous
-				&& !openfd[i]->snoopy)
-			continue;
-		if (pkt_to_ring(pkt, &openfd[i]->inq) > 0)
-			wake_up_interruptible(&openfd[i]->readq);
+	/* an ACK/NAK goes to the fd that sent the request, if any */
+	if (IS_MYPACKET(pkt) && IS_ACKNAK(pkt->ext.ext.type)) {
+		owner = ackwait_match(pkt, &xact);
+		if (xact != NULL) {
+			/* CAN_TRANSACT - only monitors see it in the log */
+			xact->reply = *pkt;
+			xact->nsec = nsec;
+			wmb();
+			xact->done = 1;
+			wake_up_interruptible(xact->waitq);
+			owner = NULL;
+		}
+		rcpt = owner ? owner->id : RX_MONITOR;
+	}
+
+	/* now user space - one copy no matter how many fd's are open */
+	seq = rxlog_head;
+	rxlog[RXLOG_SLOT(seq)] = *pkt;
+	rxlog_rcpt[RXLOG_SLOT(seq)] = rcpt;
+	rxlog_nsec[RXLOG_SLOT(seq)] = nsec;
+
+	/* each filter runs once here; readers use the verdict */
+	for (i = 0; i < filtfd_count; i++)
+		if (can_filter_run(filtfd[i]->filter, pkt) != 0)
+			set_bit(RXLOG_SLOT(seq), filtfd[i]->filtpass);
+		else
+			clear_bit(RXLOG_SLOT(seq), filtfd[i]->filtpass);
+	wmb();
+	rxlog_head++;
+
+	/* fd's that have mmapped a ring get their own copy */
+	for (i = 0; i < ringfd_count; i++)
+		if (fd_wants(ringfd[i], pkt, rcpt, seq))
+			pkt_to_mring(pkt, ringfd[i]);
+
+	if (owner != NULL) {
+		wake_up_interruptible(&owner->readq);
+		wake_up_interruptible(&rxwait_all);
+		return;
 	}
+
+	/* subscribers to this object only */
+	for (s = subidx[pkt->ext.ext.object]; s != NULL; s = s->next)
+		if (s->fs->filter == NULL && fd_wants(s->fs, pkt, rcpt, seq))
+			wake_up_interruptible(&s->fs->readq);
+
+	/* fd's whose filter program accepts the packet */
+	for (i = 0; i < filtfd_count; i++)
+		if (fd_wants(filtfd[i], pkt, rcpt, seq))
+			wake_up_interruptible(&filtfd[i]->readq);
+
+	if (IS_MYPACKET(pkt) && rcpt == RX_ANY)
+		wake_up_interruptible(&rxwait);
+	wake_up_interruptible(&rxwait_all);
 }
 
 /* 
@@ -607,10 +2482,17 @@ static void
 can_bh(void *data)
 {
 	struct can_packet pkt;
+	unsigned long depth = pktq_size(&inq);
 
+	canstats.bh_runs++;
+	if (depth > canstats.inq_maxdepth)
+		canstats.inq_maxdepth = depth;
 	while (ring_to_pkt(&pkt, &inq)) {
 		deliver_pkt(&pkt);
 	}
+	wake_up_interruptible(&txwait);
+	if (rxpolling)
+		can_rxpoll();
 }
 
 static void 
@@ -647,24 +2529,96 @@ can_unmap_82c200(struct can_reg *regp)
 	sparc_free_io(regp, PAGE_SIZE);
 }
  
+/*
+ * Work out the tightest 82C200 acceptance code and mask (a 1 in the mask
+ * means don't care) that pass every frame someone wants.  The chip sees 
+ * only the first identifier byte: lpriority, dest and the top two bits of 
+ * src.  We always want frames for this node.  A promiscuous fd wants all 
+ * frames, or if it has a filter program, those whose lpriority and dest 
+ * the program might accept.  Subscriptions match on the extended header, 
+ * which the chip can't see, so they don't narrow it.
+ */
+#define ACCEPT_BYTE(lpri, dest)	(((lpri) << 7) | ((dest) << 2))
+
+static void
+can_accept_compute(uint8_t *codep, uint8_t *maskp)
+{
+	uint8_t memo[CAN_FILTER_MAXINSNS];
+	uint8_t code = ACCEPT_BYTE(0, UNPACK_NODE(can_nodeid));
+	uint8_t mask = 0x83;
+	struct file_state *fs;
+	int i, lpri, dest;
+
+	for (i = 0; i < CAN_MAX_USECOUNT && mask != 0xff; i++) {
+		if ((fs = openfd[i]) == NULL || !fs->promiscuous)
+			continue;
+		if (fs->filter == NULL) {
+			mask = 0xff;
+			break;
+		}
+		for (lpri = 0; lpri < 2; lpri++) {
+			for (dest = 0; dest < 32; dest++) {
+				memset(memo, 0, sizeof(memo));
+				if (can_filter_may_accept(fs->filter, 0, 1, 0,
+				    lpri, dest, memo))
+					mask |= ACCEPT_BYTE(lpri, dest) ^ code;
+			}
+		}
+	}
+	*codep = code & ~mask;
+	*maskp = mask;
+}
+
+/*
+ * Reprogram the acceptance filter if the set of frames wanted has changed.
+ * The registers can only be written in reset mode, which would abort a 
+ * frame being sent, so hold off the transmitter and give the chip up to 
+ * 2ms to finish the one it has.
+ */
+static void
+can_update_accept(void)
+{
+	uint8_t code, mask;
+	unsigned long flags;
+	int i, ctl;
+
+	can_accept_compute(&code, &mask);
+	if (code == accept_code && mask == accept_mask)
+		return;
+	xmit_lock();
+	for (i = 0; i < 200 && !(reg->status & CAN_STATUS_XMIT_DONE); i++)
+		udelay(10);
+	spin_lock_irqsave(&rx_lock, flags);
+	accept_code = code;
+	accept_mask = mask;
+	ctl = reg->control;
+	reg->control = CAN_CONTROL_RESET;
+	reg->accept_code = code;
+	reg->accept_mask = mask;
+	reg->control = ctl & ~CAN_CONTROL_RESET;
+	spin_unlock_irqrestore(&rx_lock, flags);
+	canstats.accept_changes++;
+	xmit_unlock();
+	try_xmit();
+}
+
 /*
  * Initialize the 82C200.  This can be called more than once to clear a hung
- * chip or enter/leave promiscuous mode.
+ * chip.
  */
 static int 
-can_init_82c200(int promiscuous)
+can_init_82c200(void)
 {
 	static int first_time = 1;
 
 #ifdef 	VERBOSE
-	if (!first_time) {
-		printk("can: resetting chip (promiscuous %s)\n", 
-		    promiscuous ? "ON" : "OFF");
-	}
+	if (!first_time)
+		printk("can: resetting chip\n");
 #endif
+	can_accept_compute(&accept_code, &accept_mask);
 	reg->control = CAN_CONTROL_RESET;	/* enter reset mode */
-	reg->accept_mask = (promiscuous ? 0xff : 0x83);
-	reg->accept_code = UNPACK_NODE(can_nodeid) << 2;
+	reg->accept_mask = accept_mask;
+	reg->accept_code = accept_code;
 	reg->bus_timing0 = 0x40; /* mk401 spec says 0 ??? */
 	reg->bus_timing1 = 0x16; /* mk401 spec says 0x14 ??? */
 	reg->out_control = 0xaa;
@@ -700,7 +2654,9 @@ can_fini_82c200(void)
 static struct file_operations can_fops = {
 	read:	can_read,
 	write:	can_write,
+	poll:	can_poll,
 	ioctl:	can_ioctl,
+	mmap:	can_mmap,
 	open:	can_open,
 	release:can_release
 };
@@ -752,11 +2708,22 @@ __initfunc(int can_init(void))
 		return error;
 	}
 
-	can_init_queues();
+	if (can_init_queues() < 0) {
+		printk("can: can't allocate queues\n");
+		misc_deregister(&can_dev);
+		can_unmap_82c200(reg);
+		return -ENOMEM;
+	}
+	ackwait_init();
+	init_timer(&txtimer);
+	txtimer.function = txtimer_expire;
+	init_timer(&rxpoll_timer);
+	rxpoll_timer.function = rxpoll_expire;
 	can_init_bh();
-	if (can_init_82c200(0) == -1) {
+	if (can_init_82c200() == -1) {
 		printk("can: can't allocate can interrupt\n");
 		misc_deregister(&can_dev);
+		can_fini_queues();
 		can_unmap_82c200(reg);
 		return -1;
 	}
@@ -764,6 +2731,7 @@ __initfunc(int can_init(void))
 	can_init_openfd();
 	canobj_init();
 	cancon_init();
+	can_init_proc();
 
 	return 0;
 }
@@ -771,10 +2739,14 @@ __initfunc(int can_init(void))
 #ifdef MODULE
 void cleanup_module(void)
 {
+	can_fini_proc();
 	cancon_cleanup();
 	canobj_cleanup();
 	misc_deregister(&can_dev);
 	can_fini_82c200();
+	del_timer(&txtimer);
+	del_timer(&rxpoll_timer);
+	can_fini_queues();
 	can_unmap_82c200(reg);
 #ifdef	VERBOSE
 	printk("can: fini\n");
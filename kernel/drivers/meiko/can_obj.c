@@ -238,7 +238,7 @@ canobj_autoboot(struct can_packet *pkt)
 {
 	char *table[] = OBP_BOOLEAN;
 	int handled = 1;
-	uint32_t val;
+	uint32_t val = 0;
 
 	switch(pkt->ext.ext.type) {
 		case CANTYPE_RO:
@@ -305,7 +305,7 @@ canobj_boot_dev(struct can_packet *pkt)
 {
 	char *table[] = OBP_BOOT_DEVICE_VALUES;
 	int handled = 1;
-	uint32_t val;
+	uint32_t val = 0;
 
 	switch(pkt->ext.ext.type) {
 		case CANTYPE_RO:
@@ -0,0 +1,750 @@
+/*
+ * $Id$
+ *
+ * Capacity planning for the CAN network of a CS/2 installation.  Each
+ * module has an L-CAN segment with up to 16 nodes, each running its own
+ * copy of the CAN driver on an emulated 82C200, its board H8s and its
+ * module H8.  The module H8s relay between their L-CANs and the X-CAN,
+ * which joins the modules.  Module 0's L-CAN also has a console host
+ * that every node's CAN console is connected to.
+ *
+ * The load is what the drivers send by themselves (heartbeats, and IAMs
+ * on behalf of the board H8), console output printk'd at a set rate,
+ * and packets written to /dev/can at a set rate to random other nodes,
+ * as a stand in for user traffic.  The report gives each bus's
+ * utilization and how long frames waited for it, end to end latency of
+ * the /dev/can traffic, and where packets were lost.
+ *
+ * The H8s are models, as nothing documents them.  A module H8 handles
+ * one frame at a time, taking -r usec each, and holds up to -q frames
+ * for each bus; more are dropped.  A request it relays is remembered
+ * (by object and address, as the driver matches ACKs) so that the
+ * response can be sent back the way it came.  On the X-CAN, a frame's
+ * destination and source are module numbers.  The board H8s only count
+ * the heartbeats they get.
+ *
+ * All nodes share one clock, sim_now here.  Each node keeps its own,
+ * and is run up to this one before anything touches it, and whenever
+ * it has a timer due.  Nodes must not sleep, so their files are opened
+ * O_NONBLOCK.
+ *
+ * usage: bussim [-v] [-m modules] [-n nodes] [-t sec] [-a pkt/s]
+ *               [-c char/s] [-r usec] [-q frames] [-x bit/s] [-s seed]
+ */
+
+#define _GNU_SOURCE		/* RTLD_DEFAULT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#include "sim.h"
+
+#define MODULE_MAX	31		/* X-CAN addresses */
+#define NODE_MAX	16		/* per module, below the board H8s */
+#define CONHOST		0x18		/* console host, on module 0 */
+#define BENCH_OBJ	0x50		/* the /dev/can traffic */
+#define ROUTE_MAX	64		/* requests an H8 remembers */
+#define DRAIN		5000000ULL	/* nsec between reads of a node */
+#define SETTLE		500000000ULL	/* nsec to see if things have */
+#define SETTLE_MAX	20		/*   settled after the load stops */
+#define LINE		32		/* console line, with newline */
+
+#define NSEC		1000000000ULL
+#define BOOTED		(HB_INTERVAL * NSEC / HZ)	/* all nodes up */
+
+#define IS_ACKABLE(t)	((t) == CANTYPE_RO || (t) == CANTYPE_WO \
+			|| (t) == CANTYPE_DAT || (t) == CANTYPE_SIG)
+#define IS_ACKNAK(t)	((t) == CANTYPE_ACK || (t) == CANTYPE_NAK)
+
+struct sim_event {
+	uint64_t		when;
+	void			(*fn)(void *arg);
+	void			*arg;
+	struct sim_event	*next;
+};
+
+/* frames waiting to go from a model onto one bus */
+struct relayq {
+	struct sim_port	port;
+	struct can_packet *q;
+	uint64_t	*ready;
+	int		head;
+	int		count;
+	uint64_t	*cpu;		/* owner busy until */
+	unsigned long	sent;
+	unsigned long	dropped;
+};
+
+struct route {
+	uint32_t	key;		/* ACKWAIT_KEY */
+	int		to;		/* node or module */
+	int		used;
+};
+
+struct h8 {
+	int		module;
+	struct sim_bus	lcan;
+	struct relayq	tol;		/* on the L-CAN */
+	struct relayq	tox;		/* on the X-CAN */
+	uint64_t	cpu;
+	struct route	out[ROUTE_MAX];	/* our requests, by L-CAN source */
+	struct route	in[ROUTE_MAX];	/* theirs, by X-CAN source */
+	int		outnext, innext;
+	unsigned long	own;		/* frames for the H8 itself */
+	unsigned long	stray;		/* responses to nothing we relayed */
+	unsigned long	heartbeats;	/* to the board H8s */
+};
+
+struct node {
+	const struct sim_node *ops;
+	int		module;
+	int		node;
+	struct file	*f;
+	unsigned long	sent;
+	unsigned long	busy;		/* write said EAGAIN */
+	unsigned long	rcvd;
+	unsigned long	con_offered;
+};
+
+struct lat {
+	unsigned long	n;
+	uint64_t	total;		/* usec */
+	uint64_t	max;
+};
+
+uint64_t		sim_now;
+static struct sim_event	*events;
+
+static struct sim_bus	xcan = { "X-CAN", 500000 };
+static struct h8	h8[MODULE_MAX];
+static struct node	*nodes;
+static struct node	**booted;	/* in the order they came up */
+static int		nmodules = 2, nnodes = 8, total, nbooted;
+
+static struct relayq	conhost;	/* its ACKs */
+static uint64_t		conhost_cpu;
+static unsigned long	con_delivered;
+
+static uint64_t		stop;		/* the load stops */
+static double		app_rate = 20;	/* pkt/s per node */
+static double		con_rate = 20;	/* char/s per node */
+static uint64_t		turnaround = 200000;
+static int		qmax = 16;
+static unsigned long	seed = 1;
+
+static struct lat	lat_local, lat_remote;
+
+/*
+ * The world
+ */
+void
+sim_at(uint64_t when, void (*fn)(void *), void *arg)
+{
+	struct sim_event *e, **pp;
+
+	if ((e = malloc(sizeof(*e))) == NULL) {
+		fprintf(stderr, "bussim: out of memory\n");
+		exit(1);
+	}
+	e->when = when < sim_now ? sim_now : when;
+	e->fn = fn;
+	e->arg = arg;
+	for (pp = &events; *pp != NULL && (*pp)->when <= e->when;
+	    pp = &(*pp)->next)
+		;
+	e->next = *pp;
+	*pp = e;
+}
+
+/* bring every node up to now, and let them do what is due */
+static void
+nodes_run(void)
+{
+	int i;
+
+	for (i = 0; i < total; i++)
+		nodes[i].ops->run(sim_now);
+}
+
+/*
+ * Run until time until.  Nodes go first at each moment, so what they
+ * queue then arbitrates together.
+ */
+static void
+world_run(uint64_t until)
+{
+	struct sim_event *e;
+	uint64_t t, next;
+	int i;
+
+	for (;;) {
+		t = events != NULL ? events->when : UINT64_MAX;
+		for (i = 0; i < total; i++)
+			if ((next = nodes[i].ops->next()) < t)
+				t = next;
+		if (t > until)
+			break;
+		if (t > sim_now)
+			sim_now = t;
+		nodes_run();
+		while ((e = events) != NULL && e->when <= sim_now) {
+			events = e->next;
+			e->fn(e->arg);
+			free(e);
+			nodes_run();
+		}
+	}
+	sim_now = until;
+	nodes_run();
+}
+
+static double
+urand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 1) & 0x3fffffff) / (double)0x40000000;
+}
+
+/* a mean interval of nsec, give or take half */
+static uint64_t
+jitter(double nsec)
+{
+	return nsec * (0.5 + urand());
+}
+
+static void
+lat_add(struct lat *l, uint64_t usec)
+{
+	l->n++;
+	l->total += usec;
+	if (usec > l->max)
+		l->max = usec;
+}
+
+/*
+ * Relay queues, for the models
+ */
+static void
+relay_kick(void *arg)
+{
+	struct relayq *rq = arg;
+
+	rq->port.since = rq->ready[rq->head];
+	sim_bus_request(&rq->port);
+}
+
+static struct can_packet *
+relay_txpkt(struct sim_port *p)
+{
+	struct relayq *rq = (struct relayq *)p;
+
+	if (rq->count == 0 || rq->ready[rq->head] > sim_now)
+		return NULL;
+	return &rq->q[rq->head];
+}
+
+static void
+relay_txdone(struct sim_port *p)
+{
+	struct relayq *rq = (struct relayq *)p;
+
+	rq->head = (rq->head + 1) % qmax;
+	rq->count--;
+	rq->sent++;
+	if (rq->count == 0)
+		return;
+	if (rq->ready[rq->head] <= sim_now)
+		relay_kick(rq);
+	else
+		sim_at(rq->ready[rq->head], relay_kick, rq);
+}
+
+static void
+relay_init(struct relayq *rq, struct sim_bus *b, uint64_t *cpu,
+    void (*rx)(struct sim_port *p, struct can_packet *pkt), void *arg)
+{
+	rq->q = calloc(qmax, sizeof(*rq->q));
+	rq->ready = calloc(qmax, sizeof(*rq->ready));
+	if (rq->q == NULL || rq->ready == NULL) {
+		fprintf(stderr, "bussim: out of memory\n");
+		exit(1);
+	}
+	rq->cpu = cpu;
+	rq->port.txpkt = relay_txpkt;
+	rq->port.txdone = relay_txdone;
+	rq->port.rx = rx;
+	rq->port.arg = arg;
+	sim_bus_attach(b, &rq->port);
+}
+
+/* send pkt when the owner has dealt with it, if there is room */
+static void
+relay_put(struct relayq *rq, struct can_packet *pkt)
+{
+	int i;
+
+	if (rq->count == qmax) {
+		rq->dropped++;
+		return;
+	}
+	i = (rq->head + rq->count++) % qmax;
+	rq->q[i] = *pkt;
+	if (*rq->cpu < sim_now)
+		*rq->cpu = sim_now;
+	*rq->cpu += turnaround;
+	rq->ready[i] = *rq->cpu;
+	if (rq->count == 1)
+		sim_at(rq->ready[i], relay_kick, rq);
+}
+
+/*
+ * Module H8s
+ */
+static void
+route_put(struct route *r, int *next, uint32_t key, int to)
+{
+	int i;
+
+	for (i = 0; i < ROUTE_MAX; i++)
+		if (r[i].used && r[i].key == key)
+			break;
+	if (i == ROUTE_MAX) {
+		i = *next;
+		*next = (*next + 1) % ROUTE_MAX;
+	}
+	r[i].key = key;
+	r[i].to = to;
+	r[i].used = 1;
+}
+
+static int
+route_take(struct route *r, uint32_t key)
+{
+	int i;
+
+	for (i = 0; i < ROUTE_MAX; i++) {
+		if (r[i].used && r[i].key == key) {
+			r[i].used = 0;
+			return r[i].to;
+		}
+	}
+	return -1;
+}
+
+/* a frame on our L-CAN */
+static void
+h8_lrx(struct sim_port *p, struct can_packet *pkt)
+{
+	struct h8 *h = p->arg;
+	struct can_packet x = *pkt;
+	int type = pkt->ext.ext.type, to;
+
+	if (pkt->can.can.dest >= CAN_GET_BOARD_H8(0)
+	    && pkt->can.can.dest <= CAN_GET_BOARD_H8(NODE_MAX - 1)) {
+		if (pkt->ext.ext.object == CANOBJ_HEARTBEAT)
+			h->heartbeats++;
+		return;
+	}
+	if (pkt->can.can.dest != CAN_MODULE_H8)
+		return;
+	if (IS_ACKNAK(type)) {
+		if ((to = route_take(h->in, ACKWAIT_KEY(pkt->ext))) == -1) {
+			h->stray++;
+			return;
+		}
+	} else if (pkt->ext.ext.module == h->module) {
+		h->own++;
+		return;
+	} else {
+		to = pkt->ext.ext.module;
+		if (IS_ACKABLE(type))
+			route_put(h->out, &h->outnext, ACKWAIT_KEY(pkt->ext),
+			    pkt->can.can.src);
+	}
+	x.can.can.dest = to;
+	x.can.can.src = h->module;
+	relay_put(&h->tox, &x);
+}
+
+/* a frame on the X-CAN */
+static void
+h8_xrx(struct sim_port *p, struct can_packet *pkt)
+{
+	struct h8 *h = p->arg;
+	struct can_packet l = *pkt;
+	int type = pkt->ext.ext.type, to;
+
+	if (pkt->can.can.dest != h->module)
+		return;
+	if (IS_ACKNAK(type)) {
+		if ((to = route_take(h->out, ACKWAIT_KEY(pkt->ext))) == -1) {
+			h->stray++;
+			return;
+		}
+	} else {
+		to = pkt->ext.ext.node;
+		if (IS_ACKABLE(type))
+			route_put(h->in, &h->innext, ACKWAIT_KEY(pkt->ext),
+			    pkt->can.can.src);
+	}
+	l.can.can.dest = to;
+	l.can.can.src = CAN_MODULE_H8;
+	relay_put(&h->tol, &l);
+}
+
+/*
+ * The console host ACKs every console packet
+ */
+static void
+conhost_rx(struct sim_port *p, struct can_packet *pkt)
+{
+	struct can_packet ack = *pkt;
+
+	if (pkt->can.can.dest != CONHOST || pkt->ext.ext.type != CANTYPE_DAT)
+		return;
+	con_delivered += pkt->can.can.length - sizeof(can_header_ext);
+	ack.can.can.dest = pkt->can.can.src;
+	ack.can.can.src = CONHOST;
+	ack.can.can.length = sizeof(can_header_ext);
+	ack.ext.ext.type = CANTYPE_ACK;
+	relay_put(&conhost, &ack);
+}
+
+/*
+ * The load
+ */
+static void
+app_send(void *arg)
+{
+	struct node *n = arg;
+	struct node *to;
+	struct can_packet pkt;
+	int i;
+
+	if (sim_now >= stop)
+		return;
+	i = urand() * (total - 1);
+	to = &nodes[i >= n - nodes ? i + 1 : i];
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.can.can.lpriority = CAN_LOW_PRIORITY;
+	pkt.can.can.dest = to->module == n->module ? to->node : CAN_MODULE_H8;
+	pkt.can.can.length = sizeof(can_header_ext) + sizeof(can_dat);
+	pkt.ext.ext.type = CANTYPE_WNA;
+	pkt.ext.ext.module = to->module;
+	pkt.ext.ext.node = to->node;
+	pkt.ext.ext.object = BENCH_OBJ;
+	pkt.dat.dat = sim_now / 1000;
+	if (n->ops->write(n->f, &pkt, sizeof(pkt)) == sizeof(pkt))
+		n->sent++;
+	else
+		n->busy++;
+	sim_at(sim_now + jitter(NSEC / app_rate), app_send, n);
+}
+
+static void
+app_drain(void *arg)
+{
+	struct node *n = arg;
+	struct can_packet_v2 buf[64];
+	uint64_t usec;
+	int i, got;
+
+	while ((got = n->ops->read(n->f, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < got / sizeof(buf[0]); i++) {
+			if (buf[i].pkt.ext.ext.object != BENCH_OBJ)
+				continue;
+			n->rcvd++;
+			usec = (uint32_t)(buf[i].nsec / 1000
+			    - buf[i].pkt.dat.dat);
+			lat_add(buf[i].pkt.can.can.src == CAN_MODULE_H8
+			    ? &lat_remote : &lat_local, usec);
+		}
+	}
+	sim_at(sim_now + DRAIN, app_drain, n);
+}
+
+static void
+con_print(void *arg)
+{
+	struct node *n = arg;
+	char line[LINE + 1];
+
+	if (sim_now >= stop)
+		return;
+	snprintf(line, sizeof(line), "%2d.%-2d %-*lu\n", n->module, n->node,
+	    LINE - 7, n->con_offered);
+	n->ops->console(line);
+	n->con_offered += LINE + 1;		/* newline goes as \r\n */
+	sim_at(sim_now + jitter(NSEC * LINE / con_rate), con_print, n);
+}
+
+static void
+boot(void *arg)
+{
+	struct node *n = arg;
+	int format = CAN_FORMAT_2;
+
+	n->ops->run(sim_now);
+	if (n->ops->init((n->module << 6) | n->node) < 0
+	    || (n->f = n->ops->open(O_RDWR | O_NONBLOCK)) == NULL
+	    || n->ops->ioctl(n->f, CAN_SET_FORMAT, &format) < 0) {
+		fprintf(stderr, "bussim: node %d.%d didn't come up\n",
+		    n->module, n->node);
+		exit(1);
+	}
+	booted[nbooted++] = n;
+
+	/* the load starts once everyone is up */
+	if (app_rate > 0 && total > 1)
+		sim_at(BOOTED + jitter(NSEC / app_rate), app_send, n);
+	if (con_rate > 0)
+		sim_at(BOOTED + jitter(NSEC * LINE / con_rate), con_print, n);
+	sim_at(sim_now + DRAIN, app_drain, n);
+}
+
+/*
+ * Set up
+ */
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bussim [-v] [-m modules] [-n nodes] "
+	    "[-t sec] [-a pkt/s]\n"
+	    "              [-c char/s] [-r usec] [-q frames] [-x bit/s] "
+	    "[-s seed]\n");
+	exit(2);
+}
+
+static void
+world_init(int verbose)
+{
+	char name[32];
+	struct node *n;
+	int m, i;
+
+	for (i = 0; ; i++) {
+		snprintf(name, sizeof(name), "sim_node_%d", i);
+		if (dlsym(RTLD_DEFAULT, name) == NULL)
+			break;
+	}
+	if (nmodules * nnodes > i) {
+		fprintf(stderr, "bussim: built for %d nodes (make SIM_NODES=n)\n",
+		    i);
+		exit(1);
+	}
+	total = nmodules * nnodes;
+	nodes = calloc(total, sizeof(*nodes));
+	booted = calloc(total, sizeof(*booted));
+	if (nodes == NULL || booted == NULL) {
+		fprintf(stderr, "bussim: out of memory\n");
+		exit(1);
+	}
+
+	for (m = 0; m < nmodules; m++) {
+		h8[m].module = m;
+		snprintf(name, sizeof(name), "L-CAN %d", m);
+		h8[m].lcan.name = strdup(name);
+		h8[m].lcan.bitrate = sim_lcan.bitrate;
+		relay_init(&h8[m].tol, &h8[m].lcan, &h8[m].cpu, h8_lrx, &h8[m]);
+		relay_init(&h8[m].tox, &xcan, &h8[m].cpu, h8_xrx, &h8[m]);
+	}
+	relay_init(&conhost, &h8[0].lcan, &conhost_cpu, conhost_rx, NULL);
+
+	/* boot at random over a heartbeat, so they don't beat together */
+	for (i = 0; i < total; i++) {
+		n = &nodes[i];
+		snprintf(name, sizeof(name), "sim_node_%d", i);
+		n->ops = dlsym(RTLD_DEFAULT, name);
+		n->module = i / nnodes;
+		n->node = i % nnodes;
+		*n->ops->verbose = verbose;
+		*n->ops->bus = &h8[n->module].lcan;
+		n->ops->cancon_host->ext.cluster = 0;
+		n->ops->cancon_host->ext.module = 0;
+		n->ops->cancon_host->ext.node = CONHOST;
+		n->ops->cancon_host->ext.object = CANOBJ_CONSMIN + i;
+		sim_at(urand() * BOOTED, boot, n);
+	}
+}
+
+/* the reverse of boot order, for the 82C200s' signal handlers */
+static void
+world_fini(void)
+{
+	struct node *n;
+	int i;
+
+	for (i = nbooted - 1; i >= 0; i--) {
+		n = booted[i];
+		n->ops->close(n->f);
+		n->ops->fini();
+	}
+}
+
+/*
+ * Report
+ */
+/* over the time the load ran */
+static void
+bus_print(struct sim_bus *b, struct sim_bus_stats *s)
+{
+	printf("%-9s %8lu %5.1f%% %8.1f %8.1f\n", b->name, s->frames,
+	    100.0 * s->busy / stop,
+	    s->frames ? s->wait / 1000.0 / s->frames : 0.0,
+	    s->wait_max / 1000.0);
+}
+
+static unsigned long
+received(void)
+{
+	unsigned long rcvd = 0;
+	int i;
+
+	for (i = 0; i < total; i++)
+		rcvd += nodes[i].rcvd;
+	return rcvd;
+}
+
+static void
+lat_print(char *what, struct lat *l)
+{
+	if (l->n == 0)
+		return;
+	printf("%-9s %lu packets, latency %.0f/%llu us avg/max\n", what, l->n,
+	    (double)l->total / l->n, (unsigned long long)l->max);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sim_bus_stats lcan[MODULE_MAX], xstats;
+	struct can_stats st;
+	struct node *n;
+	unsigned long sent = 0, busy = 0, rcvd = 0, relay_drops = 0;
+	unsigned long chip_overruns = 0, inq_drops = 0, fd_overruns = 0;
+	unsigned long con_offered = 0, stray = 0, heartbeats = 0;
+	long leaked = 0, lost;
+	double secs = 5;
+	int c, i, verbose = 0, failed = 0;
+
+	while ((c = getopt(argc, argv, "vm:n:t:a:c:r:q:x:s:")) != EOF) {
+		switch (c) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'm':
+			nmodules = atoi(optarg);
+			break;
+		case 'n':
+			nnodes = atoi(optarg);
+			break;
+		case 't':
+			secs = atof(optarg);
+			break;
+		case 'a':
+			app_rate = atof(optarg);
+			break;
+		case 'c':
+			con_rate = atof(optarg);
+			break;
+		case 'r':
+			turnaround = atol(optarg) * 1000ULL;
+			break;
+		case 'q':
+			qmax = atoi(optarg);
+			break;
+		case 'x':
+			xcan.bitrate = atol(optarg);
+			break;
+		case 's':
+			seed = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nmodules < 1 || nmodules > MODULE_MAX || nnodes < 1
+	    || nnodes > NODE_MAX || secs <= 0 || qmax < 1
+	    || app_rate < 0 || con_rate < 0 || xcan.bitrate == 0)
+		usage();
+
+	world_init(verbose);
+	stop = secs * NSEC;
+	world_run(stop);
+	for (i = 0; i < nmodules; i++)
+		lcan[i] = h8[i].lcan.stats;
+	xstats = xcan.stats;
+
+	/* until what was queued when the load stopped has gone */
+	i = 0;
+	do {
+		rcvd = received();
+		world_run(sim_now + SETTLE);
+	} while (received() != rcvd && ++i < SETTLE_MAX);
+	rcvd = 0;
+
+	for (i = 0; i < total; i++) {
+		n = &nodes[i];
+		app_drain(n);
+		n->ops->ioctl(n->f, CAN_GET_STATS, &st);
+		sent += n->sent;
+		busy += n->busy;
+		rcvd += n->rcvd;
+		inq_drops += st.inq_drops;
+		fd_overruns += st.fd_overruns;
+		chip_overruns += n->ops->chip->rx_overruns;
+		con_offered += n->con_offered;
+	}
+	for (i = 0; i < nmodules; i++) {
+		relay_drops += h8[i].tol.dropped + h8[i].tox.dropped;
+		stray += h8[i].stray;
+		heartbeats += h8[i].heartbeats;
+	}
+
+	printf("bussim: %d modules x %d nodes, %.1f s, %g pkt/s and "
+	    "%g console char/s per node\n", nmodules, nnodes, secs, app_rate,
+	    con_rate);
+	printf("%-9s %8s %6s %8s %8s\n", "bus", "frames", "util",
+	    "wait us", "max us");
+	for (i = 0; i < nmodules; i++)
+		bus_print(&h8[i].lcan, &lcan[i]);
+	if (nmodules > 1)
+		bus_print(&xcan, &xstats);
+	for (i = 0; i < nmodules; i++)
+		printf("H8 %-6d relayed %lu to L-CAN, %lu to X-CAN, dropped "
+		    "%lu; got %lu, heartbeats %lu\n", i, h8[i].tol.sent,
+		    h8[i].tox.sent, h8[i].tol.dropped + h8[i].tox.dropped,
+		    h8[i].own, h8[i].heartbeats);
+	printf("%-9s %lu sent, %lu refused (EAGAIN), %lu received\n",
+	    "/dev/can", sent, busy, rcvd);
+	lat_print("local", &lat_local);
+	lat_print("remote", &lat_remote);
+	printf("%-9s chip overruns %lu, inq %lu, fd overruns %lu, relay %lu, "
+	    "stray ACKs %lu\n", "drops", chip_overruns, inq_drops,
+	    fd_overruns, relay_drops, stray);
+	printf("%-9s %lu chars printed, %lu got by the host, with resends\n",
+	    "console", con_offered, con_delivered);
+
+	/* every packet arrived or there is a count that could be it */
+	lost = sent - rcvd;
+	if (lost > (long)(chip_overruns + inq_drops + fd_overruns
+	    + relay_drops)) {
+		printf("bussim: %ld packets lost without a trace\n", lost);
+		failed = 1;
+	}
+	if (heartbeats == 0) {
+		printf("bussim: no heartbeats\n");
+		failed = 1;
+	}
+	world_fini();
+	for (i = 0; i < total; i++)
+		leaked += *nodes[i].ops->kmem_live;
+	if (leaked != 0) {
+		printf("bussim: %ld blocks not freed\n", leaked);
+		failed = 1;
+	}
+	printf("bussim: %s\n", failed ? "FAIL" : "PASS");
+	exit(failed ? 1 : 0);
+}
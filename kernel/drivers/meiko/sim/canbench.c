@@ -0,0 +1,436 @@
+/*
+ * $Id$
+ *
+ * Benchmark and regression test for the CAN driver, run in the
+ * simulation.  Each test prints a line of results; bus rates and
+ * latencies are in simulated time, register accesses and host time per
+ * packet measure the driver code.  Exits nonzero if a test fails.
+ *
+ * usage: canbench [-v] [-n packets]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "sim.h"
+
+#define MY_CLUSTER	1
+#define MY_MODULE	2
+#define MY_NODE		3
+#define MY_NODEID	((MY_CLUSTER << 12) | (MY_MODULE << 6) | MY_NODE)
+
+#define PEER		4		/* first responder node */
+#define NPEERS		8
+#define BENCH_OBJ	0x50		/* an object nobody else uses */
+#define TURNAROUND	100000ULL	/* responder's, nsec */
+#define DROP_EVERY	16		/* responder ignores every 16th */
+
+#define BATCH		64
+
+static int		failed;
+static uint64_t		host_start;
+
+/* frames from us on the bus */
+static unsigned long	tx_seen;
+static unsigned long	tx_seq;
+static int		tx_order_ok = 1;
+
+/* the responder */
+static int		responding;
+static unsigned long	requests[NPEERS];
+static unsigned long	dropped;
+
+static void
+fail(const char *test, const char *what)
+{
+	printf("%-9s FAIL: %s\n", test, what);
+	failed = 1;
+}
+
+static uint64_t
+host_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+measure_start(void)
+{
+	memset(&sim_chip, 0, sizeof(sim_chip));
+	memset(&sim_lcan.stats, 0, sizeof(sim_lcan.stats));
+	host_start = host_nsec();
+}
+
+/* register accesses and host usec per packet */
+static void
+measure_print(unsigned long n)
+{
+	uint64_t host = host_nsec() - host_start;
+
+	if (n == 0)
+		n = 1;
+	printf("; %.1f reg accesses/pkt, %.1f us host/pkt\n",
+	    (double)(sim_chip.reg_reads + sim_chip.reg_writes) / n,
+	    host / 1000.0 / n);
+}
+
+static void
+pkt_init(struct can_packet *pkt, int node, int type, uint32_t dat)
+{
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->can.can.lpriority = CAN_LOW_PRIORITY;
+	pkt->can.can.dest = node;
+	pkt->can.can.length = sizeof(can_header_ext) + sizeof(can_dat);
+	pkt->ext.ext.type = type;
+	pkt->ext.ext.cluster = MY_CLUSTER;
+	pkt->ext.ext.module = MY_MODULE;
+	pkt->ext.ext.node = node;
+	pkt->ext.ext.object = BENCH_OBJ;
+	pkt->dat.dat = dat;
+}
+
+static void
+inject_free(void *arg)
+{
+	sim_bus_inject(&sim_lcan, arg);
+	free(arg);
+}
+
+static void
+tap(struct can_packet *pkt, void *arg)
+{
+	struct can_packet *reply;
+
+	if (pkt->can.can.src != MY_NODE || pkt->ext.ext.object != BENCH_OBJ)
+		return;
+	if (pkt->ext.ext.type == CANTYPE_WNA) {
+		if (pkt->dat.dat != tx_seq++)
+			tx_order_ok = 0;
+		tx_seen++;
+		return;
+	}
+	if (!responding || pkt->can.can.dest < PEER
+	    || pkt->can.can.dest >= PEER + NPEERS)
+		return;
+	/* a node's next request is the retry, so that one gets through */
+	if (++requests[pkt->can.can.dest - PEER] % DROP_EVERY == 0) {
+		dropped++;
+		return;
+	}
+	if ((reply = malloc(sizeof(*reply))) == NULL)
+		return;
+	*reply = *pkt;
+	reply->can.can.dest = MY_NODE;
+	reply->can.can.src = pkt->can.can.dest;
+	reply->can.can.length = sizeof(can_header_ext) + sizeof(can_dat);
+	reply->ext.ext.type = CANTYPE_ACK;
+	reply->dat.dat = ~pkt->dat.dat;
+	sim_at(sim_now + TURNAROUND, inject_free, reply);
+}
+
+/*
+ * Write n packets to another node as fast as the driver takes them.
+ */
+static void
+test_tx(int n)
+{
+	struct can_packet pkt[BATCH];
+	struct file *f = sim_open(O_RDWR);
+	uint64_t start;
+	int i, sent = 0, count;
+	ssize_t len;
+
+	if (f == NULL) {
+		fail("tx", "open");
+		return;
+	}
+	tx_seen = tx_seq = 0;
+	measure_start();
+	start = sim_now;
+	while (sent < n) {
+		count = n - sent < BATCH ? n - sent : BATCH;
+		for (i = 0; i < count; i++)
+			pkt_init(&pkt[i], PEER + NPEERS, CANTYPE_WNA, sent + i);
+		len = sim_write(f, pkt, count * sizeof(pkt[0]));
+		if (len <= 0) {
+			fail("tx", "write");
+			break;
+		}
+		sent += len / sizeof(pkt[0]);
+	}
+	sim_idle();
+	printf("%-9s %d packets, %.3f s, %.0f pkt/s, bus %.1f%% busy",
+	    "tx", n, (sim_now - start) / 1e9, tx_seen * 1e9 / (sim_now - start),
+	    100.0 * sim_lcan.stats.busy / (sim_now - start));
+	measure_print(n);
+	if (tx_seen != n)
+		fail("tx", "packets missing from the bus");
+	if (!tx_order_ok)
+		fail("tx", "packets out of order");
+	sim_close(f);
+}
+
+/*
+ * Other nodes send n packets to us back to back; read them.
+ */
+static void
+test_rx(int n)
+{
+	struct can_packet pkt[BATCH];
+	struct file *f = sim_open(O_RDWR);
+	uint64_t start;
+	unsigned long overruns = 0;
+	int i, got = 0, order_ok = 1;
+	ssize_t len;
+
+	if (f == NULL) {
+		fail("rx", "open");
+		return;
+	}
+	measure_start();
+	start = sim_now;
+	for (i = 0; i < n; i++) {
+		pkt_init(&pkt[0], MY_NODE, CANTYPE_WNA, i);
+		pkt[0].can.can.src = PEER + i % NPEERS;
+		sim_bus_inject(&sim_lcan, &pkt[0]);
+	}
+	while (got < n) {
+		len = sim_read(f, pkt, sizeof(pkt));
+		if (len <= 0)
+			break;
+		for (i = 0; i < len / sizeof(pkt[0]); i++)
+			if (pkt[i].dat.dat != got++)
+				order_ok = 0;
+	}
+	sim_ioctl(f, CAN_GET_OVERRUNS, &overruns);
+	printf("%-9s %d packets, %d read, %lu lost, %.0f pkt/s", "rx", n, got,
+	    overruns + sim_chip.rx_overruns, got * 1e9 / (sim_now - start));
+	measure_print(n);
+	if (got != n)
+		fail("rx", "packets not read");
+	if (!order_ok)
+		fail("rx", "packets out of order");
+	sim_close(f);
+}
+
+/*
+ * n transactions with one of NPEERS responders, v at a time.
+ */
+static void
+test_transact(int n, int v)
+{
+	struct can_transact t[NPEERS];
+	struct can_transact_v tv = { t, v };
+	struct file *f = sim_open(O_RDWR);
+	unsigned long lat, min = ~0UL, max = 0, total = 0, retried = 0;
+	struct can_packet req, ack;
+	uint64_t start, expect;
+	int i, j, error, count = 0;
+	char *name = "transact";
+
+	if (f == NULL) {
+		fail(name, "open");
+		return;
+	}
+	pkt_init(&req, PEER, CANTYPE_RO, 0);
+	req.can.can.length = sizeof(can_header_ext);
+	pkt_init(&ack, MY_NODE, CANTYPE_ACK, 0);
+	expect = (sim_frame_nsec(&sim_lcan, &req) + TURNAROUND
+	    + sim_frame_nsec(&sim_lcan, &ack)) / 1000;
+	responding = 1;
+	memset(requests, 0, sizeof(requests));
+	dropped = 0;
+	measure_start();
+	start = sim_now;
+	for (i = 0; i < n; i += v) {
+		memset(t, 0, sizeof(t));
+		for (j = 0; j < v; j++) {
+			t[j].req = req.ext;
+			t[j].req.ext.node = PEER + j;
+			t[j].timeout = 20;
+			t[j].retries = 1;
+		}
+		error = v == 1 ? sim_ioctl(f, CAN_TRANSACT, t)
+		    : sim_ioctl(f, CAN_TRANSACT_V, &tv);
+		if (error < 0) {
+			fail(name, "ioctl");
+			break;
+		}
+		for (j = 0; j < v; j++) {
+			if (t[j].status != CAN_TRANSACT_ACK) {
+				fail(name, "no ACK");
+				continue;
+			}
+			if (t[j].ack.dat != ~0U)
+				fail(name, "wrong ACK");
+			if (t[j].tries > 1)
+				retried++;
+			lat = t[j].latency;
+			total += lat;
+			if (lat < min)
+				min = lat;
+			if (lat > max)
+				max = lat;
+			count++;
+		}
+	}
+	responding = 0;
+	sim_idle();
+	if (count == 0)
+		count = 1;
+	printf("%-9s %d x %d, %.0f/s, latency %lu/%lu/%lu us min/avg/max "
+	    "(bus alone %lu), %lu retried", name, n / v, v,
+	    count * 1e9 / (sim_now - start), min, total / count, max,
+	    (unsigned long)expect, retried);
+	measure_print(n);
+	if (min < expect)
+		fail(name, "faster than the bus");
+	if (retried != dropped)
+		fail(name, "dropped requests not retried");
+	sim_close(f);
+}
+
+/*
+ * Overflow the receive log and an mmapped ring, and check that what was
+ * lost is counted.  The log counts whole entries, so a lapped reader is
+ * also told about entries it didn't want (our heartbeats).
+ */
+static void
+test_overflow(void)
+{
+	struct can_packet pkt;
+	struct can_mmap_ring *ring;
+	struct file *f = sim_open(O_RDWR | O_NONBLOCK);
+	struct file *m = sim_open(O_RDWR | O_NONBLOCK);
+	unsigned long overruns = 0;
+	int i, n = RXLOG_SIZE + CAN_MMAP_SLOTS / 2, got = 0, last = -1;
+	int ringgot, order_ok = 1;
+
+	if (f == NULL || m == NULL
+	    || (ring = sim_mmap(m, CAN_MMAP_SIZE)) == NULL) {
+		fail("overflow", "open");
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		pkt_init(&pkt, MY_NODE, CANTYPE_WNA, i);
+		pkt.can.can.src = PEER;
+		sim_bus_inject(&sim_lcan, &pkt);
+	}
+	sim_idle();
+	while (sim_read(f, &pkt, sizeof(pkt)) == sizeof(pkt)) {
+		if (last != -1 && pkt.dat.dat != last + 1)
+			order_ok = 0;
+		last = pkt.dat.dat;
+		got++;
+	}
+	sim_ioctl(f, CAN_GET_OVERRUNS, &overruns);
+	ringgot = (ring->head - ring->tail + ring->size) % ring->size;
+	printf("%-9s %d packets: log %d read + %lu overrun, ring %d + %u "
+	    "overrun\n", "overflow", n, got, overruns, ringgot, 
+	    ring->overruns);
+	if (!order_ok || last != n - 1)
+		fail("overflow", "receive log out of order");
+	if (got + overruns < n)
+		fail("overflow", "receive log lost count");
+	if (ringgot + ring->overruns != n || ringgot != ring->size - 1)
+		fail("overflow", "ring lost count");
+	sim_close(m);
+	sim_close(f);
+}
+
+/*
+ * Hold off the interrupt for 5 frames: the chip keeps 2, and the driver
+ * should see the overrun.
+ */
+static void
+test_chip_overrun(void)
+{
+	struct can_packet pkt;
+	struct can_stats stats;
+	struct file *f = sim_open(O_RDWR | O_NONBLOCK);
+	unsigned long before;
+	int i, got;
+
+	if (f == NULL) {
+		fail("overrun", "open");
+		return;
+	}
+	memset(&sim_chip, 0, sizeof(sim_chip));
+	sim_ioctl(f, CAN_GET_STATS, &stats);
+	before = stats.chip_overruns;
+	disable_irq(CAN_IRQ);
+	for (i = 0; i < 5; i++) {
+		pkt_init(&pkt, MY_NODE, CANTYPE_WNA, i);
+		pkt.can.can.src = PEER;
+		sim_bus_inject(&sim_lcan, &pkt);
+	}
+	sim_idle();
+	enable_irq(CAN_IRQ);
+	sim_run(0);
+	for (got = 0; sim_read(f, &pkt, sizeof(pkt)) == sizeof(pkt); got++)
+		;
+	sim_ioctl(f, CAN_GET_STATS, &stats);
+	printf("%-9s 5 packets: %d read, chip lost %lu, driver saw %lu\n",
+	    "overrun", got, sim_chip.rx_overruns, stats.chip_overruns - before);
+	if (got != 2 || sim_chip.rx_overruns != 3
+	    || stats.chip_overruns - before != 1)
+		fail("overrun", "chip overrun");
+	sim_close(f);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, n = 2000;
+
+	while ((c = getopt(argc, argv, "vn:")) != EOF) {
+		switch (c) {
+		case 'v':
+			sim_verbose = 1;
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: canbench [-v] [-n packets]\n");
+			exit(2);
+		}
+	}
+	n -= n % (DROP_EVERY * NPEERS);
+	if (n <= 0)
+		n = DROP_EVERY * NPEERS;
+	if (sim_init(MY_NODEID) < 0) {
+		fprintf(stderr, "canbench: driver didn't initialize\n");
+		exit(1);
+	}
+	sim_bus_tap(&sim_lcan, tap, NULL);
+	printf("canbench: node %d,%d,%d on a %lu bit/s bus\n", MY_CLUSTER,
+	    MY_MODULE, MY_NODE, sim_lcan.bitrate);
+
+	test_tx(n);
+	test_rx(n);
+	test_transact(n / 8, 1);
+	test_transact(n / 8, NPEERS);
+	test_overflow();
+	test_chip_overrun();
+
+	if (sim_verbose) {
+		static char buf[8192];
+
+		if (sim_proc_read("can/stats", buf, sizeof(buf)) > 0)
+			fputs(buf, stdout);
+	}
+	sim_fini();
+	if (sim_kmem_live != 0) {
+		printf("canbench: %ld blocks not freed\n", sim_kmem_live);
+		failed = 1;
+	}
+	printf("canbench: %s\n", failed ? "FAIL" : "PASS");
+	exit(failed ? 1 : 0);
+}
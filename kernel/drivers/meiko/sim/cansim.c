@@ -0,0 +1,518 @@
+/*
+ * $Id$
+ *
+ * libcansim.so: preloaded into a CAN tool, it makes /dev/can and
+ * /dev/elan cansimd's (cansimd.c), over the Unix socket $CANSIM_SOCKET
+ * or /tmp/cansim.  The tool is unchanged:
+ *
+ *	CANSIM_NODE=4 LD_PRELOAD=./libcansim.so canping node0
+ *
+ * open(2) of /dev/can connects to cansimd and opens the driver on the
+ * node $CANSIM_NODE names (hex L-CAN address), or its first, and the
+ * socket is the file descriptor.  read(2), write(2), ioctl(2), poll(2)
+ * and mmap(2) of it are done by the driver there.  A thread that didn't
+ * open it gets a connection of its own the first time it uses it, so
+ * that one asleep in the driver doesn't hold the others up.
+ *
+ * open(2) of /dev/elan gets cansimd's page of elan registers, as a
+ * memfd, which the tool maps itself.  The clock in it ticks.
+ *
+ * Not done: select(2), fcntl(2) changing O_NONBLOCK, dup(2), and a
+ * child using its parent's /dev/can.  poll(2) of /dev/can with other
+ * descriptors looks at them in turn, every POLL_SLICE msec.  A signal
+ * doesn't interrupt a call to the driver.
+ */
+
+#define _GNU_SOURCE		/* RTLD_NEXT, MSG_CMSG_CLOEXEC */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <alloca.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <asm/meiko/can.h>
+
+#include "cansim.h"
+
+#define PATH_CAN	"/dev/can"
+#define PATH_ELAN	"/dev/elan"
+
+#define FD_MAX		1024
+#define POLL_SLICE	1		/* msec */
+
+/* the real thing, looked up the first time */
+#define REAL(f)		((__typeof__(real_##f))real((void **)&real_##f, #f))
+
+static int	(*real_open)(const char *path, int flags, ...);
+static int	(*real_open64)(const char *path, int flags, ...);
+static int	(*real_openat)(int dirfd, const char *path, int flags, ...);
+static int	(*real_close)(int fd);
+static ssize_t	(*real_read)(int fd, void *buf, size_t count);
+static ssize_t	(*real_write)(int fd, const void *buf, size_t count);
+static int	(*real_ioctl)(int fd, unsigned long cmd, ...);
+static int	(*real_poll)(struct pollfd *pfd, nfds_t n, int timeout);
+static void	*(*real_mmap)(void *addr, size_t len, int prot, int flags,
+		    int fd, off_t off);
+
+/*
+ * Our descriptors, by number: cansimd's id for the file, and a
+ * generation, 0 if it isn't ours, so a thread can tell whether its
+ * connection is to the file that has the number now.
+ */
+static struct {
+	int		id;
+	unsigned	gen;
+} fds[FD_MAX];
+static unsigned		gen;
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int	tsock[FD_MAX];
+static __thread unsigned tgen[FD_MAX];
+
+static void *
+real(void **fp, const char *name)
+{
+	if (*fp == NULL)
+		*fp = dlsym(RTLD_NEXT, name);
+	return *fp;
+}
+
+static int
+is_ours(int fd)
+{
+	return fd >= 0 && fd < FD_MAX && fds[fd].gen != 0;
+}
+
+static int
+sim_connect(int flags)
+{
+	struct sockaddr_un sun;
+	char *path = getenv("CANSIM_SOCKET");
+	int s, e;
+
+	if (path == NULL)
+		path = CANSIM_SOCKET;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if ((s = socket(AF_UNIX, SOCK_STREAM | flags, 0)) < 0)
+		return -1;
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		e = errno;
+		REAL(close)(s);
+		errno = e;
+		return -1;
+	}
+	return s;
+}
+
+static int
+sim_recv(int s, void *buf, size_t len, struct msghdr *msg)
+{
+	struct msghdr m;
+	struct iovec iov;
+	ssize_t n;
+
+	if (msg == NULL) {
+		memset(&m, 0, sizeof(m));
+		msg = &m;
+	}
+	while (len > 0) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		msg->msg_iov = &iov;
+		msg->msg_iovlen = 1;
+		n = recvmsg(s, msg, MSG_CMSG_CLOEXEC);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (char *)buf + n;
+		len -= n;
+		msg = &m;		/* ancillary data come with the first */
+		memset(&m, 0, sizeof(m));
+	}
+	return 0;
+}
+
+/*
+ * Ask cansimd on s to do q, with inlen bytes of in, and take up to outlen
+ * bytes into out, and the memfd and where in it if there is one.  Return
+ * what the call returned, or -1 with errno set.
+ */
+static int64_t
+sim_call(int s, struct cansim_req *q, const void *in, size_t inlen,
+    void *out, size_t outlen, int *fdp, off_t *offp)
+{
+	struct cansim_rep r;
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int fd = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov[0].iov_base = q;
+	iov[0].iov_len = sizeof(*q);
+	iov[1].iov_base = (void *)in;
+	iov[1].iov_len = inlen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (sendmsg(s, &msg, MSG_NOSIGNAL) != sizeof(*q) + inlen)
+		goto lost;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (sim_recv(s, &r, sizeof(r), &msg) < 0)
+		goto lost;
+	for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+	    cm = CMSG_NXTHDR(&msg, cm))
+		if (cm->cmsg_level == SOL_SOCKET
+		    && cm->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+	if (r.len > outlen || sim_recv(s, out, r.len, NULL) < 0) {
+		if (fd >= 0)
+			REAL(close)(fd);
+		goto lost;
+	}
+	if (fdp != NULL)
+		*fdp = fd;
+	else if (fd >= 0)
+		REAL(close)(fd);
+	if (offp != NULL)
+		*offp = r.off;
+	if (r.ret < 0) {
+		errno = -r.ret;
+		return -1;
+	}
+	return r.ret;
+lost:
+	errno = EIO;
+	return -1;
+}
+
+/* this thread's connection to fd's file, made if need be */
+static int
+sim_sock(int fd)
+{
+	struct cansim_req q = { CANSIM_ATTACH };
+	unsigned g;
+	int s;
+
+	pthread_mutex_lock(&lock);
+	q.len = fds[fd].id;
+	g = fds[fd].gen;
+	pthread_mutex_unlock(&lock);
+	if (tgen[fd] == g)
+		return tsock[fd];
+
+	/* ours was to a file closed since; the number, if ours, went too */
+	if (tgen[fd] != 0 && tsock[fd] != fd)
+		REAL(close)(tsock[fd]);
+	tgen[fd] = 0;
+	if ((s = sim_connect(SOCK_CLOEXEC)) < 0)
+		return -1;
+	if (sim_call(s, &q, NULL, 0, NULL, 0, NULL, NULL) < 0) {
+		REAL(close)(s);
+		errno = EBADF;
+		return -1;
+	}
+	tsock[fd] = s;
+	tgen[fd] = g;
+	return s;
+}
+
+static int
+can_open(int flags)
+{
+	struct cansim_req q = { CANSIM_OPEN };
+	char *node = getenv("CANSIM_NODE");
+	int s, id;
+
+	if ((s = sim_connect(flags & O_CLOEXEC ? SOCK_CLOEXEC : 0)) < 0)
+		return -1;
+	q.arg = flags & ~O_CLOEXEC;
+	q.len = node != NULL ? strtol(node, NULL, 16) : -1;
+	if ((id = sim_call(s, &q, NULL, 0, NULL, 0, NULL, NULL)) < 0
+	    || s >= FD_MAX) {
+		REAL(close)(s);
+		if (id >= 0)
+			errno = EMFILE;
+		return -1;
+	}
+	pthread_mutex_lock(&lock);
+	fds[s].id = id;
+	fds[s].gen = ++gen;
+	tsock[s] = s;
+	tgen[s] = gen;
+	pthread_mutex_unlock(&lock);
+	return s;
+}
+
+static int
+elan_open(int flags)
+{
+	struct cansim_req q = { CANSIM_ELAN };
+	int s, fd = -1;
+
+	if ((s = sim_connect(SOCK_CLOEXEC)) < 0)
+		return -1;
+	if (sim_call(s, &q, NULL, 0, NULL, 0, &fd, NULL) == 0 && fd < 0)
+		errno = EIO;
+	REAL(close)(s);
+	if (fd >= 0 && !(flags & O_CLOEXEC))
+		fcntl(fd, F_SETFD, 0);
+	return fd;
+}
+
+/*
+ * The calls
+ */
+static int
+dev_open(const char *path, int flags)
+{
+	if (strcmp(path, PATH_CAN) == 0)
+		return can_open(flags);
+	if (strcmp(path, PATH_ELAN) == 0)
+		return elan_open(flags);
+	return -2;
+}
+
+#define OPEN_MODE(flags, mode) do {				\
+	va_list ap;						\
+								\
+	if ((flags) & (O_CREAT | O_TMPFILE)) {			\
+		va_start(ap, flags);				\
+		mode = va_arg(ap, int);				\
+		va_end(ap);					\
+	}							\
+} while (0)
+
+int
+open(const char *path, int flags, ...)
+{
+	int fd, mode = 0;
+
+	OPEN_MODE(flags, mode);
+	if ((fd = dev_open(path, flags)) != -2)
+		return fd;
+	return REAL(open)(path, flags, mode);
+}
+
+int
+open64(const char *path, int flags, ...)
+{
+	int fd, mode = 0;
+
+	OPEN_MODE(flags, mode);
+	if ((fd = dev_open(path, flags)) != -2)
+		return fd;
+	return REAL(open64)(path, flags, mode);
+}
+
+int
+openat(int dirfd, const char *path, int flags, ...)
+{
+	int fd, mode = 0;
+
+	OPEN_MODE(flags, mode);
+	if ((fd = dev_open(path, flags)) != -2)
+		return fd;
+	return REAL(openat)(dirfd, path, flags, mode);
+}
+
+int
+close(int fd)
+{
+	if (is_ours(fd)) {
+		pthread_mutex_lock(&lock);
+		fds[fd].gen = 0;
+		pthread_mutex_unlock(&lock);
+		if (tgen[fd] != 0 && tsock[fd] != fd)
+			REAL(close)(tsock[fd]);
+		tgen[fd] = 0;
+	}
+	return REAL(close)(fd);
+}
+
+ssize_t
+read(int fd, void *buf, size_t count)
+{
+	struct cansim_req q = { CANSIM_READ };
+	int s;
+
+	if (!is_ours(fd))
+		return REAL(read)(fd, buf, count);
+	if ((s = sim_sock(fd)) < 0)
+		return -1;
+	q.len = count;
+	return sim_call(s, &q, NULL, 0, buf, count, NULL, NULL);
+}
+
+ssize_t
+write(int fd, const void *buf, size_t count)
+{
+	struct cansim_req q = { CANSIM_WRITE };
+	int s;
+
+	if (!is_ours(fd))
+		return REAL(write)(fd, buf, count);
+	if ((s = sim_sock(fd)) < 0)
+		return -1;
+	q.len = count;
+	return sim_call(s, &q, buf, count, NULL, 0, NULL, NULL);
+}
+
+int
+ioctl(int fd, unsigned long cmd, ...)
+{
+	struct cansim_req q = { CANSIM_IOCTL };
+	struct can_transact_v *tv;
+	va_list ap;
+	void *arg;
+	size_t len;
+	int s;
+
+	va_start(ap, cmd);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+	if (!is_ours(fd))
+		return REAL(ioctl)(fd, cmd, arg);
+	if ((s = sim_sock(fd)) < 0)
+		return -1;
+	if (cmd == CAN_TRANSACT_V) {
+		tv = arg;
+		if (tv->n <= 0 || tv->n > CAN_TRANSACT_MAX) {
+			errno = EINVAL;
+			return -1;
+		}
+		len = tv->n * sizeof(struct can_transact);
+		arg = tv->v;
+	} else
+		len = _IOC_SIZE(cmd);
+	q.arg = cmd;
+	q.len = len;
+	return sim_call(s, &q, arg, CANSIM_IOC_IN(cmd) ? len : 0,
+	    arg, CANSIM_IOC_OUT(cmd) ? len : 0, NULL, NULL);
+}
+
+/* what fd is ready for, waiting up to timeout msec */
+static short
+can_poll(int fd, int events, int timeout)
+{
+	struct cansim_req q = { CANSIM_POLL };
+	int64_t mask;
+	int s;
+
+	if ((s = sim_sock(fd)) < 0)
+		return POLLNVAL;
+	q.arg = events;
+	q.len = timeout < 0 ? -1 : timeout * 1000000LL;
+	if ((mask = sim_call(s, &q, NULL, 0, NULL, 0, NULL, NULL)) < 0)
+		return POLLERR;
+	return mask;
+}
+
+/*
+ * Not in poll() itself: glibc says poll(2) only writes pfd, and gcc
+ * believes it.
+ */
+static int
+can_pollv(struct pollfd *pfd, nfds_t n, int timeout)
+{
+	int *fd, *rev;
+	int ours = 0, ready, slice, got, i;
+
+	for (i = 0; i < n; i++)
+		if (is_ours(pfd[i].fd))
+			ours++;
+	if (ours == 0)
+		return REAL(poll)(pfd, n, timeout);
+	if (n == 1) {
+		pfd[0].revents = can_poll(pfd[0].fd, pfd[0].events, timeout);
+		return pfd[0].revents != 0;
+	}
+
+	/* ours, then the rest without them, a slice at a time */
+	fd = alloca(n * sizeof(*fd));
+	rev = alloca(n * sizeof(*rev));
+	for (;;) {
+		ready = 0;
+		for (i = 0; i < n; i++) {
+			fd[i] = pfd[i].fd;
+			rev[i] = -1;
+			if (!is_ours(fd[i]))
+				continue;
+			rev[i] = can_poll(fd[i], pfd[i].events, 0);
+			if (rev[i] != 0)
+				ready++;
+			pfd[i].fd = -1;
+		}
+		if (ready > 0 || timeout == 0)
+			slice = 0;
+		else if (timeout > 0 && timeout < POLL_SLICE)
+			slice = timeout;
+		else
+			slice = POLL_SLICE;
+		got = REAL(poll)(pfd, n, slice);
+		for (i = 0; i < n; i++) {
+			if (rev[i] != -1) {
+				pfd[i].fd = fd[i];
+				pfd[i].revents = rev[i];
+			}
+		}
+		if (got < 0)
+			return -1;
+		ready += got;
+		if (ready > 0 || timeout == 0)
+			return ready;
+		if (timeout > 0)
+			timeout -= slice;
+	}
+}
+
+int
+poll(struct pollfd *pfd, nfds_t n, int timeout)
+{
+	return can_pollv(pfd, n, timeout);
+}
+
+void *
+mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+	struct cansim_req q = { CANSIM_MMAP };
+	void *p;
+	off_t moff;
+	int s, mfd;
+
+	if (!is_ours(fd))
+		return REAL(mmap)(addr, len, prot, flags, fd, off);
+	if ((s = sim_sock(fd)) < 0)
+		return MAP_FAILED;
+	q.len = len;
+	q.off = off;
+	if (sim_call(s, &q, NULL, 0, NULL, 0, &mfd, &moff) < 0)
+		return MAP_FAILED;
+	if (mfd < 0) {
+		errno = EIO;
+		return MAP_FAILED;
+	}
+	p = REAL(mmap)(addr, len, prot, flags, mfd, moff);
+	REAL(close)(mfd);
+	return p;
+}
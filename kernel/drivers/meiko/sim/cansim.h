@@ -0,0 +1,53 @@
+/*
+ * $Id$
+ *
+ * What libcansim.so (cansim.c), preloaded into a CAN tool, and cansimd
+ * (cansimd.c) say to each other over the server's Unix socket.
+ *
+ * A connection is one open /dev/can, or another thread's way to one
+ * (CANSIM_ATTACH).  Requests on it go one at a time: a struct cansim_req
+ * and the data the call copies in, answered by a struct cansim_rep and
+ * the data it copies out.  A memfd to map comes back with the reply, as
+ * SCM_RIGHTS.  Both ends are built for the same host, so structs go as
+ * they are.
+ */
+
+#ifndef _CANSIM_H
+#define _CANSIM_H
+
+#define CANSIM_SOCKET	"/tmp/cansim"	/* unless $CANSIM_SOCKET */
+
+#define CANSIM_OPEN	1	/* arg flags, len node or -1: a new file */
+#define CANSIM_ATTACH	2	/* len the file's id */
+#define CANSIM_ELAN	3	/* the elan clock page, as a memfd */
+#define CANSIM_READ	4	/* len */
+#define CANSIM_WRITE	5	/* len, and the data */
+#define CANSIM_IOCTL	6	/* arg cmd, len, and what _IOC_DIR says */
+#define CANSIM_POLL	7	/* arg events, len nsec or -1 */
+#define CANSIM_MMAP	8	/* len, off: a memfd and where in it */
+
+struct cansim_req {
+	uint32_t	op;
+	uint32_t	arg;
+	int64_t		len;
+	int64_t		off;
+};
+
+struct cansim_rep {
+	int64_t		ret;		/* as the call returns, or -errno */
+	int64_t		off;		/* CANSIM_MMAP: where in the memfd */
+	uint32_t	len;		/* data after this */
+	uint32_t	_pad;
+};
+
+/*
+ * The data of CANSIM_IOCTL are len bytes, _IOC_SIZE() or none, going in
+ * and out as _IOC_DIR() says.  CAN_TRANSACT_V's argument holds a pointer,
+ * so its data are the vector itself, both ways.
+ */
+#define CANSIM_IOC_IN(cmd)	((_IOC_DIR(cmd) & _IOC_WRITE) \
+				|| (cmd) == CAN_TRANSACT_V)
+#define CANSIM_IOC_OUT(cmd)	((_IOC_DIR(cmd) & _IOC_READ) \
+				|| (cmd) == CAN_TRANSACT_V)
+
+#endif /* _CANSIM_H */
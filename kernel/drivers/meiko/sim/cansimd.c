@@ -0,0 +1,779 @@
+/*
+ * $Id$
+ *
+ * A simulated L-CAN that real processes can use.  The nodes on it are
+ * copies of the CAN driver, as in bussim, and processes open /dev/can on
+ * one of them through libcansim.so (cansim.c), which they preload, and
+ * the Unix socket we listen on.  So the tools in cmd/ can be run, timed
+ * and profiled, unchanged, on a box with no CS/2 in it.
+ *
+ * The world runs in real time: sim_now is nsec since we started, and we
+ * run it up to the monotonic clock whenever we wake.  Each connection
+ * gets its own process (struct task_struct) and stack, and the driver
+ * is called on that stack.  When it puts the process to sleep, it comes
+ * back here through the sleep hook, and the process is resumed to see if
+ * it has been woken each time the world has run.  A process whose
+ * connection goes away gets a signal.
+ *
+ * /dev/elan is a page with the elan registers in it, as a memfd, that a
+ * thread of ours keeps the clock in up to date every TICK nsec or so, on
+ * the same time line as the world.
+ *
+ * Nodes are on module 0 of cluster 0, at the L-CAN addresses (hex) given,
+ * or the sparc boards' of canhosts.template.  A process gets the node
+ * $CANSIM_NODE names, or the first.
+ *
+ * usage: cansimd [-v] [-s socket] [addr ...]
+ */
+
+#define _GNU_SOURCE		/* RTLD_DEFAULT, memfd_create(), ppoll() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+#include "sim.h"
+#include "cansim.h"
+#include <asm/meiko/elan.h>
+
+#define NODE_MAX	16
+#define STACK		(256 * 1024)	/* per connection */
+#define DATA_MAX	(1024 * 1024)	/* per request */
+#define TICK		10000		/* nsec, elan clock */
+
+#define NSEC		1000000000ULL
+
+#define IDLE		0		/* connection states */
+#define RUNNING		1
+#define SLEEPING	2
+#define DONE		3
+
+struct sim_event {
+	uint64_t		when;
+	void			(*fn)(void *arg);
+	void			*arg;
+	struct sim_event	*next;
+};
+
+struct node {
+	const struct sim_node *ops;
+	int		addr;
+	struct task_struct *idle;	/* current when no one is in */
+};
+
+/* an open /dev/can */
+struct cfile {
+	struct node	*node;
+	struct file	*f;		/* NULL once closed */
+	int		id;
+	int		gone;		/* the opener went */
+	int		conns;		/* connections to it */
+	int		busy;		/*   in the driver */
+	struct cfile	*next;
+};
+
+struct conn {
+	int		sock;
+	struct cfile	*cf;
+	int		opener;
+	int		hungup;
+	int		state;
+	struct task_struct task;
+	ucontext_t	ctx;
+	char		*stack;
+	uint64_t	until;		/* SLEEPING */
+	struct cansim_req req;
+	struct cansim_rep rep;
+	char		*data;		/* in, then out */
+	int		fd;		/* memfd to send, or -1 */
+	struct conn	*next;
+};
+
+uint64_t		sim_now;
+static struct sim_event	*events;
+static struct timespec	t0;
+
+static struct node	nodes[NODE_MAX];
+static int		nnodes;
+static struct cfile	*cfiles;
+static int		nextid;
+static struct conn	*conns;
+static struct conn	*running;	/* in the driver */
+static ucontext_t	mainctx;
+
+static int		elanfd;
+static elanreg_t	*elanpage;
+static char		*sockpath;
+static volatile int	quit;
+
+/*
+ * The world, as in bussim.c
+ */
+void
+sim_at(uint64_t when, void (*fn)(void *), void *arg)
+{
+	struct sim_event *e, **pp;
+
+	if ((e = malloc(sizeof(*e))) == NULL) {
+		fprintf(stderr, "cansimd: out of memory\n");
+		exit(1);
+	}
+	e->when = when < sim_now ? sim_now : when;
+	e->fn = fn;
+	e->arg = arg;
+	for (pp = &events; *pp != NULL && (*pp)->when <= e->when;
+	    pp = &(*pp)->next)
+		;
+	e->next = *pp;
+	*pp = e;
+}
+
+static void
+nodes_run(void)
+{
+	int i;
+
+	for (i = 0; i < nnodes; i++)
+		nodes[i].ops->run(sim_now);
+}
+
+/* when something next happens */
+static uint64_t
+world_next(void)
+{
+	uint64_t t, next;
+	int i;
+
+	t = events != NULL ? events->when : UINT64_MAX;
+	for (i = 0; i < nnodes; i++)
+		if ((next = nodes[i].ops->next()) < t)
+			t = next;
+	return t;
+}
+
+static void
+world_run(uint64_t until)
+{
+	struct sim_event *e;
+	uint64_t t;
+
+	while ((t = world_next()) <= until) {
+		if (t > sim_now)
+			sim_now = t;
+		nodes_run();
+		while ((e = events) != NULL && e->when <= sim_now) {
+			events = e->next;
+			e->fn(e->arg);
+			free(e);
+			nodes_run();
+		}
+	}
+	if (until > sim_now)
+		sim_now = until;
+	nodes_run();
+}
+
+/* nsec since we started */
+static uint64_t
+wall(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - t0.tv_sec) * NSEC + ts.tv_nsec - t0.tv_nsec;
+}
+
+/*
+ * The elan clock, as sim.c keeps it for the driver
+ */
+static void *
+ticker(void *arg)
+{
+	struct timespec tick = { 0, TICK };
+	elanclock_t ts;
+	uint64_t t, clock;
+
+	for (;;) {
+		t = wall();
+		ts.tv_sec = t / NSEC;
+		ts.tv_nsec = t % NSEC;
+		memcpy(&clock, &ts, sizeof(clock));
+		elanpage->clock = clock;
+		elanpage->clockHi = ts.tv_sec;
+		elanpage->clockLo = ts.tv_nsec;
+		nanosleep(&tick, NULL);
+	}
+	return NULL;
+}
+
+static void
+clock_init(void)
+{
+	sigset_t all, old;
+	pthread_t t;
+
+	if ((elanfd = memfd_create("elan", MFD_CLOEXEC)) < 0
+	    || ftruncate(elanfd, PAGE_SIZE) < 0
+	    || (elanpage = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, elanfd, 0)) == MAP_FAILED) {
+		perror("cansimd: elan page");
+		exit(1);
+	}
+
+	/* signals are for the main loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (pthread_create(&t, NULL, ticker, NULL) != 0) {
+		fprintf(stderr, "cansimd: can't start the elan clock\n");
+		exit(1);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Processes
+ */
+
+/* the sleep hook: back to the main loop until woken, until, or a signal */
+static int
+proc_sleep(uint64_t until, int (*woken)(void))
+{
+	struct conn *c = running;
+
+	for (;;) {
+		if (woken())
+			return 1;
+		if (c->hungup || *c->cf->node->ops->now >= until)
+			return 0;
+		c->until = until;
+		c->state = SLEEPING;
+		swapcontext(&c->ctx, &mainctx);
+		c->state = RUNNING;
+	}
+}
+
+static struct node *
+node_find(int addr)
+{
+	int i;
+
+	if (addr == -1)
+		return &nodes[0];
+	for (i = 0; i < nnodes; i++)
+		if (nodes[i].addr == addr)
+			return &nodes[i];
+	return NULL;
+}
+
+static struct cfile *
+cfile_find(int id)
+{
+	struct cfile *cf;
+
+	for (cf = cfiles; cf != NULL; cf = cf->next)
+		if (cf->id == id && !cf->gone)
+			return cf;
+	return NULL;
+}
+
+/* close the file once its opener has gone and no one is in the driver */
+static void
+cfile_check(struct cfile *cf)
+{
+	struct cfile **pp;
+
+	if (cf->gone && cf->busy == 0 && cf->f != NULL) {
+		cf->node->ops->close(cf->f);
+		cf->f = NULL;
+	}
+	if (cf->conns > 0)
+		return;
+	for (pp = &cfiles; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == cf) {
+			*pp = cf->next;
+			break;
+		}
+	}
+	free(cf);
+}
+
+/* what the request asks of the driver, on the connection's stack */
+static void
+proc_call(void)
+{
+	struct conn *c = running;
+	struct cansim_req *q = &c->req;
+	struct cansim_rep *r = &c->rep;
+	const struct sim_node *ops = c->cf->node->ops;
+	struct file *f = c->cf->f;
+	struct can_transact_v tv;
+	void *addr;
+	off_t off;
+
+	switch (q->op) {
+	case CANSIM_READ:
+		if ((r->ret = ops->read(f, c->data, q->len)) > 0)
+			r->len = r->ret;
+		break;
+	case CANSIM_WRITE:
+		r->ret = ops->write(f, c->data, q->len);
+		break;
+	case CANSIM_IOCTL:
+		if (q->arg == CAN_TRANSACT_V) {
+			tv.v = (struct can_transact *)c->data;
+			tv.n = q->len / sizeof(struct can_transact);
+			r->ret = ops->ioctl(f, q->arg, &tv);
+		} else
+			r->ret = ops->ioctl(f, q->arg, c->data);
+		if (r->ret >= 0 && CANSIM_IOC_OUT(q->arg))
+			r->len = q->len;
+		break;
+	case CANSIM_POLL:
+		r->ret = ops->poll(f, q->arg, q->len < 0 ? UINT64_MAX : q->len);
+		break;
+	case CANSIM_MMAP:
+		if (q->off != 0) {
+			r->ret = -EINVAL;
+			break;
+		}
+		if ((addr = ops->mmap(f, q->len)) == NULL)
+			r->ret = -errno;
+		else if ((c->fd = ops->page_fd(addr, &off)) < 0)
+			r->ret = -ENOMEM;
+		else
+			r->off = off;
+		break;
+	default:
+		r->ret = -EINVAL;
+	}
+	c->state = DONE;
+}
+
+/*
+ * Connections
+ */
+static int
+conn_send(struct conn *c)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cm;
+
+	memset(&msg, 0, sizeof(msg));
+	iov[0].iov_base = &c->rep;
+	iov[0].iov_len = sizeof(c->rep);
+	iov[1].iov_base = c->data;
+	iov[1].iov_len = c->rep.len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (c->fd >= 0) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &c->fd, sizeof(int));
+	}
+	return sendmsg(c->sock, &msg, MSG_NOSIGNAL)
+	    == sizeof(c->rep) + c->rep.len ? 0 : -1;
+}
+
+static void
+conn_free(struct conn *c)
+{
+	struct conn **pp, *a;
+	struct cfile *cf = c->cf;
+	int opener = c->opener;
+
+	for (pp = &conns; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == c) {
+			*pp = c->next;
+			break;
+		}
+	}
+	close(c->sock);
+	free(c->stack);
+	free(c->data);
+	free(c);
+	if (cf == NULL)
+		return;
+	cf->conns--;
+
+	/* the file goes with its opener: interrupt the other threads */
+	if (opener) {
+		cf->gone = 1;
+		for (a = conns; a != NULL; a = a->next)
+			if (a->cf == cf)
+				a->hungup = 1;
+	}
+	cfile_check(cf);
+}
+
+/* the call is done or asleep; if done, answer */
+static void
+conn_after(struct conn *c)
+{
+	if (c->state != DONE)
+		return;
+	c->state = IDLE;
+	c->cf->busy--;
+	if (c->rep.ret < 0 && c->rep.ret != -EAGAIN && c->rep.ret != -EINTR
+	    && c->req.op != CANSIM_POLL && *c->cf->node->ops->verbose)
+		fprintf(stderr, "cansimd: op %u: %s\n", c->req.op,
+		    strerror(-c->rep.ret));
+	if (c->hungup || conn_send(c) < 0)
+		conn_free(c);
+	else
+		cfile_check(c->cf);
+}
+
+static void
+conn_resume(struct conn *c)
+{
+	struct node *n = c->cf->node;
+
+	running = c;
+	*n->ops->current = &c->task;
+	swapcontext(&mainctx, &c->ctx);
+	*n->ops->current = n->idle;
+	running = NULL;
+	conn_after(c);
+}
+
+/* run the call on the connection's own stack */
+static void
+conn_call(struct conn *c)
+{
+	if (c->stack == NULL && (c->stack = malloc(STACK)) == NULL) {
+		c->rep.ret = -ENOMEM;
+		c->state = DONE;
+		conn_after(c);
+		return;
+	}
+	getcontext(&c->ctx);
+	c->ctx.uc_stack.ss_sp = c->stack;
+	c->ctx.uc_stack.ss_size = STACK;
+	c->ctx.uc_link = &mainctx;
+	makecontext(&c->ctx, proc_call, 0);
+	c->state = RUNNING;
+	c->cf->busy++;
+	world_run(wall());
+	conn_resume(c);
+}
+
+static int
+conn_open(struct conn *c, struct cansim_req *q)
+{
+	struct node *n;
+	struct cfile *cf;
+	struct file *f;
+
+	if ((n = node_find(q->len)) == NULL)
+		return -ENXIO;
+	world_run(wall());
+	if ((f = n->ops->open(q->arg)) == NULL)
+		return -errno;
+	if ((cf = calloc(1, sizeof(*cf))) == NULL) {
+		n->ops->close(f);
+		return -ENOMEM;
+	}
+	cf->node = n;
+	cf->f = f;
+	cf->id = nextid++;
+	cf->conns = 1;
+	cf->next = cfiles;
+	cfiles = cf;
+	c->cf = cf;
+	c->opener = 1;
+	return cf->id;
+}
+
+/* a request has come: answer it, or start the call */
+static void
+conn_request(struct conn *c)
+{
+	struct cansim_req *q = &c->req;
+	int64_t len;
+
+	if ((len = recv(c->sock, q, sizeof(*q), MSG_WAITALL)) != sizeof(*q)) {
+		conn_free(c);
+		return;
+	}
+	memset(&c->rep, 0, sizeof(c->rep));
+	c->fd = -1;
+	free(c->data);
+	c->data = NULL;
+
+	if (q->op == CANSIM_OPEN || q->op == CANSIM_ATTACH
+	    || q->op == CANSIM_ELAN) {
+		if (c->cf != NULL)
+			c->rep.ret = -EINVAL;
+		else if (q->op == CANSIM_OPEN)
+			c->rep.ret = conn_open(c, q);
+		else if (q->op == CANSIM_ELAN)
+			c->fd = elanfd;
+		else if ((c->cf = cfile_find(q->len)) == NULL)
+			c->rep.ret = -EBADF;
+		else
+			c->cf->conns++;
+		if (conn_send(c) < 0)
+			conn_free(c);
+		return;
+	}
+
+	/* the data, if any, then whether we can do it */
+	len = 0;
+	if (q->op == CANSIM_READ && q->len > DATA_MAX)
+		q->len = DATA_MAX;
+	if (q->op == CANSIM_READ || q->op == CANSIM_WRITE
+	    || q->op == CANSIM_IOCTL)
+		len = q->len;
+	if (len < 0 || len > DATA_MAX
+	    || (c->data = calloc(1, len + 1)) == NULL) {
+		conn_free(c);
+		return;
+	}
+	if ((q->op == CANSIM_WRITE
+	    || (q->op == CANSIM_IOCTL && CANSIM_IOC_IN(q->arg)))
+	    && recv(c->sock, c->data, len, MSG_WAITALL) != len) {
+		conn_free(c);
+		return;
+	}
+	if (q->op == CANSIM_IOCTL && q->arg != CAN_TRANSACT_V
+	    && len != _IOC_SIZE(q->arg))
+		c->rep.ret = -EINVAL;
+	else if (c->cf == NULL || c->cf->f == NULL)
+		c->rep.ret = -EBADF;
+	if (c->rep.ret < 0) {
+		if (conn_send(c) < 0)
+			conn_free(c);
+		return;
+	}
+	conn_call(c);
+}
+
+static void
+conn_accept(int lsock)
+{
+	struct conn *c;
+	int s;
+
+	if ((s = accept4(lsock, NULL, NULL, SOCK_CLOEXEC)) < 0)
+		return;
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		close(s);
+		return;
+	}
+	c->sock = s;
+	c->fd = -1;
+	c->task.pid = s;
+	c->next = conns;
+	conns = c;
+}
+
+/*
+ * Set up
+ */
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: cansimd [-v] [-s socket] [addr ...]\n");
+	exit(2);
+}
+
+static void
+stop(int sig)
+{
+	quit = 1;
+}
+
+static void
+nodes_init(int verbose)
+{
+	char name[32];
+	struct node *n;
+	int i;
+
+	for (i = 0; i < nnodes; i++) {
+		n = &nodes[i];
+		snprintf(name, sizeof(name), "sim_node_%d", i);
+		if ((n->ops = dlsym(RTLD_DEFAULT, name)) == NULL) {
+			fprintf(stderr, "cansimd: built for %d nodes "
+			    "(make SIM_NODES=n)\n", i);
+			exit(1);
+		}
+		*n->ops->verbose = verbose;
+		*n->ops->sleep_hook = proc_sleep;
+		*n->ops->sleep_limit = UINT64_MAX / 2;	/* no timeouts */
+		n->idle = *n->ops->current;
+		n->ops->run(sim_now);
+		if (n->ops->init(n->addr) < 0) {
+			fprintf(stderr, "cansimd: node %x didn't come up\n",
+			    n->addr);
+			exit(1);
+		}
+	}
+}
+
+static int
+listen_init(void)
+{
+	struct sockaddr_un sun;
+	int s;
+
+	if (strlen(sockpath) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "cansimd: %s: name too long\n", sockpath);
+		exit(1);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, sockpath);
+	unlink(sockpath);
+	if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+	    || bind(s, (struct sockaddr *)&sun, sizeof(sun)) < 0
+	    || listen(s, 16) < 0) {
+		perror(sockpath);
+		exit(1);
+	}
+	return s;
+}
+
+/*
+ * Wait for a request, a connection, or the next thing the world or a
+ * sleeper has to do, and deal with them.
+ */
+static void
+serve(int lsock)
+{
+	static struct pollfd *pfd;
+	static int maxpfd;
+	struct conn *c, *next;
+	struct timespec ts;
+	uint64_t t, now;
+	char b;
+	int i, n;
+
+	t = world_next();
+	for (c = conns; c != NULL; c = c->next)
+		if (c->state == SLEEPING && c->until < t)
+			t = c->until;
+	if (t <= sim_now)
+		return;
+	now = wall();
+	t = t > now ? t - now : 0;
+
+	n = 1;
+	for (c = conns; c != NULL; c = c->next)
+		n++;
+	if (n > maxpfd) {
+		maxpfd = n * 2;
+		if ((pfd = realloc(pfd, maxpfd * sizeof(*pfd))) == NULL) {
+			fprintf(stderr, "cansimd: out of memory\n");
+			exit(1);
+		}
+	}
+	pfd[0].fd = lsock;
+	pfd[0].events = POLLIN;
+	for (i = 1, c = conns; c != NULL; c = c->next, i++) {
+		pfd[i].fd = c->sock;
+		pfd[i].events = POLLIN;
+	}
+	ts.tv_sec = t / NSEC;
+	ts.tv_nsec = t % NSEC;
+	if (ppoll(pfd, n, t == UINT64_MAX ? NULL : &ts, NULL) <= 0)
+		return;
+
+	/* conns is as it was when pfd was made, but for what we free */
+	for (i = 1, c = conns; c != NULL; c = next, i++) {
+		next = c->next;
+		if (pfd[i].revents == 0)
+			continue;
+		if (c->state == IDLE)
+			conn_request(c);
+		else if (recv(c->sock, &b, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+			c->hungup = 1;		/* a signal */
+			if (c->state == SLEEPING)
+				conn_resume(c);
+		}
+	}
+	if (pfd[0].revents & POLLIN)
+		conn_accept(lsock);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct conn *cn, *next;
+	int c, i, lsock, verbose = 0;
+	char *end;
+
+	while ((c = getopt(argc, argv, "vs:")) != EOF) {
+		switch (c) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 's':
+			sockpath = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (sockpath == NULL && (sockpath = getenv("CANSIM_SOCKET")) == NULL)
+		sockpath = CANSIM_SOCKET;
+	for (; optind < argc; optind++) {
+		if (nnodes == NODE_MAX)
+			usage();
+		nodes[nnodes].addr = strtol(argv[optind], &end, 16);
+		if (*end != '\0' || nodes[nnodes].addr < 0
+		    || nodes[nnodes].addr >= CAN_GET_BOARD_H8(0))
+			usage();
+		nnodes++;
+	}
+	if (nnodes == 0)
+		for (nnodes = 0; nnodes < 4; nnodes++)
+			nodes[nnodes].addr = nnodes * 4;
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	clock_init();
+	nodes_init(verbose);
+	lsock = listen_init();
+
+	while (!quit) {
+		world_run(wall());
+		for (cn = conns; cn != NULL; cn = next) {
+			next = cn->next;
+			if (cn->state == SLEEPING)
+				conn_resume(cn);
+		}
+		serve(lsock);
+	}
+
+	/* interrupt what is in the driver, and close everything */
+	while ((cn = conns) != NULL) {
+		cn->hungup = 1;
+		if (cn->state == SLEEPING)
+			conn_resume(cn);
+		else
+			conn_free(cn);
+	}
+	for (i = nnodes - 1; i >= 0; i--)
+		nodes[i].ops->fini();
+	unlink(sockpath);
+	exit(0);
+}
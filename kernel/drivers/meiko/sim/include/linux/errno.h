@@ -0,0 +1,3 @@
+/* the host's first: system headers include it too */
+#include_next <linux/errno.h>
+#include "../sim_kernel.h"
@@ -0,0 +1,482 @@
+/*
+ * $Id$
+ *
+ * Just enough of the Linux 2.2 kernel interface to build can_main.c,
+ * can_obj.c and can_console.c unchanged as ordinary user space code.  
+ * Every shim header under include/linux and include/asm pulls in this file.
+ *
+ * The simulated kernel is single threaded.  "Interrupts" and bottom halves
+ * run only at well defined points: when the harness calls sim_run(), or
+ * when driver code sleeps.  See sim.c.
+ */
+
+#ifndef _SIM_KERNEL_H
+#define _SIM_KERNEL_H
+
+#ifndef __KERNEL__
+#define __KERNEL__
+#endif
+#ifndef MODULE
+#define MODULE
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>		/* O_NONBLOCK */
+#include <sys/types.h>
+#include <time.h>		/* struct timespec for elan.h */
+#include <sys/poll.h>		/* POLLIN, etc */
+#include <sys/ioctl.h>		/* _IO(), etc, encoded as on the host */
+
+typedef uint8_t		u8;
+typedef uint16_t	u16;
+typedef uint32_t	u32;
+typedef uint64_t	u64;
+typedef unsigned short	kdev_t;
+
+#define MKDEV(ma, mi)	(((ma) << 8) | (mi))
+
+#define HZ		100
+#define PAGE_SHIFT	12
+#define PAGE_SIZE	(1UL << PAGE_SHIFT)
+#define PAGE_MASK	(~(PAGE_SIZE - 1))
+#define PAGE_ALIGN(x)	(((x) + PAGE_SIZE - 1) & PAGE_MASK)
+
+#define KERN_ERR	"<3>"
+#define KERN_WARNING	"<4>"
+#define KERN_INFO	"<6>"
+#define KERN_DEBUG	"<7>"
+
+#define __init
+#define __exit
+#define __initfunc(x)	x
+#define __NO_VERSION__
+
+#define EXPORT_NO_SYMBOLS
+#define MOD_INC_USE_COUNT	(sim_mod_usecount++)
+#define MOD_DEC_USE_COUNT	(sim_mod_usecount--)
+#define MOD_IN_USE		(sim_mod_usecount != 0)
+
+#define barrier()	__asm__ __volatile__("" : : : "memory")
+#define mb()		__sync_synchronize()
+#define rmb()		mb()
+#define wmb()		mb()
+
+extern volatile unsigned long	jiffies;
+extern int			sim_mod_usecount;
+
+extern int	printk(const char *fmt, ...)
+		__attribute__ ((format (printf, 1, 2)));
+extern void	panic(const char *fmt, ...)
+		__attribute__ ((noreturn, format (printf, 1, 2)));
+extern void	machine_halt(void);
+
+#define simple_strtoul	strtoul
+
+/*
+ * Processes
+ */
+struct task_struct {
+	volatile long	state;
+	int	sigpending;
+	int	pid;
+};
+#define TASK_RUNNING		0
+#define TASK_INTERRUPTIBLE	1
+extern void	schedule(void);
+extern long	schedule_timeout(long timeout);
+#define MAX_SCHEDULE_TIMEOUT	0x7fffffffL
+#define time_after(a, b)	((long)(b) - (long)(a) < 0)
+#define time_before(a, b)	time_after(b, a)
+extern struct task_struct *current;
+
+#ifndef ERESTARTSYS
+#define ERESTARTSYS		512
+#endif
+
+extern void	udelay(unsigned long usecs);
+
+/*
+ * One CPU.  The ring producers' __cli() only has to keep out "interrupts",
+ * which the simulation never delivers in the middle of driver code anyway.
+ * __save_flags() does report cli(), as the PSR's processor interrupt level.
+ */
+#define smp_processor_id()	0
+#define PSR_PIL			0x00000f00
+#define __save_flags(f)		((f) = sim_irq_disabled ? PSR_PIL : 0)
+#define __cli()			do { } while (0)
+#define __restore_flags(f)	((void)(f))
+
+static inline int 
+test_and_set_bit(int nr, volatile void *a)
+{
+	volatile unsigned long *p = (volatile unsigned long *)a;
+	int old = (*p >> nr) & 1;
+
+	*p |= 1UL << nr;
+	return old;
+}
+
+static inline void
+set_bit(int nr, volatile void *a)
+{
+	*(volatile unsigned long *)a |= 1UL << nr;
+}
+
+static inline void
+clear_bit(int nr, volatile void *a)
+{
+	*(volatile unsigned long *)a &= ~(1UL << nr);
+}
+
+static inline int
+test_bit(int nr, volatile void *a)
+{
+	return (*(volatile unsigned long *)a >> nr) & 1;
+}
+
+/*
+ * Interrupt state.  There is no preemption in the simulation, so the
+ * lock primitives only track nesting so sim.c can tell when it is safe to
+ * deliver an interrupt.
+ */
+typedef struct { int lock; } spinlock_t;
+#define SPIN_LOCK_UNLOCKED	((spinlock_t) { 0 })
+#define spin_lock_init(l)	((l)->lock = 0)
+
+extern int sim_irq_disabled;
+extern int sim_bh_disabled;
+
+#define save_flags(f)		((f) = sim_irq_disabled)
+#define restore_flags(f)	(sim_irq_disabled = (f))
+#define cli()			(sim_irq_disabled = 1)
+#define sti()			(sim_irq_disabled = 0)
+#define spin_lock(l)		((void)(l))
+#define spin_unlock(l)		((void)(l))
+#define spin_lock_irqsave(l, f)	do { save_flags(f); cli(); spin_lock(l); } \
+				while (0)
+#define spin_unlock_irqrestore(l, f) \
+				do { spin_unlock(l); restore_flags(f); } \
+				while (0)
+#define spin_lock_irq(l)	do { cli(); spin_lock(l); } while (0)
+#define spin_unlock_irq(l)	do { spin_unlock(l); sti(); } while (0)
+#define spin_lock_bh(l)		do { sim_bh_disabled++; spin_lock(l); } \
+				while (0)
+#define spin_unlock_bh(l)	do { spin_unlock(l); sim_bh_disabled--; } \
+				while (0)
+#define start_bh_atomic()	(sim_bh_disabled++)
+#define end_bh_atomic()		(sim_bh_disabled--)
+#define in_interrupt()		(sim_in_interrupt != 0)
+
+extern int sim_in_interrupt;
+
+struct semaphore { int count; };
+#define MUTEX			((struct semaphore) { 1 })
+#define sema_init(s, n)		((s)->count = (n))
+#define down(s)			((s)->count--)
+#define down_interruptible(s)	((s)->count--, 0)
+#define up(s)			((s)->count++)
+
+/*
+ * Wait queues.  A sleeper runs the simulation until it is woken; if nothing
+ * left to simulate can wake it, it returns with a signal pending.
+ */
+struct wait_queue {
+	struct task_struct	*task;
+	struct wait_queue	*next;
+};
+
+extern void	add_wait_queue(struct wait_queue **q, struct wait_queue *w);
+extern void	remove_wait_queue(struct wait_queue **q, struct wait_queue *w);
+
+extern void	interruptible_sleep_on(struct wait_queue **q);
+extern void	interruptible_sleep_on_timeout(struct wait_queue **q,
+		    long timeout);
+extern void	wake_up_interruptible(struct wait_queue **q);
+#define sleep_on(q)	interruptible_sleep_on(q)
+#define wake_up(q)	wake_up_interruptible(q)
+#define init_waitqueue(q)	(*(q) = NULL)
+
+/*
+ * poll
+ */
+#define SIM_POLL_MAX	8
+typedef struct poll_table_struct {
+	int			nr;
+	struct wait_queue	**q[SIM_POLL_MAX];
+} poll_table;
+
+struct file;
+extern void	poll_wait(struct file *file, struct wait_queue **q,
+		    poll_table *p);
+
+/*
+ * Memory
+ */
+#define GFP_KERNEL	0
+#define GFP_ATOMIC	1
+
+extern void	*kmalloc(size_t size, int flags);
+extern void	kfree(const void *p);
+extern unsigned long __get_free_pages(int flags, unsigned long order);
+extern void	free_pages(unsigned long addr, unsigned long order);
+#define __get_free_page(f)	__get_free_pages((f), 0)
+#define free_page(a)		free_pages((a), 0)
+#define __pa(x)			((unsigned long)(x))
+#define virt_to_phys(x)		((unsigned long)(x))
+#define MAP_NR(x)		(0)
+#define mem_map_reserve(x)	do { } while (0)
+#define mem_map_unreserve(x)	do { } while (0)
+
+typedef struct { unsigned long pgprot; } pgprot_t;
+
+struct vm_area_struct {
+	unsigned long	vm_start;
+	unsigned long	vm_end;
+	unsigned long	vm_offset;
+	unsigned short	vm_flags;
+	pgprot_t	vm_page_prot;
+	struct file	*vm_file;
+	struct vm_operations_struct *vm_ops;
+};
+
+struct vm_operations_struct {
+	void	(*open)(struct vm_area_struct *vma);
+	void	(*close)(struct vm_area_struct *vma);
+};
+
+extern int	remap_page_range(unsigned long from, unsigned long to,
+		    unsigned long size, pgprot_t prot);
+
+/*
+ * User space access.  All addresses are ours, so these are just memcpy.
+ */
+#define VERIFY_READ	0
+#define VERIFY_WRITE	1
+#define verify_area(t, a, n)	(0)
+#define access_ok(t, a, n)	(1)
+
+extern unsigned long sim_copy(void *to, const void *from, unsigned long n);
+
+#define copy_to_user(to, from, n) \
+	sim_copy((void *)(unsigned long)(to), (from), (n))
+#define copy_from_user(to, from, n) \
+	sim_copy((to), (const void *)(unsigned long)(from), (n))
+#define __copy_to_user		copy_to_user
+#define __copy_from_user	copy_from_user
+#define copy_to_user_ret(to, from, n, retval) \
+	({ if (copy_to_user(to, from, n)) return retval; })
+#define copy_from_user_ret(to, from, n, retval) \
+	({ if (copy_from_user(to, from, n)) return retval; })
+#define get_user(x, p)	({ (x) = *(p); 0; })
+#define put_user(x, p)	({ *(p) = (x); 0; })
+
+/*
+ * Files
+ */
+struct inode { kdev_t i_rdev; };
+
+struct file {
+	unsigned int	f_flags;
+	unsigned int	f_mode;
+	void		*private_data;
+};
+
+struct file_operations {
+	loff_t	(*llseek)(struct file *, loff_t, int);
+	ssize_t	(*read)(struct file *, char *, size_t, loff_t *);
+	ssize_t	(*write)(struct file *, const char *, size_t, loff_t *);
+	int	(*readdir)(struct file *, void *, void *);
+	unsigned int (*poll)(struct file *, poll_table *);
+	int	(*ioctl)(struct inode *, struct file *, unsigned int,
+		    unsigned long);
+	int	(*mmap)(struct file *, struct vm_area_struct *);
+	int	(*open)(struct inode *, struct file *);
+	int	(*flush)(struct file *);
+	int	(*release)(struct inode *, struct file *);
+};
+
+struct miscdevice {
+	int			minor;
+	const char		*name;
+	struct file_operations	*fops;
+	struct miscdevice	*next, *prev;
+};
+
+extern int	misc_register(struct miscdevice *m);
+extern int	misc_deregister(struct miscdevice *m);
+
+#define MISC_MAJOR	10
+#define TTY_MAJOR	4
+
+/*
+ * Interrupts, bottom halves and task queues
+ */
+struct pt_regs { int dummy; };
+
+extern int	request_irq(unsigned int irq,
+		    void (*handler)(int, void *, struct pt_regs *),
+		    unsigned long flags, const char *name, void *dev_id);
+extern void	free_irq(unsigned int irq, void *dev_id);
+extern void	disable_irq(unsigned int irq);
+extern void	enable_irq(unsigned int irq);
+
+struct tq_struct {
+	struct tq_struct	*next;
+	unsigned long		sync;
+	void			(*routine)(void *);
+	void			*data;
+};
+typedef struct tq_struct *task_queue;
+
+extern task_queue	tq_immediate, tq_timer, tq_scheduler;
+extern void		queue_task(struct tq_struct *t, task_queue *q);
+
+#define IMMEDIATE_BH	9
+extern void		mark_bh(int nr);
+
+/*
+ * Timers
+ */
+struct timer_list {
+	struct timer_list	*next, *prev;
+	unsigned long		expires;
+	unsigned long		data;
+	void			(*function)(unsigned long);
+};
+
+extern void	init_timer(struct timer_list *t);
+extern void	add_timer(struct timer_list *t);
+extern int	del_timer(struct timer_list *t);
+extern void	mod_timer(struct timer_list *t, unsigned long expires);
+#define timer_pending(t)	((t)->prev != NULL)
+
+/*
+ * I/O space and the PROM
+ */
+#define PROMREG_MAX	16
+
+struct linux_prom_registers {
+	unsigned int which_io;
+	unsigned int phys_addr;
+	unsigned int reg_size;
+};
+
+extern int	prom_root_node;
+extern int	prom_node_has_property(int node, char *name);
+extern int	prom_getchild(int node);
+extern int	prom_searchsiblings(int node, char *name);
+extern int	prom_getproperty(int node, char *name, char *buf, int size);
+extern int	prom_setprop(int node, char *name, char *buf, int size);
+extern void	prom_apply_obio_ranges(struct linux_prom_registers *r, int n);
+extern void	*sparc_alloc_io(unsigned int phys, void *virt, int len,
+		    char *name, unsigned int bus, int rdonly);
+extern void	sparc_free_io(void *va, int len);
+
+/*
+ * /proc
+ */
+struct proc_dir_entry;
+typedef int (read_proc_t)(char *page, char **start, off_t off, int count,
+		int *eof, void *data);
+
+struct proc_dir_entry {
+	const char		*name;
+	mode_t			mode;
+	read_proc_t		*read_proc;
+	void			*data;
+	struct proc_dir_entry	*parent, *next, *subdir;
+};
+
+extern struct proc_dir_entry	proc_root;
+extern struct proc_dir_entry	*create_proc_entry(const char *name,
+				    mode_t mode, struct proc_dir_entry *parent);
+extern void	remove_proc_entry(const char *name,
+		    struct proc_dir_entry *parent);
+
+/*
+ * ttys and consoles
+ */
+struct termios { unsigned int c_cflag; };
+extern struct termios tty_std_termios;
+
+#define TTY_FLIPBUF_SIZE	512
+#define TTY_DRIVER_MAGIC	0x5402
+#define TTY_DRIVER_REAL_RAW	0x0004
+#define TTY_DRIVER_RESET_TERMIOS 0x0008
+#define TTY_DO_WRITE_WAKEUP	5
+
+struct tty_struct;
+
+struct tty_ldisc {
+	void	(*write_wakeup)(struct tty_struct *tty);
+};
+
+struct tty_flip_buffer {
+	char		char_buf[2 * TTY_FLIPBUF_SIZE];
+	char		flag_buf[2 * TTY_FLIPBUF_SIZE];
+	char		*char_buf_ptr;
+	unsigned char	*flag_buf_ptr;
+	int		count;
+};
+
+struct tty_struct {
+	struct tty_flip_buffer	flip;
+	struct tty_ldisc	ldisc;
+	struct wait_queue	*write_wait;
+	unsigned long		flags;
+	int			stopped;
+};
+
+struct tty_driver {
+	int		magic;
+	const char	*driver_name;
+	const char	*name;
+	short		major;
+	short		minor_start;
+	short		num;
+	short		type;
+	short		subtype;
+	struct termios	init_termios;
+	int		flags;
+	int		*refcount;
+	struct tty_struct **table;
+	struct termios	**termios;
+	struct termios	**termios_locked;
+	int	(*open)(struct tty_struct *tty, struct file *filp);
+	void	(*close)(struct tty_struct *tty, struct file *filp);
+	int	(*write)(struct tty_struct *tty, int from_user,
+		    const unsigned char *buf, int count);
+	void	(*put_char)(struct tty_struct *tty, unsigned char ch);
+	void	(*flush_chars)(struct tty_struct *tty);
+	int	(*write_room)(struct tty_struct *tty);
+	int	(*chars_in_buffer)(struct tty_struct *tty);
+	void	(*flush_buffer)(struct tty_struct *tty);
+};
+
+extern int	tty_register_driver(struct tty_driver *d);
+extern int	tty_unregister_driver(struct tty_driver *d);
+extern void	tty_hangup(struct tty_struct *tty);
+extern void	tty_flip_buffer_push(struct tty_struct *tty);
+
+#define CON_PRINTBUFFER	1
+#define CON_ENABLED	4
+
+struct console {
+	char	name[8];
+	void	(*write)(struct console *c, const char *s, unsigned count);
+	kdev_t	(*device)(struct console *c);
+	short	flags;
+	short	index;
+	struct console *next;
+};
+
+extern void	register_console(struct console *c);
+extern int	unregister_console(struct console *c);
+
+#endif /* _SIM_KERNEL_H */
+
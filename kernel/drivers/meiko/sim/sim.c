@@ -0,0 +1,1003 @@
+/*
+ * $Id$
+ *
+ * The kernel the CAN driver runs on in the simulation: virtual time and
+ * the elan clock, timers, the interrupt and bottom halves, sleeping and
+ * wait queues, memory, /proc, and /dev/can's file operations.
+ *
+ * There is one process, the harness.  When the driver puts it to sleep,
+ * the rest of the world runs until something wakes it.  If nothing has
+ * after sim_sleep_limit, it gets a signal.  A harness with processes of
+ * its own (cansimd.c) sets sim_sleep_hook and current instead.
+ *
+ * printk goes to the registered consoles, as in the kernel, and so to
+ * the CAN console when the PROM says one is connected.
+ */
+
+#define _GNU_SOURCE		/* memfd_create() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sim.h"
+#include <asm/meiko/elan.h>
+
+extern int	init_module(void);
+extern void	cleanup_module(void);
+
+struct sim_event {
+	uint64_t		when;
+	void			(*fn)(void *arg);
+	void			*arg;
+	struct sim_event	*next;
+};
+
+struct sim_file {
+	struct file		file;
+	struct inode		inode;
+};
+
+struct sim_pages {
+	void			*addr;
+	size_t			len;
+	int			fd;
+	struct sim_pages	*next;
+};
+
+uint64_t			sim_now;
+uint64_t			sim_sleep_limit = 10 * 1000000000ULL;
+int				(*sim_sleep_hook)(uint64_t until,
+				    int (*woken)(void));
+int				sim_verbose;
+long				sim_kmem_live;
+
+volatile unsigned long		jiffies;
+int				sim_mod_usecount;
+int				sim_irq_disabled;
+int				sim_bh_disabled;
+int				sim_in_interrupt;
+
+static struct task_struct	sim_task = { TASK_RUNNING, 0, 1 };
+struct task_struct		*current = &sim_task;
+
+static elanreg_t		sim_elanreg;
+elanreg_t			*elanreg = &sim_elanreg;
+
+static struct sim_event		*events;	/* in time order */
+static struct timer_list	timers = { &timers, &timers };
+task_queue			tq_immediate, tq_timer, tq_scheduler;
+static unsigned long		bh_active;
+
+static void			(*irq_handler)(int, void *, struct pt_regs *);
+static void			*irq_dev_id;
+static int			irq_depth;
+
+static struct console		*consoles;
+static int			in_console;
+
+static struct miscdevice	*miscdev;
+static unsigned long		remap_to;
+static struct sim_pages		*pages;
+
+struct proc_dir_entry		proc_root = { "" };
+struct termios			tty_std_termios;
+
+/*
+ * Time
+ */
+static void
+sim_settime(uint64_t t)
+{
+	elanclock_t ts;
+	uint64_t clock;
+
+	sim_now = t;
+	jiffies = t / SIM_NSEC_PER_JIFFY;
+	ts.tv_sec = t / 1000000000;
+	ts.tv_nsec = t % 1000000000;
+	memcpy(&clock, &ts, sizeof(clock));
+	sim_elanreg.clock = clock;
+	sim_elanreg.clockHi = ts.tv_sec;
+	sim_elanreg.clockLo = ts.tv_nsec;
+}
+
+/*
+ * Call fn(arg) at when, as the hardware would: it must not call the
+ * driver.
+ */
+void
+sim_at(uint64_t when, void (*fn)(void *), void *arg)
+{
+	struct sim_event *e, **pp;
+
+	if ((e = malloc(sizeof(*e))) == NULL)
+		panic("sim_at: out of memory");
+	e->when = when < sim_now ? sim_now : when;
+	e->fn = fn;
+	e->arg = arg;
+	for (pp = &events; *pp != NULL && (*pp)->when <= e->when;
+	    pp = &(*pp)->next)
+		;
+	e->next = *pp;
+	*pp = e;
+}
+
+/*
+ * Timers
+ */
+void
+init_timer(struct timer_list *t)
+{
+	t->next = t->prev = NULL;
+}
+
+void
+add_timer(struct timer_list *t)
+{
+	if (timer_pending(t))
+		panic("add_timer: timer already pending");
+	t->next = timers.next;
+	t->prev = &timers;
+	timers.next->prev = t;
+	timers.next = t;
+}
+
+int
+del_timer(struct timer_list *t)
+{
+	if (!timer_pending(t))
+		return 0;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	return 1;
+}
+
+void
+mod_timer(struct timer_list *t, unsigned long expires)
+{
+	del_timer(t);
+	t->expires = expires;
+	add_timer(t);
+}
+
+static struct timer_list *
+sim_timer_first(void)
+{
+	struct timer_list *t, *first = NULL;
+
+	for (t = timers.next; t != &timers; t = t->next)
+		if (first == NULL || time_before(t->expires, first->expires))
+			first = t;
+	return first;
+}
+
+/* when the next timer is due, in nsec */
+static uint64_t
+sim_timer_next(void)
+{
+	struct timer_list *t = sim_timer_first();
+
+	if (t == NULL)
+		return UINT64_MAX;
+	if (!time_after(t->expires, jiffies))
+		return sim_now;
+	return (uint64_t)t->expires * SIM_NSEC_PER_JIFFY;
+}
+
+/*
+ * Bottom halves
+ */
+void
+queue_task(struct tq_struct *t, task_queue *q)
+{
+	if (!test_and_set_bit(0, &t->sync)) {
+		t->next = *q;
+		*q = t;
+	}
+}
+
+void
+mark_bh(int nr)
+{
+	set_bit(nr, &bh_active);
+}
+
+static void
+run_task_queue(task_queue *q)
+{
+	struct tq_struct *t = *q, *next;
+
+	*q = NULL;
+	for (; t != NULL; t = next) {
+		next = t->next;
+		clear_bit(0, &t->sync);
+		t->routine(t->data);
+	}
+}
+
+/*
+ * Interrupts
+ */
+int
+request_irq(unsigned int irq, void (*handler)(int, void *, struct pt_regs *),
+		unsigned long flags, const char *name, void *dev_id)
+{
+	if (irq != CAN_IRQ || irq_handler != NULL)
+		return -EBUSY;
+	irq_handler = handler;
+	irq_dev_id = dev_id;
+	return 0;
+}
+
+void
+free_irq(unsigned int irq, void *dev_id)
+{
+	irq_handler = NULL;
+}
+
+void
+disable_irq(unsigned int irq)
+{
+	irq_depth++;
+}
+
+void
+enable_irq(unsigned int irq)
+{
+	irq_depth--;
+}
+
+/* bottom halves and timers can run */
+static int
+sim_bh_ok(void)
+{
+	return !sim_in_interrupt && !sim_irq_disabled && !sim_bh_disabled;
+}
+
+/*
+ * Deliver what real hardware would have by now: the 82C200 interrupt,
+ * then bottom halves and timers, unless they are held off.
+ */
+static void
+sim_softirq(void)
+{
+	struct pt_regs regs;
+	struct timer_list *t;
+	int storm = 0;
+
+	while (!sim_in_interrupt && !sim_irq_disabled) {
+		if (sim_82c200_irq() && irq_handler != NULL && irq_depth == 0) {
+			if (++storm > 100)
+				panic("sim: 82C200 interrupt not cleared");
+			sim_chip.interrupts++;
+			sim_in_interrupt++;
+			irq_handler(CAN_IRQ, irq_dev_id, &regs);
+			sim_in_interrupt--;
+			continue;
+		}
+		if (sim_bh_disabled)
+			break;
+		if (test_bit(IMMEDIATE_BH, &bh_active)) {
+			clear_bit(IMMEDIATE_BH, &bh_active);
+			sim_in_interrupt++;
+			run_task_queue(&tq_immediate);
+			sim_in_interrupt--;
+			continue;
+		}
+		if (sim_timer_next() == sim_now) {
+			t = sim_timer_first();
+			del_timer(t);
+			sim_in_interrupt++;
+			t->function(t->data);
+			sim_in_interrupt--;
+			continue;
+		}
+		break;
+	}
+}
+
+/* when there is next something to do, in nsec */
+static uint64_t
+sim_next(void)
+{
+	uint64_t next = sim_bh_ok() ? sim_timer_next() : UINT64_MAX;
+
+	if (events != NULL && events->when < next)
+		next = events->when;
+	return next;
+}
+
+/*
+ * Run the world until time until, or until stop() is true.  Return 1 if
+ * it stopped.
+ */
+static int
+sim_advance(uint64_t until, int (*stop)(void))
+{
+	struct sim_event *e;
+	uint64_t next;
+
+	for (;;) {
+		sim_softirq();
+		if (stop != NULL && stop())
+			return 1;
+		next = sim_next();
+		if (next > until) {
+			if (until > sim_now)
+				sim_settime(until);
+			sim_softirq();
+			return stop != NULL && stop();
+		}
+		if (next > sim_now)
+			sim_settime(next);
+		while ((e = events) != NULL && e->when <= sim_now) {
+			events = e->next;
+			e->fn(e->arg);
+			free(e);
+		}
+	}
+}
+
+static int
+sim_woken(void)
+{
+	return current->state == TASK_RUNNING;
+}
+
+/*
+ * current sleeps until it is woken or until time until.  Return 1 if it
+ * was woken.  With sim_sleep_hook set, the harness runs the world, and
+ * may return 0 early to deliver a signal.
+ */
+static int
+sim_sleep(uint64_t until)
+{
+	if (sim_sleep_hook != NULL)
+		return sim_sleep_hook(until, sim_woken);
+	return sim_advance(until, sim_woken);
+}
+
+static int
+sim_quiet(void)
+{
+	return events == NULL;
+}
+
+void
+sim_run(uint64_t nsec)
+{
+	sim_advance(sim_now + nsec, NULL);
+}
+
+/*
+ * Run until the bus has nothing to do.  Return 0, or -1 if it still had
+ * after sim_sleep_limit.
+ */
+int
+sim_idle(void)
+{
+	return sim_advance(sim_now + sim_sleep_limit, sim_quiet) ? 0 : -1;
+}
+
+void
+udelay(unsigned long usecs)
+{
+	sim_advance(sim_now + usecs * 1000ULL, NULL);
+}
+
+/*
+ * Sleeping
+ */
+void
+schedule(void)
+{
+	if (sim_in_interrupt)
+		panic("schedule: in interrupt");
+	if (current->state == TASK_RUNNING) {
+		sim_softirq();
+		return;
+	}
+	if (!sim_sleep(sim_now + sim_sleep_limit)) {
+		current->sigpending = 1;
+		current->state = TASK_RUNNING;
+	}
+}
+
+static void
+sim_process_timeout(unsigned long data)
+{
+	((struct task_struct *)data)->state = TASK_RUNNING;
+}
+
+long
+schedule_timeout(long timeout)
+{
+	struct timer_list timer;
+	unsigned long expire;
+
+	if (timeout == MAX_SCHEDULE_TIMEOUT) {
+		schedule();
+		return timeout;
+	}
+	expire = jiffies + timeout;
+	init_timer(&timer);
+	timer.expires = expire;
+	timer.data = (unsigned long)current;
+	timer.function = sim_process_timeout;
+	add_timer(&timer);
+	schedule();
+	del_timer(&timer);
+	timeout = expire - jiffies;
+	return timeout < 0 ? 0 : timeout;
+}
+
+void
+add_wait_queue(struct wait_queue **q, struct wait_queue *w)
+{
+	w->next = *q;
+	*q = w;
+}
+
+void
+remove_wait_queue(struct wait_queue **q, struct wait_queue *w)
+{
+	for (; *q != NULL; q = &(*q)->next) {
+		if (*q == w) {
+			*q = w->next;
+			break;
+		}
+	}
+}
+
+void
+wake_up_interruptible(struct wait_queue **q)
+{
+	struct wait_queue *w;
+
+	for (w = *q; w != NULL; w = w->next)
+		if (w->task->state == TASK_INTERRUPTIBLE)
+			w->task->state = TASK_RUNNING;
+}
+
+void
+interruptible_sleep_on(struct wait_queue **q)
+{
+	struct wait_queue wait = { current, NULL };
+
+	current->state = TASK_INTERRUPTIBLE;
+	add_wait_queue(q, &wait);
+	schedule();
+	remove_wait_queue(q, &wait);
+}
+
+void
+interruptible_sleep_on_timeout(struct wait_queue **q, long timeout)
+{
+	struct wait_queue wait = { current, NULL };
+
+	current->state = TASK_INTERRUPTIBLE;
+	add_wait_queue(q, &wait);
+	schedule_timeout(timeout);
+	remove_wait_queue(q, &wait);
+}
+
+void
+poll_wait(struct file *file, struct wait_queue **q, poll_table *p)
+{
+	if (p != NULL && p->nr < SIM_POLL_MAX)
+		p->q[p->nr++] = q;
+}
+
+/*
+ * Memory
+ */
+void *
+kmalloc(size_t size, int flags)
+{
+	void *p = malloc(size);
+
+	if (p != NULL)
+		sim_kmem_live++;
+	return p;
+}
+
+void
+kfree(const void *p)
+{
+	if (p != NULL) {
+		sim_kmem_live--;
+		free((void *)p);
+	}
+}
+
+/*
+ * Page blocks are each a memfd of their own, so that what the driver maps
+ * to user space (an fd's receive ring) can be mapped by another process.
+ */
+unsigned long
+__get_free_pages(int flags, unsigned long order)
+{
+	struct sim_pages *p;
+
+	if ((p = malloc(sizeof(*p))) == NULL)
+		return 0;
+	p->len = PAGE_SIZE << order;
+	if ((p->fd = memfd_create("sim pages", MFD_CLOEXEC)) < 0) {
+		free(p);
+		return 0;
+	}
+	if (ftruncate(p->fd, p->len) < 0 
+	    || (p->addr = mmap(NULL, p->len, PROT_READ | PROT_WRITE, 
+	    MAP_SHARED, p->fd, 0)) == MAP_FAILED) {
+		close(p->fd);
+		free(p);
+		return 0;
+	}
+	p->next = pages;
+	pages = p;
+	sim_kmem_live++;
+	return (unsigned long)p->addr;
+}
+
+void
+free_pages(unsigned long addr, unsigned long order)
+{
+	struct sim_pages **pp, *p;
+
+	for (pp = &pages; (p = *pp) != NULL; pp = &p->next) {
+		if (p->addr == (void *)addr) {
+			*pp = p->next;
+			munmap(p->addr, p->len);
+			close(p->fd);
+			free(p);
+			sim_kmem_live--;
+			break;
+		}
+	}
+}
+
+/* the memfd addr is in, and where in it; or -1 */
+int
+sim_page_fd(void *addr, off_t *off)
+{
+	struct sim_pages *p;
+
+	for (p = pages; p != NULL; p = p->next) {
+		if ((char *)addr >= (char *)p->addr 
+		    && (char *)addr < (char *)p->addr + p->len) {
+			*off = (char *)addr - (char *)p->addr;
+			return p->fd;
+		}
+	}
+	return -1;
+}
+
+/* physical is virtual here, so this just says where the mapping is */
+int
+remap_page_range(unsigned long from, unsigned long to, unsigned long size,
+		pgprot_t prot)
+{
+	remap_to = to;
+	return 0;
+}
+
+unsigned long
+sim_copy(void *to, const void *from, unsigned long n)
+{
+	if (to == NULL || from == NULL)
+		return n;
+	memcpy(to, from, n);
+	return 0;
+}
+
+/*
+ * Messages
+ */
+int
+printk(const char *fmt, ...)
+{
+	char buf[1024], *msg = buf;
+	struct console *c;
+	int level = 4;			/* default_message_loglevel */
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (buf[0] == '<' && buf[1] != '\0' && buf[2] == '>') {
+		level = buf[1] - '0';
+		msg += 3;
+	}
+	if (sim_verbose)
+		fputs(msg, stderr);
+
+	/* not debug messages, and not from a console */
+	if (level < 7 && !in_console) {
+		in_console++;
+		for (c = consoles; c != NULL; c = c->next)
+			c->write(c, msg, strlen(msg));
+		in_console--;
+	}
+	return n;
+}
+
+void
+panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "sim: panic: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+void
+machine_halt(void)
+{
+	printk("sim: machine_halt\n");
+}
+
+/*
+ * /proc
+ */
+struct proc_dir_entry *
+create_proc_entry(const char *name, mode_t mode, struct proc_dir_entry *parent)
+{
+	struct proc_dir_entry *e;
+
+	if (parent == NULL)
+		parent = &proc_root;
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		return NULL;
+	e->name = strdup(name);
+	e->mode = mode;
+	e->parent = parent;
+	e->next = parent->subdir;
+	parent->subdir = e;
+	return e;
+}
+
+void
+remove_proc_entry(const char *name, struct proc_dir_entry *parent)
+{
+	struct proc_dir_entry **pp, *e;
+
+	if (parent == NULL)
+		parent = &proc_root;
+	for (pp = &parent->subdir; (e = *pp) != NULL; pp = &e->next) {
+		if (strcmp(e->name, name) == 0) {
+			*pp = e->next;
+			free((void *)e->name);
+			free(e);
+			break;
+		}
+	}
+}
+
+/* read a /proc file, such as "can/stats", into buf as a string */
+int
+sim_proc_read(const char *path, char *buf, int size)
+{
+	struct proc_dir_entry *e, *dir = &proc_root;
+	char page[PAGE_SIZE], *start = NULL;
+	const char *p = path;
+	int len, eof = 0;
+
+	for (;;) {
+		len = strcspn(p, "/");
+		for (e = dir->subdir; e != NULL; e = e->next)
+			if (strncmp(e->name, p, len) == 0 && e->name[len] == '\0')
+				break;
+		if (e == NULL)
+			return -ENOENT;
+		if (p[len] == '\0')
+			break;
+		dir = e;
+		p += len + 1;
+	}
+	if (e->read_proc == NULL || size <= 0)
+		return -EINVAL;
+	len = e->read_proc(page, &start, 0, PAGE_SIZE, &eof, e->data);
+	if (len < 0)
+		return len;
+	if (len >= size)
+		len = size - 1;
+	memcpy(buf, page, len);
+	buf[len] = '\0';
+	return len;
+}
+
+/*
+ * ttys and consoles.  printk goes to stderr, not to the CAN console.
+ */
+int
+tty_register_driver(struct tty_driver *d)
+{
+	return 0;
+}
+
+int
+tty_unregister_driver(struct tty_driver *d)
+{
+	return 0;
+}
+
+void
+tty_hangup(struct tty_struct *tty)
+{
+}
+
+/* no line discipline - throw the input away */
+void
+tty_flip_buffer_push(struct tty_struct *tty)
+{
+	tty->flip.count = 0;
+	tty->flip.char_buf_ptr = tty->flip.char_buf;
+	tty->flip.flag_buf_ptr = (unsigned char *)tty->flip.flag_buf;
+}
+
+void
+register_console(struct console *c)
+{
+	c->next = consoles;
+	consoles = c;
+}
+
+int
+unregister_console(struct console *c)
+{
+	struct console **pp;
+
+	for (pp = &consoles; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == c) {
+			*pp = c->next;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * The driver and /dev/can
+ */
+int
+misc_register(struct miscdevice *m)
+{
+	if (miscdev != NULL)
+		return -EBUSY;
+	miscdev = m;
+	return 0;
+}
+
+int
+misc_deregister(struct miscdevice *m)
+{
+	if (miscdev == m)
+		miscdev = NULL;
+	return 0;
+}
+
+/*
+ * Bring up the driver on node nodeid (as CAN_GET_ADDR returns it), at
+ * the current time.  This can be done once per copy of the driver: it
+ * keeps state in statics.
+ */
+int
+sim_init(uint32_t nodeid)
+{
+	sim_settime(sim_now);
+	sim_prom_init(nodeid);
+	if (init_module() != 0)
+		return -1;
+	sim_softirq();
+	return 0;
+}
+
+void
+sim_fini(void)
+{
+	struct sim_event *e;
+
+	cleanup_module();
+	while ((e = events) != NULL) {
+		events = e->next;
+		free(e);
+	}
+}
+
+/* as on entry to and return from a system call */
+static void
+sim_enter(void)
+{
+	current->sigpending = 0;
+	current->state = TASK_RUNNING;
+	sim_softirq();
+}
+
+static void
+sim_leave(void)
+{
+	sim_softirq();
+}
+
+struct file *
+sim_open(int flags)
+{
+	struct sim_file *sf;
+	int error;
+
+	if (miscdev == NULL) {
+		errno = ENODEV;
+		return NULL;
+	}
+	if ((sf = calloc(1, sizeof(*sf))) == NULL)
+		return NULL;
+	sf->inode.i_rdev = MKDEV(MISC_MAJOR, miscdev->minor);
+	sf->file.f_flags = flags;
+	sf->file.f_mode = (flags + 1) & O_ACCMODE;
+	sim_enter();
+	error = miscdev->fops->open(&sf->inode, &sf->file);
+	sim_leave();
+	if (error < 0) {
+		free(sf);
+		errno = -error;
+		return NULL;
+	}
+	return &sf->file;
+}
+
+int
+sim_close(struct file *f)
+{
+	struct sim_file *sf = (struct sim_file *)f;
+	int error;
+
+	sim_enter();
+	error = miscdev->fops->release(&sf->inode, f);
+	sim_leave();
+	free(sf);
+	return error;
+}
+
+ssize_t
+sim_read(struct file *f, void *buf, size_t count)
+{
+	loff_t pos = 0;
+	ssize_t n;
+
+	sim_enter();
+	n = miscdev->fops->read(f, buf, count, &pos);
+	sim_leave();
+	return n;
+}
+
+ssize_t
+sim_write(struct file *f, const void *buf, size_t count)
+{
+	loff_t pos = 0;
+	ssize_t n;
+
+	sim_enter();
+	n = miscdev->fops->write(f, buf, count, &pos);
+	sim_leave();
+	return n;
+}
+
+int
+sim_ioctl(struct file *f, unsigned int cmd, void *arg)
+{
+	struct sim_file *sf = (struct sim_file *)f;
+	int error;
+
+	sim_enter();
+	error = miscdev->fops->ioctl(&sf->inode, f, cmd, (unsigned long)arg);
+	sim_leave();
+	return error;
+}
+
+/*
+ * Wait up to timeout nsec (at most sim_sleep_limit) for one of events.
+ * Return the events that are ready, or 0.
+ */
+int
+sim_poll(struct file *f, int events, uint64_t timeout)
+{
+	struct wait_queue wait[SIM_POLL_MAX];
+	poll_table pt;
+	uint64_t deadline;
+	unsigned int mask;
+	int i;
+
+	if (timeout > sim_sleep_limit)
+		timeout = sim_sleep_limit;
+	deadline = sim_now + timeout;
+	sim_enter();
+	for (;;) {
+		pt.nr = 0;
+		mask = miscdev->fops->poll(f, &pt);
+		mask &= events | POLLERR | POLLHUP;
+		if (mask != 0 || sim_now >= deadline)
+			break;
+		current->state = TASK_INTERRUPTIBLE;
+		for (i = 0; i < pt.nr; i++) {
+			wait[i].task = current;
+			add_wait_queue(pt.q[i], &wait[i]);
+		}
+		if (!sim_sleep(deadline))
+			deadline = sim_now;	/* a signal */
+		current->state = TASK_RUNNING;
+		for (i = 0; i < pt.nr; i++)
+			remove_wait_queue(pt.q[i], &wait[i]);
+	}
+	sim_leave();
+	return mask;
+}
+
+void *
+sim_mmap(struct file *f, size_t len)
+{
+	struct vm_area_struct vma;
+	int error;
+
+	memset(&vma, 0, sizeof(vma));
+	vma.vm_end = len;
+	vma.vm_file = f;
+	remap_to = 0;
+	sim_enter();
+	error = miscdev->fops->mmap(f, &vma);
+	sim_leave();
+	if (error < 0) {
+		errno = -error;
+		return NULL;
+	}
+	return (void *)remap_to;
+}
+
+/*
+ * This copy of the driver, for a harness with many
+ */
+static void
+sim_run_to(uint64_t until)
+{
+	sim_advance(until, NULL);
+}
+
+static void
+sim_console(const char *s)
+{
+	printk("%s", s);
+}
+
+const struct sim_node sim_node = {
+	init:		sim_init,
+	fini:		sim_fini,
+	next:		sim_next,
+	run:		sim_run_to,
+	console:	sim_console,
+	open:		sim_open,
+	close:		sim_close,
+	read:		sim_read,
+	write:		sim_write,
+	ioctl:		sim_ioctl,
+	poll:		sim_poll,
+	mmap:		sim_mmap,
+	page_fd:	sim_page_fd,
+	now:		&sim_now,
+	verbose:	&sim_verbose,
+	kmem_live:	&sim_kmem_live,
+	chip:		&sim_chip,
+	bus:		&sim_82c200_bus,
+	cancon_host:	&sim_cancon_host,
+	current:	&current,
+	sleep_hook:	&sim_sleep_hook,
+	sleep_limit:	&sim_sleep_limit,
+};
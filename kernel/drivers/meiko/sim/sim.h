@@ -0,0 +1,181 @@
+/*
+ * $Id$
+ *
+ * User space simulation of the CAN driver.  can_main.c, can_obj.c and
+ * can_console.c are compiled unchanged against the kernel shim in
+ * include/, and drive an emulated 82C200 on a simulated bus.
+ *
+ * Time is virtual: it only moves when the harness calls sim_run() or
+ * sim_idle(), or when the driver sleeps or busy waits, and driver code
+ * itself takes no time.  Interrupts, bottom halves and timers are
+ * delivered only at those points, so a run is repeatable.
+ *
+ * Include system headers before this one: the shim redefines struct
+ * timespec for the elan clock (see include/sim_kernel.h).
+ */
+
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <asm/meiko/can.h>
+
+#define SIM_NSEC_PER_JIFFY	(1000000000ULL / HZ)
+
+/*
+ * The world
+ */
+extern uint64_t	sim_now;		/* nsec since sim_init() */
+extern uint64_t	sim_sleep_limit;	/* a sleeper gets a signal after */
+extern int	sim_verbose;		/* printk to stderr */
+extern long	sim_kmem_live;		/* kmalloc'd or page blocks held */
+
+
+/*
+ * A harness that runs several processes, each on a stack of its own,
+ * sets current to the one it calls the driver for, and sim_sleep_hook.
+ * When the driver puts that process to sleep it calls the hook instead
+ * of running the world, which must return 1 once woken() is, or 0 at
+ * time until, or earlier to deliver a signal.
+ */
+extern int	(*sim_sleep_hook)(uint64_t until, int (*woken)(void));
+
+extern int	sim_init(uint32_t nodeid);
+extern void	sim_fini(void);
+extern void	sim_run(uint64_t nsec);
+extern int	sim_idle(void);
+extern void	sim_at(uint64_t when, void (*fn)(void *), void *arg);
+
+/*
+ * /dev/can as a process sees it.  These return what the driver returns
+ * (-errno on failure), except sim_open() and sim_mmap(), which return
+ * NULL and set errno.
+ */
+extern struct file *sim_open(int flags);
+extern int	sim_close(struct file *f);
+extern ssize_t	sim_read(struct file *f, void *buf, size_t count);
+extern ssize_t	sim_write(struct file *f, const void *buf, size_t count);
+extern int	sim_ioctl(struct file *f, unsigned int cmd, void *arg);
+extern int	sim_poll(struct file *f, int events, uint64_t timeout);
+extern void	*sim_mmap(struct file *f, size_t len);
+extern int	sim_page_fd(void *addr, off_t *off);
+extern int	sim_proc_read(const char *path, char *buf, int size);
+
+/*
+ * The bus (sim_bus.c)
+ */
+struct sim_port {
+	struct sim_bus	*bus;
+	/* the frame waiting to go, or NULL */
+	struct can_packet *(*txpkt)(struct sim_port *p);
+	/* it went, whole */
+	void		(*txdone)(struct sim_port *p);
+	/* another port's frame, if not NULL */
+	void		(*rx)(struct sim_port *p, struct can_packet *pkt);
+	/* the bus went busy or idle, if not NULL */
+	void		(*change)(struct sim_port *p);
+	void		*arg;
+	uint64_t	since;		/* frame waiting since, for stats */
+	struct sim_port	*next;
+};
+
+struct sim_bus_stats {
+	unsigned long	frames;
+	unsigned long	injected;	/* frames from sim_bus_inject() */
+	uint64_t	busy;		/* nsec */
+	uint64_t	wait;		/* nsec frames waited for the bus */
+	uint64_t	wait_max;
+};
+
+struct sim_bus {
+	char		*name;
+	unsigned long	bitrate;	/* set by the 82C200s on it */
+	struct sim_port	*ports;
+	struct sim_port	*cur;		/* sending, or NULL */
+	struct can_packet curpkt;
+	int		aborted;	/* sender was reset mid-frame */
+	int		kicked;		/* arbitration to come */
+	void		(*tap)(struct can_packet *pkt, void *arg);
+	void		*taparg;
+	struct sim_port	inject;
+	struct sim_inj	*inj;		/* from sim_bus_inject() */
+	struct sim_inj	**injtail;
+	struct sim_bus_stats stats;
+};
+
+extern struct sim_bus	sim_lcan;	/* the one the 82C200 starts on */
+
+extern void	sim_bus_attach(struct sim_bus *b, struct sim_port *p);
+extern void	sim_bus_detach(struct sim_port *p);
+extern void	sim_bus_request(struct sim_port *p);
+extern void	sim_bus_abort(struct sim_port *p);
+extern void	sim_bus_inject(struct sim_bus *b, const struct can_packet *pkt);
+extern void	sim_bus_tap(struct sim_bus *b,
+		    void (*fn)(struct can_packet *pkt, void *arg), void *arg);
+extern int	sim_can_id(const struct can_packet *pkt);
+extern uint64_t	sim_frame_nsec(struct sim_bus *b, const struct can_packet *pkt);
+
+/*
+ * The 82C200 (sim_82c200.c)
+ */
+struct sim_chip_stats {
+	unsigned long	reg_reads;	/* driver register accesses */
+	unsigned long	reg_writes;
+	unsigned long	interrupts;	/* times can_intr() was run */
+	unsigned long	tx_frames;	/* sent by the chip */
+	unsigned long	rx_frames;	/* passed the acceptance filter */
+	unsigned long	rx_rejected;	/* failed it */
+	unsigned long	rx_overruns;	/* lost to a full receive buffer */
+};
+
+extern unsigned long		sim_can_xtal;	/* oscillator, Hz */
+extern struct sim_bus		*sim_82c200_bus; /* set before sim_init() */
+extern struct sim_chip_stats	sim_chip;
+
+extern can_header_ext		sim_cancon_host; /* set before sim_init() */
+
+/*
+ * One node, as a harness with many sees it.  Each node is a copy of the
+ * driver and of everything here but the bus, with its own clock, and
+ * this is its table of entry points; a node's run() must not be asked
+ * to go back in time.  See the Makefile and bussim.c.
+ */
+struct sim_node {
+	int		(*init)(uint32_t nodeid);
+	void		(*fini)(void);
+	uint64_t	(*next)(void);		/* when it next has work */
+	void		(*run)(uint64_t until);
+	void		(*console)(const char *s);	/* printk */
+	struct file	*(*open)(int flags);
+	int		(*close)(struct file *f);
+	ssize_t		(*read)(struct file *f, void *buf, size_t count);
+	ssize_t		(*write)(struct file *f, const void *buf, size_t count);
+	int		(*ioctl)(struct file *f, unsigned int cmd, void *arg);
+	int		(*poll)(struct file *f, int events, uint64_t timeout);
+	void		*(*mmap)(struct file *f, size_t len);
+	int		(*page_fd)(void *addr, off_t *off);
+	uint64_t	*now;
+	int		*verbose;
+	long		*kmem_live;
+	struct sim_chip_stats *chip;
+	struct sim_bus	**bus;			/* sim_82c200_bus */
+	can_header_ext	*cancon_host;		/* sim_cancon_host */
+	struct task_struct **current;
+	int		(**sleep_hook)(uint64_t until, int (*woken)(void));
+	uint64_t	*sleep_limit;		/* sim_sleep_limit */
+};
+
+extern const struct sim_node sim_node;
+
+/* where the PROM says the chips are */
+#define SIM_CAN_PHYS	0x00200000
+#define SIM_ELAN_PHYS	0x00300000
+
+/* for sim.c */
+extern void	sim_prom_init(uint32_t nodeid);
+extern struct can_reg *sim_82c200_map(void);
+extern void	sim_82c200_unmap(void);
+extern int	sim_82c200_irq(void);
+
+#endif /* _SIM_H */
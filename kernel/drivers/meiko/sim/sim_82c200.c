@@ -0,0 +1,397 @@
+/*
+ * $Id$
+ *
+ * An emulated Philips 82C200 on a simulated CAN bus.
+ *
+ * The driver gets a register page it can't touch: every access faults.
+ * The fault handler opens the page up and single steps the access, then
+ * the trap handler closes it again and does what the chip would have done
+ * (a command written, control changed, the interrupt register read and so
+ * cleared).  We see the same page through a second mapping that doesn't
+ * fault.  This needs x86 Linux.
+ *
+ * The chip has two receive buffers and one transmit buffer, an
+ * acceptance filter on the first identifier byte, and raises the receive,
+ * transmit and overrun interrupts.  It doesn't model bus errors.  It is
+ * a port on sim_82c200_bus (sim_bus.c), and sets that bus's bit rate from
+ * its bus timing registers when it leaves reset mode.
+ *
+ * A harness with many nodes has a chip per node, each with its own
+ * handlers; a fault or trap that isn't ours goes to the handler that was
+ * there before us.  So chips must go away in the reverse of the order
+ * they came.
+ */
+
+#define _GNU_SOURCE		/* memfd_create(), REG_EFL */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "sim.h"
+
+#define RXBUF_MAX	2		/* receive buffers */
+#define FRAME_BYTES	10		/* 2 descriptor bytes, 8 data */
+
+#define EFL_TF		0x100		/* x86 trap flag */
+#define PF_WRITE	0x2		/* page fault error code: a write */
+
+#define REG(x)		offsetof(struct can_reg, x)
+
+#define TX_IDLE		0
+#define TX_PENDING	1		/* waiting for the bus */
+#define TX_ONBUS	2
+
+static struct {
+	struct can_reg	*trap;		/* the driver's view */
+	struct can_reg	*r;		/* ours */
+	uint8_t		control;	/* last value seen */
+	uint8_t		code;		/* acceptance code and mask */
+	uint8_t		mask;		/*   latched leaving reset mode */
+	uint8_t		rxbuf[RXBUF_MAX][FRAME_BYTES];
+	int		rxcount;
+	int		overrun;
+	struct can_packet txpkt;
+	int		txstate;
+	int		txdone;
+	int		access;		/* offset being single stepped */
+	int		write;
+	struct sim_port	port;
+	struct sigaction oldsegv;	/* who had the signals before us */
+	struct sigaction oldtrap;
+} chip;
+
+unsigned long		sim_can_xtal = 10000000;
+struct sim_bus		*sim_82c200_bus = &sim_lcan;
+struct sim_chip_stats	sim_chip;
+
+/*
+ * Frames: how the chip holds them, with the descriptor bytes first
+ */
+static void
+frame_to_pkt(const uint8_t *b, struct can_packet *pkt)
+{
+	memset(pkt, 0, sizeof(*pkt));
+	memcpy(pkt->can.can_b, b, 2);
+	memcpy(pkt->ext.ext_b, b + 2, 4);
+	memcpy(pkt->dat.dat_b, b + 6, 4);
+}
+
+static void
+pkt_to_frame(const struct can_packet *pkt, uint8_t *b)
+{
+	memcpy(b, pkt->can.can_b, 2);
+	memcpy(b + 2, pkt->ext.ext_b, 4);
+	memcpy(b + 6, pkt->dat.dat_b, 4);
+}
+
+/*
+ * A bit is 1 + TSEG1 + TSEG2 time quanta, each 2 * (BRP + 1) oscillator
+ * periods.
+ */
+static unsigned long
+btr_bitrate(uint8_t btr0, uint8_t btr1)
+{
+	int brp = (btr0 & 0x3f) + 1;
+	int tseg1 = (btr1 & 0x0f) + 1;
+	int tseg2 = ((btr1 >> 4) & 0x07) + 1;
+
+	return sim_can_xtal / (2 * brp * (1 + tseg1 + tseg2));
+}
+
+/*
+ * The chip
+ */
+static void
+chip_status(void)
+{
+	uint8_t s = 0;
+
+	if (chip.rxcount > 0)
+		s |= CAN_STATUS_RECV_AVAIL;
+	if (chip.overrun)
+		s |= CAN_STATUS_OVERRUN;
+	if (chip.txstate == TX_IDLE)
+		s |= CAN_STATUS_XMIT_AVAIL;
+	if (chip.txdone)
+		s |= CAN_STATUS_XMIT_DONE;
+	if (chip.port.bus != NULL && chip.port.bus->cur != NULL
+	    && chip.port.bus->cur != &chip.port)
+		s |= CAN_STATUS_RECV_STAT;
+	if (chip.txstate == TX_ONBUS)
+		s |= CAN_STATUS_XMIT_STAT;
+	chip.r->status = s;
+}
+
+static void
+chip_intr(uint8_t bit, uint8_t enable)
+{
+	if (chip.r->control & enable)
+		chip.r->interrupt |= bit;
+}
+
+/* put the oldest receive buffer in the receive registers */
+static void
+chip_rxload(void)
+{
+	uint8_t *b = chip.rxbuf[0];
+
+	chip.r->rxdb1 = b[0];
+	chip.r->rxdb2 = b[1];
+	chip.r->rx0 = b[2];
+	chip.r->rx1 = b[3];
+	chip.r->rx2 = b[4];
+	chip.r->rx3 = b[5];
+	chip.r->rx4 = b[6];
+	chip.r->rx5 = b[7];
+	chip.r->rx6 = b[8];
+	chip.r->rx7 = b[9];
+	chip_intr(CAN_INTR_RECV, CAN_CONTROL_RIE);
+}
+
+static void
+chip_receive(const struct can_packet *pkt)
+{
+	if (chip.r->control & CAN_CONTROL_RESET)
+		return;
+	if (((sim_can_id(pkt) >> 3) ^ chip.code) & ~chip.mask & 0xff) {
+		sim_chip.rx_rejected++;
+		return;
+	}
+	if (chip.rxcount == RXBUF_MAX) {
+		chip.overrun = 1;
+		sim_chip.rx_overruns++;
+		chip_intr(CAN_INTR_OVERRUN, CAN_CONTROL_OIE);
+		return;
+	}
+	pkt_to_frame(pkt, chip.rxbuf[chip.rxcount++]);
+	sim_chip.rx_frames++;
+	if (chip.rxcount == 1)
+		chip_rxload();
+}
+
+static void
+chip_command(uint8_t cmd)
+{
+	uint8_t b[FRAME_BYTES];
+
+	if (cmd & CAN_COMMAND_TRANSMIT && chip.txstate == TX_IDLE
+	    && !(chip.r->control & CAN_CONTROL_RESET)) {
+		b[0] = chip.r->txdb1;
+		b[1] = chip.r->txdb2;
+		b[2] = chip.r->tx0;
+		b[3] = chip.r->tx1;
+		b[4] = chip.r->tx2;
+		b[5] = chip.r->tx3;
+		b[6] = chip.r->tx4;
+		b[7] = chip.r->tx5;
+		b[8] = chip.r->tx6;
+		b[9] = chip.r->tx7;
+		frame_to_pkt(b, &chip.txpkt);
+		chip.txstate = TX_PENDING;
+		chip.txdone = 0;
+		chip.port.since = sim_now;
+		sim_bus_request(&chip.port);
+	}
+	if (cmd & CAN_COMMAND_TRANSABORT && chip.txstate == TX_PENDING)
+		chip.txstate = TX_IDLE;
+	if (cmd & CAN_COMMAND_CLR_RECV && chip.rxcount > 0) {
+		memmove(chip.rxbuf[0], chip.rxbuf[1],
+		    (RXBUF_MAX - 1) * FRAME_BYTES);
+		if (--chip.rxcount > 0)
+			chip_rxload();
+	}
+	if (cmd & CAN_COMMAND_CLR_OVERRUN)
+		chip.overrun = 0;
+}
+
+static void
+chip_control(uint8_t old, uint8_t new)
+{
+	/* entering reset mode stops whatever the chip was doing */
+	if (!(old & CAN_CONTROL_RESET) && new & CAN_CONTROL_RESET) {
+		chip.rxcount = 0;
+		chip.overrun = 0;
+		if (chip.txstate == TX_ONBUS)
+			sim_bus_abort(&chip.port);
+		chip.txstate = TX_IDLE;
+		chip.txdone = 1;
+		chip.r->interrupt = 0;
+	}
+	if (old & CAN_CONTROL_RESET && !(new & CAN_CONTROL_RESET)) {
+		chip.code = chip.r->accept_code;
+		chip.mask = chip.r->accept_mask;
+		if (chip.port.bus != NULL)
+			chip.port.bus->bitrate = btr_bitrate(
+			    chip.r->bus_timing0, chip.r->bus_timing1);
+	}
+	chip.control = new;
+}
+
+/* after the driver's access to the register at off */
+static void
+chip_access(int off, int write)
+{
+	if (write)
+		sim_chip.reg_writes++;
+	else
+		sim_chip.reg_reads++;
+	if (off == REG(command) && write) {
+		chip_command(chip.r->command);
+		chip.r->command = 0;
+	} else if (off == REG(control) && chip.r->control != chip.control) {
+		chip_control(chip.control, chip.r->control);
+	} else if (off == REG(interrupt) && !write) {
+		chip.r->interrupt = 0;
+	}
+	chip_status();
+}
+
+/* a signal that isn't ours */
+static void
+chip_chain(int sig, siginfo_t *si, void *ctx, struct sigaction *old)
+{
+	if (old->sa_flags & SA_SIGINFO)
+		old->sa_sigaction(sig, si, ctx);
+	else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN)
+		old->sa_handler(sig);
+	else
+		signal(sig, SIG_DFL);	/* a real one: take it again */
+}
+
+static void
+chip_segv(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	char *addr = si->si_addr;
+
+	if (chip.trap == NULL || addr < (char *)chip.trap
+	    || addr >= (char *)chip.trap + PAGE_SIZE) {
+		chip_chain(sig, si, ctx, &chip.oldsegv);
+		return;
+	}
+	chip.access = addr - (char *)chip.trap;
+	chip.write = (uc->uc_mcontext.gregs[REG_ERR] & PF_WRITE) != 0;
+	mprotect(chip.trap, PAGE_SIZE, PROT_READ | PROT_WRITE);
+	uc->uc_mcontext.gregs[REG_EFL] |= EFL_TF;
+}
+
+static void
+chip_trap(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = ctx;
+
+	if (chip.access == -1) {
+		chip_chain(sig, si, ctx, &chip.oldtrap);
+		return;
+	}
+	uc->uc_mcontext.gregs[REG_EFL] &= ~EFL_TF;
+	mprotect(chip.trap, PAGE_SIZE, PROT_NONE);
+	chip_access(chip.access, chip.write);
+	chip.access = -1;
+}
+
+/*
+ * On the bus
+ */
+static struct can_packet *
+chip_txpkt(struct sim_port *p)
+{
+	return chip.txstate == TX_PENDING ? &chip.txpkt : NULL;
+}
+
+static void
+chip_txdone(struct sim_port *p)
+{
+	chip.txstate = TX_IDLE;
+	chip.txdone = 1;
+	sim_chip.tx_frames++;
+	chip_intr(CAN_INTR_XMIT, CAN_CONTROL_TIE);
+	chip_status();
+}
+
+static void
+chip_rx(struct sim_port *p, struct can_packet *pkt)
+{
+	chip_receive(pkt);
+	chip_status();
+}
+
+static void
+chip_change(struct sim_port *p)
+{
+	if (p->bus->cur == p)
+		chip.txstate = TX_ONBUS;
+	chip_status();
+}
+
+/*
+ * Power up the chip and give the driver its registers.
+ */
+struct can_reg *
+sim_82c200_map(void)
+{
+	struct sigaction sa;
+	int fd;
+
+	if (chip.trap != NULL)
+		return NULL;
+	if ((fd = memfd_create("82c200", 0)) < 0)
+		return NULL;
+	if (ftruncate(fd, PAGE_SIZE) < 0) {
+		close(fd);
+		return NULL;
+	}
+	chip.r = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	chip.trap = mmap(NULL, PAGE_SIZE, PROT_NONE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (chip.r == MAP_FAILED || chip.trap == MAP_FAILED) {
+		printk("sim: can't map 82C200 registers\n");
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_SIGINFO;
+	sa.sa_sigaction = chip_segv;
+	sigaction(SIGSEGV, &sa, &chip.oldsegv);
+	sa.sa_sigaction = chip_trap;
+	sigaction(SIGTRAP, &sa, &chip.oldtrap);
+
+	chip.access = -1;
+	chip.control = CAN_CONTROL_RESET;
+	chip.r->control = chip.control;
+	chip.txstate = TX_IDLE;
+	chip.txdone = 1;
+	chip.port.txpkt = chip_txpkt;
+	chip.port.txdone = chip_txdone;
+	chip.port.rx = chip_rx;
+	chip.port.change = chip_change;
+	sim_bus_attach(sim_82c200_bus, &chip.port);
+	chip_status();
+	return chip.trap;
+}
+
+void
+sim_82c200_unmap(void)
+{
+	if (chip.trap == NULL)
+		return;
+	sim_bus_detach(&chip.port);
+	sigaction(SIGSEGV, &chip.oldsegv, NULL);
+	sigaction(SIGTRAP, &chip.oldtrap, NULL);
+	munmap(chip.trap, PAGE_SIZE);
+	munmap(chip.r, PAGE_SIZE);
+	memset(&chip, 0, sizeof(chip));
+}
+
+/* the chip's interrupt line */
+int
+sim_82c200_irq(void)
+{
+	return chip.trap != NULL && chip.r->interrupt != 0;
+}
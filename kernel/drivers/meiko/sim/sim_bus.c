@@ -0,0 +1,289 @@
+/*
+ * $Id$
+ *
+ * A simulated CAN bus segment.  Ports are the things on the bus: an
+ * emulated 82C200 (sim_82c200.c), the frames the harness injects, or a
+ * harness model such as an H8.  When the bus is free, every port with a
+ * frame waiting arbitrates, the lowest identifier wins, and the frame
+ * takes its length in bits at the bus bit rate.  Every other port then
+ * receives it.  A sender that is reset mid-frame leaves a frame nobody
+ * receives.  There are no bus errors.
+ *
+ * Frame length counts the stuff bits the frame's identifier, data and
+ * CRC need.  The data are the bytes in the chip's transmit buffer, which
+ * for the Meiko header are in host bitfield order, not sparc's, so the
+ * count is exact for the identifier and approximate for the rest.
+ *
+ * The bus runs on whatever clock sim_now and sim_at() are: the one node's
+ * in sim.c, or the world's when the harness has many nodes (bussim.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+struct sim_inj {
+	struct can_packet	pkt;
+	uint64_t		when;
+	struct sim_inj		*next;
+};
+
+struct sim_bus		sim_lcan = { "L-CAN", 500000 };
+
+static void	bus_arbitrate(void *arg);
+
+/* the 11 bit identifier, which arbitration and acceptance filters see */
+int
+sim_can_id(const struct can_packet *pkt)
+{
+	return (pkt->can.can.lpriority << 10) | (pkt->can.can.dest << 5)
+	    | pkt->can.can.src;
+}
+
+/*
+ * SOF, identifier, RTR, r1, r0, DLC, data and the 15 bit CRC are stuffed:
+ * after five equal bits the sender adds one of the other value.  Then
+ * the CRC delimiter, ACK, ACK delimiter, EOF and intermission are 13.
+ */
+static int
+frame_bits(const struct can_packet *pkt)
+{
+	uint8_t data[8];
+	int bits[34 + 64];
+	int len = pkt->can.can.length, id = sim_can_id(pkt);
+	int n = 0, i, run, last, stuff, crc = 0, crcnxt;
+
+	if (len > 8)
+		len = 8;
+	memcpy(data, pkt->ext.ext_b, 4);
+	memcpy(data + 4, pkt->dat.dat_b, 4);
+	bits[n++] = 0;
+	for (i = 10; i >= 0; i--)
+		bits[n++] = (id >> i) & 1;
+	bits[n++] = pkt->can.can.remote;
+	bits[n++] = 0;
+	bits[n++] = 0;
+	for (i = 3; i >= 0; i--)
+		bits[n++] = (len >> i) & 1;
+	for (i = 0; i < 8 * len; i++)
+		bits[n++] = (data[i / 8] >> (7 - i % 8)) & 1;
+	for (i = 0; i < n; i++) {
+		crcnxt = bits[i] ^ ((crc >> 14) & 1);
+		crc = (crc << 1) & 0x7fff;
+		if (crcnxt)
+			crc ^= 0x4599;
+	}
+	for (i = 14; i >= 0; i--)
+		bits[n++] = (crc >> i) & 1;
+
+	stuff = 0;
+	run = 0;
+	last = -1;
+	for (i = 0; i < n; i++) {
+		if (bits[i] == last)
+			run++;
+		else {
+			last = bits[i];
+			run = 1;
+		}
+		if (run == 5) {
+			/* the stuff bit starts a new run */
+			stuff++;
+			last = !last;
+			run = 1;
+		}
+	}
+	return n + stuff + 13;
+}
+
+uint64_t
+sim_frame_nsec(struct sim_bus *b, const struct can_packet *pkt)
+{
+	return frame_bits(pkt) * 1000000000ULL / b->bitrate;
+}
+
+/*
+ * Ports
+ */
+void
+sim_bus_attach(struct sim_bus *b, struct sim_port *p)
+{
+	struct sim_port **pp;
+
+	for (pp = &b->ports; *pp != NULL; pp = &(*pp)->next)
+		;
+	p->bus = b;
+	p->next = NULL;
+	*pp = p;
+}
+
+void
+sim_bus_detach(struct sim_port *p)
+{
+	struct sim_bus *b = p->bus;
+	struct sim_port **pp;
+
+	if (b == NULL)
+		return;
+	if (b->cur == p)
+		b->aborted = 1;
+	for (pp = &b->ports; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == p) {
+			*pp = p->next;
+			break;
+		}
+	}
+	p->bus = NULL;
+}
+
+/*
+ * p has a frame to send, waiting since p->since.  If the bus is free, it
+ * arbitrates once everything else that happens now has happened, so
+ * that frames queued at the same moment contend.
+ */
+void
+sim_bus_request(struct sim_port *p)
+{
+	struct sim_bus *b = p->bus;
+
+	if (b == NULL || b->cur != NULL || b->kicked)
+		return;
+	b->kicked = 1;
+	sim_at(sim_now, bus_arbitrate, b);
+}
+
+/* p stopped sending: what is on the bus is lost */
+void
+sim_bus_abort(struct sim_port *p)
+{
+	if (p->bus != NULL && p->bus->cur == p)
+		p->bus->aborted = 1;
+}
+
+static void
+bus_change(struct sim_bus *b)
+{
+	struct sim_port *p;
+
+	for (p = b->ports; p != NULL; p = p->next)
+		if (p->change != NULL)
+			p->change(p);
+}
+
+static void
+bus_end(void *arg)
+{
+	struct sim_bus *b = arg;
+	struct sim_port *p, *from = b->cur;
+
+	b->cur = NULL;
+	if (!b->aborted) {
+		b->stats.frames++;
+		from->txdone(from);
+		for (p = b->ports; p != NULL; p = p->next)
+			if (p != from && p->rx != NULL)
+				p->rx(p, &b->curpkt);
+		if (b->tap != NULL)
+			b->tap(&b->curpkt, b->taparg);
+	}
+	bus_change(b);
+	bus_arbitrate(b);
+}
+
+/* if the bus is free, start the frame that wins arbitration */
+static void
+bus_arbitrate(void *arg)
+{
+	struct sim_bus *b = arg;
+	struct sim_port *p, *win = NULL;
+	struct can_packet *pkt, *winpkt = NULL;
+	uint64_t nsec, wait;
+
+	b->kicked = 0;
+	if (b->cur != NULL)
+		return;
+	for (p = b->ports; p != NULL; p = p->next) {
+		if ((pkt = p->txpkt(p)) == NULL)
+			continue;
+		if (win == NULL || sim_can_id(pkt) < sim_can_id(winpkt)) {
+			win = p;
+			winpkt = pkt;
+		}
+	}
+	if (win == NULL)
+		return;
+	b->cur = win;
+	b->curpkt = *winpkt;
+	b->aborted = 0;
+	wait = sim_now - win->since;
+	b->stats.wait += wait;
+	if (wait > b->stats.wait_max)
+		b->stats.wait_max = wait;
+	nsec = sim_frame_nsec(b, winpkt);
+	b->stats.busy += nsec;
+	sim_at(sim_now + nsec, bus_end, b);
+	bus_change(b);
+}
+
+/*
+ * Frames from nowhere in particular, sent in order as the bus allows.
+ */
+static struct can_packet *
+inj_txpkt(struct sim_port *p)
+{
+	struct sim_bus *b = p->bus;
+
+	return b->inj != NULL ? &b->inj->pkt : NULL;
+}
+
+static void
+inj_txdone(struct sim_port *p)
+{
+	struct sim_bus *b = p->bus;
+	struct sim_inj *i = b->inj;
+
+	if ((b->inj = i->next) != NULL) {
+		p->since = b->inj->when;
+		sim_bus_request(p);
+	} else
+		b->injtail = &b->inj;
+	free(i);
+}
+
+void
+sim_bus_inject(struct sim_bus *b, const struct can_packet *pkt)
+{
+	struct sim_inj *i;
+
+	if (b->inject.txpkt == NULL) {
+		b->inject.txpkt = inj_txpkt;
+		b->inject.txdone = inj_txdone;
+		b->injtail = &b->inj;
+		sim_bus_attach(b, &b->inject);
+	}
+	if ((i = malloc(sizeof(*i))) == NULL) {
+		fprintf(stderr, "sim_bus_inject: out of memory\n");
+		abort();
+	}
+	i->pkt = *pkt;
+	i->when = sim_now;
+	i->next = NULL;
+	*b->injtail = i;
+	b->injtail = &i->next;
+	b->stats.injected++;
+	if (b->inj == i) {
+		b->inject.since = sim_now;
+		sim_bus_request(&b->inject);
+	}
+}
+
+void
+sim_bus_tap(struct sim_bus *b, void (*fn)(struct can_packet *pkt, void *arg),
+    void *arg)
+{
+	b->tap = fn;
+	b->taparg = arg;
+}
+
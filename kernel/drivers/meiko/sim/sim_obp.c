@@ -0,0 +1,178 @@
+/*
+ * $Id$
+ *
+ * The PROM as the CAN driver sees it: a device tree with just the nodes
+ * and properties it looks up, and I/O space with just the 82C200 in it.
+ *
+ * This is also where the out of line copies of the obp.h functions come
+ * from, for calls gcc doesn't inline: this file is built with C99 inline
+ * semantics, so their "extern __inline__" definitions are emitted here.
+ */
+
+#include "sim.h"
+#include <asm/meiko/obp.h>
+
+#define NODE_ROOT	1
+#define NODE_OPTIONS	2
+#define NODE_OBIO	3
+#define NODE_CAN	4
+#define NODE_ELAN	5
+
+/* node 0 is no node */
+static struct {
+	char	*name;
+	int	parent;
+} nodes[] = {
+	{ NULL,		0 },
+	{ "",		0 },
+	{ "options",	NODE_ROOT },
+	{ "obio",	NODE_ROOT },
+	{ "can",	NODE_OBIO },
+	{ "elan",	NODE_CAN },
+};
+#define NODE_COUNT	(sizeof(nodes) / sizeof(nodes[0]))
+
+static struct {
+	int	node;
+	char	*name;
+	char	val[OBP_MAXSTR];
+	int	len;
+} props[] = {
+	{ NODE_OPTIONS,	"auto-boot?",		"true",		5 },
+	{ NODE_OPTIONS,	"boot-device",		"disk",		5 },
+	{ NODE_OPTIONS,	"input-device",		"keyboard",	9 },
+	{ NODE_OPTIONS,	"output-device",	"screen",	7 },
+	{ NODE_OPTIONS,	"cancon-host",		"",		1 },
+	{ NODE_CAN,	"reg",			"",		0 },
+	{ NODE_CAN,	"can-nodeid",		"",		0 },
+	{ NODE_CAN,	"can-meiko-board-type",	"",		0 },
+	{ NODE_ELAN,	"reg",			"",		0 },
+};
+#define PROP_COUNT	(sizeof(props) / sizeof(props[0]))
+
+int prom_root_node = NODE_ROOT;
+
+/* no console connection, as can_console.c leaves it */
+can_header_ext sim_cancon_host = {
+	ext: { cluster: 0x3f, module: 0x3f, node: 0x3f }
+};
+
+static int
+prom_findprop(int node, char *name)
+{
+	int i;
+
+	for (i = 0; i < PROP_COUNT; i++)
+		if (props[i].node == node && strcmp(props[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+static void
+prom_setbin(int node, char *name, void *val, int len)
+{
+	int i = prom_findprop(node, name);
+
+	memcpy(props[i].val, val, len);
+	props[i].len = len;
+}
+
+/*
+ * Fill in the properties that depend on the node, and cancon-host from
+ * sim_cancon_host.  Binary properties
+ * are in host byte order, as the driver reads them straight into its
+ * variables.
+ */
+void
+sim_prom_init(uint32_t nodeid)
+{
+	struct linux_prom_registers canreg = { 0, SIM_CAN_PHYS, PAGE_SIZE };
+	struct linux_prom_registers elanreg = { 0, SIM_ELAN_PHYS, PAGE_SIZE };
+	uint32_t boardtype = 0;
+	int i;
+
+	prom_setbin(NODE_CAN, "reg", &canreg, sizeof(canreg));
+	prom_setbin(NODE_CAN, "can-nodeid", &nodeid, sizeof(nodeid));
+	prom_setbin(NODE_CAN, "can-meiko-board-type", &boardtype,
+	    sizeof(boardtype));
+	prom_setbin(NODE_ELAN, "reg", &elanreg, sizeof(elanreg));
+
+	i = prom_findprop(NODE_OPTIONS, "cancon-host");
+	props[i].len = sprintf(props[i].val, "%lu", 
+	    (unsigned long)sim_cancon_host.ext_dat) + 1;
+}
+
+int
+prom_node_has_property(int node, char *name)
+{
+	return prom_findprop(node, name) != -1;
+}
+
+int
+prom_getchild(int node)
+{
+	int i;
+
+	for (i = 1; i < NODE_COUNT; i++)
+		if (nodes[i].parent == node)
+			return i;
+	return -1;
+}
+
+/* node and the siblings after it */
+int
+prom_searchsiblings(int node, char *name)
+{
+	int i;
+
+	if (node <= 0 || node >= NODE_COUNT)
+		return 0;
+	for (i = node; i < NODE_COUNT; i++)
+		if (nodes[i].parent == nodes[node].parent
+		    && strcmp(nodes[i].name, name) == 0)
+			return i;
+	return 0;
+}
+
+int
+prom_getproperty(int node, char *name, char *buf, int size)
+{
+	int i = prom_findprop(node, name);
+
+	if (i == -1)
+		return -1;
+	memcpy(buf, props[i].val, props[i].len < size ? props[i].len : size);
+	return props[i].len;
+}
+
+int
+prom_setprop(int node, char *name, char *buf, int size)
+{
+	int i = prom_findprop(node, name);
+
+	if (i == -1 || size > OBP_MAXSTR)
+		return -1;
+	memcpy(props[i].val, buf, size);
+	props[i].len = size;
+	return size;
+}
+
+void
+prom_apply_obio_ranges(struct linux_prom_registers *r, int n)
+{
+}
+
+void *
+sparc_alloc_io(unsigned int phys, void *virt, int len, char *name,
+		unsigned int bus, int rdonly)
+{
+	if (phys == SIM_CAN_PHYS && len <= PAGE_SIZE)
+		return sim_82c200_map();
+	return NULL;
+}
+
+void
+sparc_free_io(void *va, int len)
+{
+	sim_82c200_unmap();
+}
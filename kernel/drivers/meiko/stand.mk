@@ -15,8 +15,13 @@ elan.o: elan.c
 can.o: $(CAN_OBJ)
 	ld -r -o $@ $(CAN_OBJ)
 
+# user space build against an emulated 82C200, and its benchmark
+sim:
+	$(MAKE) -C sim test
+
 inst:
 	cp ../../include/asm-sparc/meiko/*.h /usr/include/asm/meiko
 
 clean:
 	rm -f *.o
+	$(MAKE) -C sim clean
@@ -16,6 +16,21 @@
 #define CAN_CLR_DEBUG		_IO('b', 53)
 #define CAN_SET_SNOOPY		_IO('b', 54)
 #define CAN_CLR_SNOOPY		_IO('b', 55)
+#define CAN_GET_OVERRUNS	_IOR('b', 56, unsigned long)
+#define CAN_SUBSCRIBE		_IOW('b', 57, struct can_subscription)
+#define CAN_UNSUBSCRIBE		_IO('b', 58)
+#define CAN_GET_SUBSCRIPTION	_IOR('b', 59, struct can_subscription)
+#define CAN_SET_FILTER		_IOW('b', 60, struct can_filter)
+#define CAN_CLR_FILTER		_IO('b', 61)
+#define CAN_SET_TXRATE		_IOW('b', 62, unsigned long)
+#define CAN_GET_TXRATE		_IOR('b', 63, unsigned long)
+#define CAN_GET_STATS		_IOR('b', 64, struct can_stats)
+#define CAN_SET_FORMAT		_IOW('b', 65, int)
+#define CAN_GET_FORMAT		_IOR('b', 66, int)
+#define CAN_SET_RXPOLL		_IOW('b', 67, unsigned long)
+#define CAN_GET_RXPOLL		_IOR('b', 68, unsigned long)
+#define CAN_TRANSACT		_IOWR('b', 69, struct can_transact)
+#define CAN_TRANSACT_V		_IOW('b', 70, struct can_transact_v)
 
 #define HB_RESET          0x00      /* held in reset                   */
 #define HB_ROM_RUNNING    0x01      /* at 'OK'                         */
@@ -150,6 +165,58 @@ struct can_packet {
 	can_dat		dat;		/* payload */
 };
 
+/*
+ * What read(2) returns after CAN_SET_FORMAT selects CAN_FORMAT_2: the
+ * packet plus the elan clock (ns since boot) when the driver received or 
+ * sent it.  The default is CAN_FORMAT_1 (struct can_packet).  write(2) 
+ * always takes struct can_packet.
+ */
+#define CAN_FORMAT_1		1
+#define CAN_FORMAT_2		2
+
+struct can_packet_v2 {
+	uint64_t		nsec;	/* elan clock */
+	struct can_packet	pkt;	/* pkt.timestamp is still jiffies */
+};
+
+/*
+ * CAN_TRANSACT sends an RO, WO or DAT request and waits in the driver for 
+ * the ACK/NAK that answers it.  The request is sent again on a NAK, or if 
+ * no answer comes within timeout msec, up to 'retries' more times.  The 
+ * driver builds the CAN header from req.  On return, status says how the
+ * last attempt ended and ack/acklen hold the answer's payload.  The answer
+ * is not queued for read(2).
+ *
+ * CAN_TRANSACT_V does the same for a vector of up to CAN_TRANSACT_MAX 
+ * transactions, keeping as many in flight at once as the driver's queues 
+ * allow, except that two for the same object on the same node (which 
+ * their ACK/NAKs couldn't tell apart) go one after the other.
+ */
+#define CAN_TRANSACT_PENDING	0
+#define CAN_TRANSACT_ACK	1
+#define CAN_TRANSACT_NAK	2
+#define CAN_TRANSACT_TIMEDOUT	3
+
+struct can_transact {
+	can_header_ext	req;		/* request */
+	can_dat		dat;		/* request payload */
+	int		len;		/* and its length */
+	int		timeout;	/* msec, per attempt */
+	int		retries;	/* attempts after the first */
+	int		status;		/* returned: CAN_TRANSACT_* */
+	int		tries;		/* returned: attempts made */
+	can_dat		ack;		/* returned: answer payload */
+	int		acklen;		/* and its length */
+	unsigned long	latency;	/* returned: usec, last attempt */
+};
+
+#define CAN_TRANSACT_MAX	256
+
+struct can_transact_v {
+	struct can_transact	*v;
+	int			n;
+};
+
 /*
  * It is sketchy business depending on compiler-dependent struct alignment!
  * Not only do the individual header bytes have to be aligned properly,
@@ -171,10 +238,144 @@ can_checkalign(void)
 	return 0;
 }
 
+/*
+ * Object subscription, set with the CAN_SUBSCRIBE ioctl.  A subscribed fd 
+ * receives only packets whose object is in objs, whose type is in types 
+ * (a mask of 1 << CANTYPE_*, 0 means any), and, if npeers > 0, whose 
+ * extended header cluster, module and node match one of peers.  An 
+ * unsubscribed fd receives everything addressed to this node.
+ */
+#define CAN_SUB_MAXPEERS	8
+#define CAN_SUB_OBJWORDS	(1024 / 32)	/* object ID is 10 bits */
+
+struct can_subscription {
+	uint32_t	types;
+	uint32_t	npeers;
+	can_header_ext	peers[CAN_SUB_MAXPEERS];
+	uint32_t	objs[CAN_SUB_OBJWORDS];
+};
+
+#define CAN_SUB_SETOBJ(s, o)	((s)->objs[(o) / 32] |= (1 << ((o) % 32)))
+#define CAN_SUB_CLROBJ(s, o)	((s)->objs[(o) / 32] &= ~(1 << ((o) % 32)))
+#define CAN_SUB_ISSET(s, o)	((s)->objs[(o) / 32] & (1 << ((o) % 32)))
+
+/*
+ * Packet filter program, installed on an fd with CAN_SET_FILTER.  A small
+ * accumulator machine in the style of BPF: load a header field or payload
+ * byte into A, test A against a constant and jump forward, return a verdict
+ * (nonzero accepts the packet).  Programs are checked when installed:
+ * jumps must go forward and stay in the program and the last instruction 
+ * must be a RET, so every program terminates.
+ */
+#define CAN_FILTER_MAXINSNS	64
+
+#define CANF_LD			0x01	/* A = header field k (CANF_F_*) */
+#define CANF_LDB		0x02	/* A = payload byte k */
+#define CANF_AND		0x03	/* A &= k */
+#define CANF_JEQ		0x10	/* if (A == k) skip jt else skip jf */
+#define CANF_JGT		0x11	/* if (A > k) ... */
+#define CANF_JGE		0x12	/* if (A >= k) ... */
+#define CANF_JSET		0x13	/* if (A & k) ... */
+#define CANF_RET		0x20	/* return k */
+
+#define CANF_F_LPRIORITY	0	/* can_header fields */
+#define CANF_F_DEST		1
+#define CANF_F_SRC		2
+#define CANF_F_LENGTH		3
+#define CANF_F_XPRIORITY	4	/* can_header_ext fields */
+#define CANF_F_TYPE		5
+#define CANF_F_CLUSTER		6
+#define CANF_F_MODULE		7
+#define CANF_F_NODE		8
+#define CANF_F_OBJECT		9
+#define CANF_F_DAT		10	/* payload as a 32 bit word */
+#define CANF_F_MAX		11
+
+struct can_filter_insn {
+	uint16_t	code;
+	uint8_t		jt;		/* insns to skip if true */
+	uint8_t		jf;		/* insns to skip if false */
+	uint32_t	k;
+};
+
+struct can_filter {
+	uint32_t		len;	/* insns used */
+	struct can_filter_insn	insns[CAN_FILTER_MAXINSNS];
+};
+
+#define CANF_STMT(code, k)		{ (code), 0, 0, (k) }
+#define CANF_JUMP(code, k, jt, jf)	{ (code), (jt), (jf), (k) }
+
+/*
+ * Receive ring shared with user space by mmap(2) of CAN_MMAP_SIZE bytes of
+ * /dev/can at offset 0.  The driver stores packets at head and then 
+ * advances it; the reader takes packets at tail and then advances it.
+ * Empty is head == tail, full is head + 1 == tail (modulo CAN_MMAP_SLOTS).
+ * Packets that arrive while the ring is full are counted in overruns.
+ */
+#define CAN_MMAP_SIZE		(4 * 4096)
+#define CAN_MMAP_SLOTS		(CAN_MMAP_SIZE / sizeof(struct can_packet) - 1)
+
+struct can_mmap_ring {
+	volatile uint32_t	head;		/* written by driver */
+	volatile uint32_t	tail;		/* written by reader */
+	volatile uint32_t	overruns;	/* written by driver */
+	uint32_t		size;		/* CAN_MMAP_SLOTS */
+	struct can_packet	pkt[CAN_MMAP_SLOTS];
+};
+
+/*
+ * Driver statistics, from the CAN_GET_STATS ioctl or /proc/can/stats.
+ * Counters only ever go up (modulo wrap).  rx_type and rx_obj count every
+ * packet the bottom half delivers: received, sent to ourselves, and the 
+ * copies of sent packets kept for snoopers.
+ */
+#define CAN_STATS_NTYPES	8		/* type is 3 bits */
+#define CAN_STATS_NOBJS		1024		/* object is 10 bits */
+#define CAN_STATS_NTXQ		3		/* control, heartbeat, bulk */
+
+struct can_stats {
+	unsigned long	rx_packets;		/* received from the bus */
+	unsigned long	tx_packets;		/* loaded into the transmitter */
+	unsigned long	rx_type[CAN_STATS_NTYPES];	/* delivered */
+	unsigned long	tx_type[CAN_STATS_NTYPES];	/* transmitted */
+	unsigned long	inq_drops;		/* lost to a full inq */
+	unsigned long	txq_drops[CAN_STATS_NTXQ]; /* kernel sends lost */
+	unsigned long	fd_overruns;		/* lost to slow readers */
+	unsigned long	chip_overruns;		/* 82C200 receive overruns */
+	unsigned long	bus_errors;		/* error status interrupts */
+	unsigned long	bus_status;		/* bus status interrupts */
+	unsigned long	resets;			/* interrupts in reset mode */
+	unsigned long	bh_runs;		/* bottom half runs */
+	unsigned long	inq_maxdepth;		/* packets */
+	unsigned long	txq_maxdepth[CAN_STATS_NTXQ];
+	unsigned long	ackwait_overflow;	/* requests not tracked */
+	unsigned long	rxpoll_enter;		/* switches to polled receive */
+	unsigned long	rxpoll_exit;		/* and back to interrupts */
+	unsigned long	rxpoll_packets;		/* received while polling */
+	unsigned long	bh_latency_max;		/* usec, stamp to delivery */
+	unsigned long	bh_latency_total;	/* usec, over all delivered */
+	unsigned long	accept_changes;		/* acceptance filter rewrites */
+	unsigned long	loopback_packets;	/* sent to self, not via inq */
+	unsigned long	rx_obj[CAN_STATS_NOBJS];	/* delivered */
+};
+
 #ifdef __KERNEL__
 
+#include <asm/semaphore.h>		/* for struct file_state */
+
 #define CAN_MAX_USECOUNT	256
 
+/*
+ * Adaptive receive.  When more than the CAN_SET_RXPOLL rate (packets/s, 
+ * 0 = never) arrive in an RXPOLL_WINDOW, the receive interrupt is masked 
+ * and the bottom half polls the chip, up to RXPOLL_BUDGET packets a pass,
+ * until a poll finds it empty.
+ */
+#define RXPOLL_WINDOW		(HZ / 10)
+#define RXPOLL_BUDGET		64
+#define CAN_MMAP_ORDER		2		/* log2(CAN_MMAP_SIZE/PAGE_SIZE) */
+
 #define MAX_RXBUF 16
 #define MAX_TXBUF 16
 
@@ -186,27 +387,26 @@ can_checkalign(void)
  * Ringbuf data structure.  We write at the element pointed to
  * by head, and read at the element pointed to by tail.  Empty is defined
  * as head == tail, full as tail = head + 1 (modulo wrap).
+ *
+ * A ring is safe without locks for one producer and one consumer, which
+ * may run on different CPUs: only the producer writes head and only the 
+ * consumer writes tail, and RING_IN/RING_OUT order the element copy 
+ * against the index update.  Rings with more than one producer or 
+ * consumer must serialize them some other way (see pktq_t below).
  */
 #define MAXRING 1024
 
 typedef struct {
         struct can_packet buf[MAXRING];
-        int head;
-        int tail;
-	spinlock_t inlock;
-	int use_inlock;
-	spinlock_t outlock;
-	int use_outlock;
+        volatile int head;
+        volatile int tail;
+	unsigned long drops;		/* written by producer */
 } ringbuf_t;
 
 typedef struct {
         char buf[MAXRING];
-        int head;
-        int tail;
-	spinlock_t inlock;
-	int use_inlock;
-	spinlock_t outlock;
-	int use_outlock;
+        volatile int head;
+        volatile int tail;
 } cringbuf_t;
 
 #define RING_NEXT(n)    (((n) + 1) % MAXRING)
@@ -218,35 +418,152 @@ typedef struct {
     : (rb).tail - (rb).head - 1)
 
 #define RING_INIT(rb) \
-    { (rb).head = (rb).tail = (rb).use_inlock = (rb).use_outlock = 0; }
-#define RING_CLEAR(rb) \
     { (rb).head = (rb).tail = 0; }
-#define RING_INIT_INLOCK(rb) \
-    { (rb).use_inlock = 1; (rb).inlock = SPIN_LOCK_UNLOCKED; }
-#define RING_INIT_OUTLOCK(rb) \
-    { (rb).use_outlock = 1; (rb).outlock = SPIN_LOCK_UNLOCKED; }
+#define RING_CLEAR(rb) \
+    { (rb).tail = (rb).head; }		/* consumer side */
 
 #define RING_HEAD(rb)	((rb).buf[(rb).head])
 #define RING_TAIL(rb)	((rb).buf[(rb).tail])
 #define RING_TAILPP(rb) (rb).tail = RING_NEXT((rb).tail)
 #define RING_HEADPP(rb) (rb).head = RING_NEXT((rb).head)
 
-#define RING_IN(rb, x)	{ RING_HEAD(rb) = x; RING_HEADPP(rb); }
-#define RING_OUT(rb, x)	{ x = RING_TAIL(rb); RING_TAILPP(rb); }
+/* producer: fill the slot before publishing it */
+#define RING_IN(rb, x)	{ RING_HEAD(rb) = x; wmb(); RING_HEADPP(rb); }
+/* consumer: see the slot after head, empty it before releasing it */
+#define RING_OUT(rb, x)	{ rmb(); x = RING_TAIL(rb); mb(); RING_TAILPP(rb); }
 
 #define RING_SIZE(rb) \
     (((rb).head-(rb).tail) >= 0 ? ((rb).head-(rb).tail) \
         : (MAXRING-(rb).tail+(rb).head))
 
+/* 
+ * Bulk access.  RING_SPAN_OUT is the number of full slots from tail to 
+ * head or the end of buf, RING_SPAN_IN the number of free slots from head 
+ * to tail or the end of buf.  Anything in the ring is at most two spans.
+ * The producer fills a span, wmb()'s, then RING_HEADADD's; the consumer
+ * rmb()'s, empties a span, mb()'s, then RING_TAILADD's.
+ */
+#define RING_SPAN_OUT(rb) \
+    ((rb).head >= (rb).tail ? (rb).head - (rb).tail : MAXRING - (rb).tail)
+#define RING_SPAN_IN(rb) \
+    ((rb).tail > (rb).head ? (rb).tail - (rb).head - 1 \
+        : MAXRING - (rb).head - ((rb).tail == 0))
+#define RING_HEADADD(rb, n) (rb).head = ((rb).head + (n)) % MAXRING
+#define RING_TAILADD(rb, n) (rb).tail = ((rb).tail + (n)) % MAXRING
+
+/*
+ * Packet queue: one SPSC ring per producer (CPU, context) pair, merged 
+ * by the consumer.  See pkt_to_ring() in can_main.c.
+ */
+#ifdef __SMP__
+#define CAN_NR_CPUS	4		/* sun4m MBus module ids are 0-3 */
+#else
+#define CAN_NR_CPUS	1
+#endif
+#define CTX_PROCESS	0		/* system calls */
+#define CTX_INTR	1		/* interrupts, bottom halves, timers */
+#define CTX_MAX		2
+#define PKTQ_NRING	(CTX_MAX * CAN_NR_CPUS)
+
+typedef struct {
+	ringbuf_t	*ring[PKTQ_NRING];
+	int		next;		/* consumer's merge position */
+} pktq_t;
+
+/* transmit classes, highest priority first */
+#define TXQ_CTRL	0		/* ACK/NAK */
+#define TXQ_HB		1		/* heartbeat, IAM */
+#define TXQ_BULK	2		/* everything else */
+#define TXQ_MAX		3
+
+/*
+ * Bulk packets written by user space wait in per-fd transmit rings, 
+ * served deficit round-robin with the kernel's own bulk packets.  A 
+ * packet costs its length on the wire; each visit to an fd adds 
+ * TXQ_QUANTUM to its deficit.  An fd may also be capped at txrate packets 
+ * per second, with a burst of TXQ_BURST packets.
+ */
+#define TXQ_COST(pkt)	(sizeof(can_header) + (pkt)->can.can.length)
+#define TXQ_QUANTUM	(sizeof(can_header) + 8)	/* one largest packet */
+#define TXQ_BURST	8
+
+/*
+ * Receive log.  Each packet bound for user space is stored once in a
+ * kernel-wide log, which open files read through their own cursors.
+ * Entries are numbered by a free running sequence number; a reader that
+ * falls RXLOG_SIZE - 1 entries behind loses the oldest ones (overrun).
+ */
+#define RXLOG_SIZE		1024		/* must be a power of 2 */
+#define RXLOG_SLOT(seq)		((seq) & (RXLOG_SIZE - 1))
+
+/*
+ * Subscriber index: one list per object of the fd's subscribed to it.
+ */
+struct can_subidx {
+	struct file_state	*fs;
+	struct can_subidx	*next;
+};
+
+/*
+ * Outstanding RO/WO/DAT requests written by user space, so the bottom half
+ * can route the ACK/NAK back to the fd (or CAN_TRANSACT) that sent it.  Requests 
+ * are keyed by object and target address (see ACKWAIT_KEY).
+ */
+#define ACKWAIT_MAX		1024
+#define ACKWAIT_HASH		128		/* must be a power of 2 */
+#define ACKWAIT_TIMEOUT		(5*HZ)
+
+#define ACKWAIT_KEY(e)		(((e).ext.object << 18) | ((e).ext.cluster << 12) \
+				| ((e).ext.module << 6) | (e).ext.node)
+#define ACKWAIT_BUCKET(key)	((key) & (ACKWAIT_HASH - 1))
+
+struct can_ackwait {
+	uint32_t		key;
+	unsigned long		expires;	/* jiffies */
+	struct file_state	*fs;
+	struct can_xact		*xact;		/* CAN_TRANSACT, or NULL */
+	struct can_ackwait	*next;
+};
+
+/* a transaction its CAN_TRANSACT caller is waiting on */
+struct can_xact {
+	struct wait_queue	**waitq;	/* where the caller sleeps */
+	int			done;		/* set by the bottom half */
+	struct can_packet	reply;		/* ditto */
+	uint64_t		nsec;		/* ditto, elan clock */
+	struct can_packet	req;
+	uint32_t		key;		/* ACKWAIT_KEY(req.ext) */
+	int			inflight;
+	unsigned long		expires;	/* jiffies */
+	uint64_t		sent;		/* elan clock */
+};
+
 /* 
  * State that is kept per open file.  
  */
 struct file_state {
-	ringbuf_t inq;
+	unsigned long id;		/* unique, for routing ACK/NAKs */
+	unsigned long rxseq;		/* next receive log entry to read */
+	unsigned long overruns;		/* entries lost to log wrap */
+	unsigned long lost;		/* overruns, never cleared */
+	int format;			/* CAN_FORMAT_1 or CAN_FORMAT_2 */
+	struct can_mmap_ring *ring;	/* mmapped receive ring (or NULL) */
+	uint32_t ringhead;		/* driver's copy of ring->head */
+	struct can_subscription *sub;	/* object subscription (or NULL) */
+	struct can_filter *filter;	/* packet filter program (or NULL) */
+	unsigned long *filtpass;	/* filter verdict per rxlog slot */
+	unsigned long filtseq;		/* first entry filtpass covers */
+	struct wait_queue *readq;	/* woken for packets routed to us */
+	ringbuf_t *txq;			/* transmit ring (or NULL) */
+	struct semaphore txsem;		/* serializes writers of txq */
+	struct wait_queue *writeq;	/* woken when txq drains */
+	int txdeficit;			/* DRR deficit, bytes */
+	unsigned long txrate;		/* cap, packets/s (0 = none) */
+	unsigned long txtokens;		/* rate cap bucket, HZ per packet */
+	unsigned long txstamp;		/* jiffies txtokens last filled */
 	int promiscuous;
 	int snoopy;
 	int consobj;
-	struct wait_queue *readq;
 };			
 
 #define DINO1_CANCON_MINOR 128		/* major = tty (4) */
@@ -23,10 +23,19 @@ typedef struct {
 	uint32_t		_pad6;
 } elanreg_t;
 
+/* 
+ * The clock register, as a sparc struct timespec.  Spelt out, so that
+ * code built for a host whose struct timespec is bigger reads it right.
+ */
+typedef struct {
+	uint32_t		tv_sec;
+	uint32_t		tv_nsec;
+} elanclock_t;
+
 static __inline__ uint64_t
 elan_getclock(elanreg_t *reg, struct timespec *tsp)
 {
-	struct timespec ts;
+	elanclock_t ts;
 
 	/* read tv_sec & tv_usec atomically - ldd */
 	*(uint64_t *)&ts = reg->clock;
@@ -98,7 +98,8 @@ obp_lookup(char *path)
 		return -1;
 	if (*path == '/')
 		path++;
-	strncpy(path_cpy, path, OBP_MAX_PATHLEN + 1);
+	strncpy(path_cpy, path, OBP_MAX_PATHLEN);
+	path_cpy[OBP_MAX_PATHLEN] = '\0';
 	return __obp_lookup(prom_root_node, path_cpy);
 }
 
@@ -138,9 +139,10 @@ obp_setprop(char *path, void *buf, size_t size)
 
 /*
  * These function use Meiko CAN encodings to get/set properties.
+ * Static, like the conversions they call.
  */
 
-extern __inline__ int
+static __inline__ int
 obp_getcan(char *path, char *table[], u32 *val)
 {
 	char str[OBP_MAXSTR];
@@ -151,7 +153,7 @@ obp_getcan(char *path, char *table[], u32 *val)
 	return 0;
 }
 
-extern __inline__ int
+static __inline__ int
 obp_setcan(char *path, char *table[], int val)
 {
 	char *str = obp_numtostr(val, table);